@@ -0,0 +1,639 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#endif
+
+#include "arm_cpu.h"
+#include "arm_elf.h"
+#include "arm_aio.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Raw io_uring: a submission ring, a completion ring and the
+   submission entries, all shared with the kernel */
+struct arm32_aio_ring
+{
+  int fd;
+
+  void  *sq_map;
+  size_t sq_map_size;
+  void  *cq_map;
+  size_t cq_map_size;
+
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  uint32_t *sq_tail;
+  uint32_t *sq_mask;
+  uint32_t *sq_array;
+
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static void
+arm32_aio_ring_destroy (struct arm32_aio_ring *ring)
+{
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_size);
+
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_map_size);
+
+  if (ring->sq_map != NULL)
+    munmap (ring->sq_map, ring->sq_map_size);
+
+  close (ring->fd);
+
+  free (ring);
+}
+
+static void *
+arm32_aio_ring_map (int fd, size_t size, off_t offset)
+{
+  void *map;
+
+  if ((map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset)) == MAP_FAILED)
+    return NULL;
+
+  return map;
+}
+
+static struct arm32_aio_ring *
+arm32_aio_ring_new (void)
+{
+  struct arm32_aio_ring *new;
+  struct io_uring_params params;
+
+  if ((new = calloc (1, sizeof (struct arm32_aio_ring))) == NULL)
+    return NULL;
+
+  memset (&params, 0, sizeof (struct io_uring_params));
+
+  /* Kernels without io_uring, or sandboxes that forbid it */
+  if ((new->fd = syscall (__NR_io_uring_setup, ARM32_AIO_QUEUE_DEPTH, &params)) == -1)
+  {
+    debug ("io_uring not available (%s), falling back to posix_fadvise\n", strerror (errno));
+
+    free (new);
+
+    return NULL;
+  }
+
+  new->sq_map_size = params.sq_off.array + params.sq_entries * sizeof (uint32_t);
+  new->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  new->sqes_size   = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (new->cq_map_size > new->sq_map_size)
+      new->sq_map_size = new->cq_map_size;
+
+    if ((new->sq_map = arm32_aio_ring_map (new->fd, new->sq_map_size, IORING_OFF_SQ_RING)) == NULL)
+      goto fail;
+
+    new->cq_map = new->sq_map;
+  }
+  else if ((new->sq_map = arm32_aio_ring_map (new->fd, new->sq_map_size, IORING_OFF_SQ_RING)) == NULL ||
+           (new->cq_map = arm32_aio_ring_map (new->fd, new->cq_map_size, IORING_OFF_CQ_RING)) == NULL)
+    goto fail;
+
+  if ((new->sqes = arm32_aio_ring_map (new->fd, new->sqes_size, IORING_OFF_SQES)) == NULL)
+    goto fail;
+
+  new->sq_tail  = new->sq_map + params.sq_off.tail;
+  new->sq_mask  = new->sq_map + params.sq_off.ring_mask;
+  new->sq_array = new->sq_map + params.sq_off.array;
+
+  new->cq_head  = new->cq_map + params.cq_off.head;
+  new->cq_tail  = new->cq_map + params.cq_off.tail;
+  new->cq_mask  = new->cq_map + params.cq_off.ring_mask;
+  new->cqes     = new->cq_map + params.cq_off.cqes;
+
+  return new;
+
+fail:
+  arm32_aio_ring_destroy (new);
+
+  return NULL;
+}
+
+static int
+arm32_aio_ring_submit (struct arm32_aio_ring *ring, struct arm32_aio_block *block, int fd)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t tail, index;
+
+  tail  = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+  sqe   = &ring->sqes[index];
+
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+
+  sqe->opcode    = IORING_OP_READ;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long) block->data;
+  sqe->len       = ARM32_AIO_CHUNK;
+  sqe->off       = block->off;
+  sqe->user_data = (unsigned long) block;
+
+  ring->sq_array[index] = index;
+
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall (__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == -1)
+    if (errno != EINTR)
+    {
+      /* Not consumed by the kernel, take it back */
+      __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Ask the kernel to give up the read into block. The block still
+   completes, with -ECANCELED if it was not done yet. */
+static int
+arm32_aio_ring_cancel (struct arm32_aio_ring *ring, struct arm32_aio_block *block)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t tail, index;
+
+  tail  = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+  sqe   = &ring->sqes[index];
+
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+
+  /* No block of its own: its completion is skipped when reaping */
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->fd        = -1;
+  sqe->addr      = (unsigned long) block;
+  sqe->user_data = 0;
+
+  ring->sq_array[index] = index;
+
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall (__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == -1)
+    if (errno != EINTR)
+    {
+      __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Mark every completed block. Returns how many there were. */
+static int
+arm32_aio_ring_reap (struct arm32_aio *aio)
+{
+  struct arm32_aio_ring *ring = aio->ring;
+  struct arm32_aio_block *block;
+  struct io_uring_cqe *cqe;
+  uint32_t head, tail;
+  int count = 0;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; ++head, ++count)
+  {
+    cqe   = &ring->cqes[head & *ring->cq_mask];
+
+    if ((block = (struct arm32_aio_block *) (unsigned long) cqe->user_data) == NULL)
+      continue;
+
+    if (cqe->res < 0)
+    {
+      block->len   = 0;
+      block->error = -cqe->res;
+    }
+    else
+      block->len = cqe->res;
+
+    block->pending = 0;
+
+    --aio->in_flight;
+  }
+
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+static int
+arm32_aio_ring_wait (struct arm32_aio_ring *ring)
+{
+  if (syscall (__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+    return -1;
+
+  return 0;
+}
+#else
+/* Built without io_uring headers: read ahead is only advised */
+struct arm32_aio_ring
+{
+  int fd;
+};
+
+static struct arm32_aio_ring *
+arm32_aio_ring_new (void)
+{
+  return NULL;
+}
+
+static void
+arm32_aio_ring_destroy (struct arm32_aio_ring *ring)
+{
+}
+
+static int
+arm32_aio_ring_submit (struct arm32_aio_ring *ring, struct arm32_aio_block *block, int fd)
+{
+  return -1;
+}
+
+static int
+arm32_aio_ring_cancel (struct arm32_aio_ring *ring, struct arm32_aio_block *block)
+{
+  return -1;
+}
+
+static int
+arm32_aio_ring_reap (struct arm32_aio *aio)
+{
+  return 0;
+}
+
+static int
+arm32_aio_ring_wait (struct arm32_aio_ring *ring)
+{
+  return -1;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Only created if read ahead was asked for */
+struct arm32_aio *
+arm32_cpu_get_aio (struct arm32_cpu *cpu)
+{
+  if (cpu->runtime.aio == NULL && getenv (ARM32_AIO_ENV) != NULL)
+    if ((cpu->runtime.aio = calloc (1, sizeof (struct arm32_aio))) != NULL)
+      cpu->runtime.aio->ring = arm32_aio_ring_new ();
+
+  return cpu->runtime.aio;
+}
+
+/* Completions can no longer be waited for. Closing the ring stops the
+   kernel from posting them, but reads still running may write into
+   their blocks, so those buffers are given up rather than freed. Read
+   ahead goes on through posix_fadvise. */
+static void
+arm32_aio_drop_ring (struct arm32_aio *aio)
+{
+  struct arm32_aio_block *block;
+  int i, j;
+
+  for (i = 0; i < aio->file_count; ++i)
+    if (aio->file_list[i] != NULL)
+      for (j = 0; j < ARM32_AIO_BLOCKS; ++j)
+      {
+        block = &aio->file_list[i]->block_list[j];
+
+        if (block->pending)
+        {
+          block->data    = NULL;
+          block->pending = 0;
+          block->error   = EIO;
+        }
+      }
+
+  arm32_aio_ring_destroy (aio->ring);
+
+  aio->ring      = NULL;
+  aio->in_flight = 0;
+}
+
+/* Only returns once the kernel is done with block */
+static void
+arm32_aio_wait (struct arm32_aio *aio, struct arm32_aio_block *block)
+{
+  int cancelled = 0;
+
+  while (block->pending)
+  {
+    if (arm32_aio_ring_reap (aio) > 0 || arm32_aio_ring_wait (aio->ring) == 0)
+      continue;
+
+    if (!cancelled && arm32_aio_ring_cancel (aio->ring, block) == 0)
+    {
+      cancelled = 1;
+      continue;
+    }
+
+    error ("Cannot wait for read ahead: %s\n", strerror (errno));
+
+    arm32_aio_drop_ring (aio);
+  }
+}
+
+static void
+arm32_aio_file_destroy (struct arm32_aio *aio, struct arm32_aio_file *file)
+{
+  int i;
+
+  for (i = 0; i < ARM32_AIO_BLOCKS; ++i)
+  {
+    arm32_aio_wait (aio, &file->block_list[i]);
+
+    if (file->block_list[i].data != NULL)
+      free (file->block_list[i].data);
+  }
+
+  free (file);
+}
+
+void
+arm32_aio_destroy (struct arm32_aio *aio)
+{
+  int i;
+
+  for (i = 0; i < aio->file_count; ++i)
+    if (aio->file_list[i] != NULL)
+      arm32_aio_file_destroy (aio, aio->file_list[i]);
+
+  if (aio->file_list != NULL)
+    free (aio->file_list);
+
+  if (aio->ring != NULL)
+    arm32_aio_ring_destroy (aio->ring);
+
+  free (aio);
+}
+
+/* Start reading fd ahead of the guest. Only regular files qualify. An
+   entry left for the same descriptor belongs to a file closed behind
+   our back, and is replaced. */
+int
+arm32_aio_track (struct arm32_cpu *cpu, int fd)
+{
+  struct arm32_aio *aio;
+  struct arm32_aio_file *new;
+  struct stat sbuf;
+  off_t pos;
+  int i;
+
+  if ((aio = arm32_cpu_get_aio (cpu)) == NULL)
+    return -1;
+
+  for (i = 0; i < aio->file_count; ++i)
+    if (aio->file_list[i] != NULL && aio->file_list[i]->fd == fd)
+    {
+      arm32_aio_file_destroy (aio, aio->file_list[i]);
+
+      aio->file_list[i] = NULL;
+    }
+
+  if (fstat (fd, &sbuf) == -1 || !S_ISREG (sbuf.st_mode))
+    return -1;
+
+  if ((pos = lseek (fd, 0, SEEK_CUR)) == -1)
+    return -1;
+
+  if ((new = calloc (1, sizeof (struct arm32_aio_file))) == NULL)
+    return -1;
+
+  new->fd    = fd;
+  new->pos   = pos;
+  new->ahead = pos;
+  new->end   = -1;
+
+  if (PTR_LIST_APPEND_CHECK (aio->file, new) == -1)
+  {
+    free (new);
+
+    return -1;
+  }
+
+  if (aio->ring == NULL)
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  return 0;
+}
+
+struct arm32_aio_file *
+arm32_aio_lookup (struct arm32_cpu *cpu, int fd)
+{
+  int i;
+
+  if (cpu->runtime.aio == NULL)
+    return NULL;
+
+  for (i = 0; i < cpu->runtime.aio->file_count; ++i)
+    if (cpu->runtime.aio->file_list[i] != NULL && cpu->runtime.aio->file_list[i]->fd == fd)
+      return cpu->runtime.aio->file_list[i];
+
+  return NULL;
+}
+
+/* Anything but a plain read: the kernel file offset has to be right
+   again */
+void
+arm32_aio_untrack (struct arm32_cpu *cpu, int fd)
+{
+  int i;
+
+  if (cpu->runtime.aio == NULL)
+    return;
+
+  for (i = 0; i < cpu->runtime.aio->file_count; ++i)
+    if (cpu->runtime.aio->file_list[i] != NULL && cpu->runtime.aio->file_list[i]->fd == fd)
+    {
+      lseek (fd, cpu->runtime.aio->file_list[i]->pos, SEEK_SET);
+
+      arm32_aio_file_destroy (cpu->runtime.aio, cpu->runtime.aio->file_list[i]);
+
+      cpu->runtime.aio->file_list[i] = NULL;
+    }
+}
+
+static struct arm32_aio_block *
+arm32_aio_find (struct arm32_aio_file *file, off_t pos)
+{
+  struct arm32_aio_block *block;
+  int i;
+
+  for (i = 0; i < ARM32_AIO_BLOCKS; ++i)
+  {
+    block = &file->block_list[i];
+
+    if (block->data != NULL && pos >= block->off &&
+        pos < block->off + (block->pending ? ARM32_AIO_CHUNK : block->len))
+      return block;
+  }
+
+  return NULL;
+}
+
+/* Keep the blocks busy reading what comes after pos */
+static void
+arm32_aio_schedule (struct arm32_aio *aio, struct arm32_aio_file *file)
+{
+  struct arm32_aio_block *block;
+  off_t window;
+  int i;
+
+  window = file->pos + ARM32_AIO_CHUNK * ARM32_AIO_BLOCKS;
+
+  if (file->ahead < file->pos || file->ahead > window)
+    file->ahead = file->pos;
+
+  if (aio->ring == NULL)
+  {
+    while (file->ahead < window && (file->end == -1 || file->ahead < file->end))
+    {
+      posix_fadvise (file->fd, file->ahead, ARM32_AIO_CHUNK, POSIX_FADV_WILLNEED);
+
+      file->ahead += ARM32_AIO_CHUNK;
+    }
+
+    return;
+  }
+
+  for (i = 0; i < ARM32_AIO_BLOCKS; ++i)
+  {
+    block = &file->block_list[i];
+
+    if (file->end != -1 && file->ahead >= file->end)
+      break;
+
+    if (aio->in_flight >= ARM32_AIO_QUEUE_DEPTH)
+      break;
+
+    /* Still in flight, or not consumed yet */
+    if (block->pending ||
+        (block->len > 0 && block->off + block->len > file->pos && block->off < window))
+      continue;
+
+    if (block->data == NULL)
+      if ((block->data = malloc (ARM32_AIO_CHUNK)) == NULL)
+        break;
+
+    block->off   = file->ahead;
+    block->len   = 0;
+    block->error = 0;
+
+    if (arm32_aio_ring_submit (aio->ring, block, file->fd) == -1)
+      break;
+
+    block->pending = 1;
+
+    ++aio->in_flight;
+
+    file->ahead += ARM32_AIO_CHUNK;
+  }
+}
+
+/* Read into iov from the guest position of file, as read would. Blocks
+   read ahead are used first, whatever they do not cover goes straight
+   into guest memory. */
+ssize_t
+arm32_aio_readv (struct arm32_cpu *cpu, struct arm32_aio_file *file, struct iovec *iov, int count)
+{
+  struct arm32_aio *aio = cpu->runtime.aio;
+  struct arm32_aio_block *block;
+  size_t done = 0;
+  size_t avail, n;
+  ssize_t got;
+
+  while (count > 0 && (block = arm32_aio_find (file, file->pos)) != NULL)
+  {
+    arm32_aio_wait (aio, block);
+
+    if (block->error == 0 && block->len < ARM32_AIO_CHUNK)
+      file->end = block->off + block->len;
+
+    if (block->error != 0 || file->pos >= block->off + block->len)
+      break;
+
+    avail = block->off + block->len - file->pos;
+
+    while (count > 0 && avail > 0)
+    {
+      if ((n = iov->iov_len) > avail)
+        n = avail;
+
+      memcpy (iov->iov_base, block->data + (file->pos - block->off), n);
+
+      if (n == iov->iov_len)
+      {
+        ++iov;
+        --count;
+      }
+      else
+      {
+        iov->iov_base  = (char *) iov->iov_base + n;
+        iov->iov_len  -= n;
+      }
+
+      file->pos += n;
+      done      += n;
+      avail     -= n;
+    }
+  }
+
+  /* The end seen so far is tried again, the file may have grown */
+  if (count > 0)
+  {
+    if ((got = arm32_stdlib_host_preadv (file->fd, iov, count, file->pos)) == -1)
+    {
+      if (done == 0)
+        return -1;
+    }
+    else
+    {
+      file->pos += got;
+      done      += got;
+
+      if (file->end != -1 && file->pos > file->end)
+        file->end = -1;
+    }
+  }
+
+  arm32_aio_schedule (aio, file);
+
+  return done;
+}
@@ -0,0 +1,75 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef _ARM_AIO_H
+#define _ARM_AIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "arm_cpu.h"
+
+/* Read files opened by the guest ahead of it, if set */
+#define ARM32_AIO_ENV "ARMETTE_READ_AHEAD"
+
+#define ARM32_AIO_CHUNK       (256 * 1024)
+#define ARM32_AIO_BLOCKS      2 /* Per file: one being consumed, one in flight */
+#define ARM32_AIO_QUEUE_DEPTH 32
+
+struct arm32_aio_block
+{
+  char  *data;
+  off_t  off;     /* File offset of data[0] */
+  size_t len;     /* Valid bytes, once complete */
+  int    pending; /* Read in flight */
+  int    error;   /* errno of the read, if it failed */
+};
+
+/* A file read sequentially by the guest. Reads are served from blocks
+   read ahead of it, so the file offset seen by the kernel is not
+   updated until the file stops being tracked. */
+struct arm32_aio_file
+{
+  int   fd;
+  off_t pos;   /* Guest file offset */
+  off_t ahead; /* Next offset to read ahead */
+  off_t end;   /* End of file, once seen, or -1 */
+
+  struct arm32_aio_block block_list[ARM32_AIO_BLOCKS];
+};
+
+struct arm32_aio_ring;
+
+struct arm32_aio
+{
+  struct arm32_aio_ring *ring; /* NULL: read ahead through posix_fadvise */
+  int in_flight;
+
+  PTR_LIST (struct arm32_aio_file, file);
+};
+
+struct arm32_aio *arm32_cpu_get_aio (struct arm32_cpu *);
+void arm32_aio_destroy (struct arm32_aio *);
+
+int arm32_aio_track (struct arm32_cpu *, int);
+void arm32_aio_untrack (struct arm32_cpu *, int);
+struct arm32_aio_file *arm32_aio_lookup (struct arm32_cpu *, int);
+ssize_t arm32_aio_readv (struct arm32_cpu *, struct arm32_aio_file *, struct iovec *, int);
+
+#endif /* _ARM_AIO_H */
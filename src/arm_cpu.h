@@ -40,8 +40,16 @@
 #define ARM32_DEFAULT_STACK_BOTTOM 0xc0000000
 #define ARM32_DEFAULT_VDSO_BOTTOM  0xe0000000
 
+/* Guest data of the emulated runtime, errno first */
+#define ARM32_DEFAULT_RUNTIME_BOTTOM 0xe0001000
+#define ARM32_DEFAULT_RUNTIME_SIZE   4096
+
 #define ARM32_ARMETTE_RETURN_INSTRUCTION 0xefffffff
 
+/* Unconditional SWI into the import hook range, as patched by the ELF loader */
+#define ARM32_IS_HOOK_INSTRUCTION(inst) \
+  (((inst) & 0xff000000) == 0xef000000 && ((inst) & 0xffffff) >= ARM32_IMPORT_HOOK_BASE)
+
 #define CPSR_N_BIT 31
 #define CPSR_Z_BIT 30
 #define CPSR_C_BIT 29
@@ -83,6 +91,7 @@
 #define debug(fmt, arg...)   arm32_dbg (ARMETTE_DEBUG, fmt, ##arg)
 
 #define REG(cpu, reg) cpu->regs.r[reg]
+#define ERRNO(cpu) (*(cpu)->runtime.errno_ptr)
 #define O_REG(cpu, reg) cpu->wps->regs_saved.r[reg]
 
 #define R0(cpu)  REG (cpu, 0)
@@ -194,6 +203,25 @@ struct arm32_regs
 };
 
 struct arm32_watchpoint_set;
+struct arm32_decode_cache;
+struct arm32_stdio;
+struct arm32_aio;
+
+/* State of the emulated libc and kernel, one per CPU so that CPUs can
+   run side by side */
+struct arm32_runtime
+{
+  uint32_t *errno_ptr;      /* Guest errno, in the runtime segment */
+  uint32_t  errno_virt;
+  uint32_t *optind;         /* Guest optind, optind_local if it has none */
+  uint32_t  optind_local;
+  uint32_t  locale;         /* Last locale set through setlocale */
+  uint32_t  tls;            /* Thread pointer, as set by the guest */
+  struct arm32_stdio *stdio; /* Guest FILE streams, created on demand */
+  struct arm32_aio *aio;     /* Files read ahead of the guest */
+  struct iovec *iov_list;    /* Host iovecs of guest transfers, on demand */
+  uint64_t bytes;           /* Moved by memory and I/O hooks, for profiling */
+};
 
 struct arm32_cpu
 {
@@ -213,6 +241,8 @@ struct arm32_cpu
   void (*dtor) (void *);
 
   struct arm32_watchpoint_set *wps;
+  struct arm32_decode_cache *dcache;
+  struct arm32_runtime runtime;
 };
 
 static inline struct arm32_segment *
@@ -292,6 +322,24 @@ arm32_cpu_translate_read_size (struct arm32_cpu *cpu, uint32_t virt, uint32_t si
   return arm32_segment_translate (seg, virt);
 }
 
+/* Like arm32_cpu_translate_read, also telling how many bytes can be
+   read before the end of the segment */
+static inline void *
+arm32_cpu_translate_read_avail (struct arm32_cpu *cpu, uint32_t virt, uint32_t *avail)
+{
+  struct arm32_segment *seg;
+
+  if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL)
+    return NULL;
+
+  if (arm32_segment_check_access (seg, SA_R) == -1)
+    return NULL;
+
+  *avail = seg->virt + seg->size - virt;
+  
+  return arm32_segment_translate (seg, virt);
+}
+
 struct arm32_cpu *arm32_cpu_new (void);
 struct arm32_segment *arm32_segment_new (uint32_t, void *, uint32_t, uint8_t);
 void arm32_segment_set_dtor (struct arm32_segment *, void (*) (void *, void *, uint32_t), void *);
@@ -303,11 +351,14 @@ uint32_t arm32_map_exec_buffer (struct arm32_cpu *, void *, size_t);
 void arm32_segment_destroy (struct arm32_segment *);
 void arm32_cpu_destroy (struct arm32_cpu *);
 int arm32_cpu_run (struct arm32_cpu *);
+int arm32_cpu_except (struct arm32_cpu *, int, uint32_t, uint32_t);
 int arm32_cpu_callproc (struct arm32_cpu *, uint32_t);
+int arm32_cpu_call (struct arm32_cpu *, uint32_t, const uint32_t *, unsigned int, uint64_t *);
 void arm32_cpu_jump (struct arm32_cpu *, uint32_t);
 void arm32_cpu_return (struct arm32_cpu *);
 int arm32_elf_call_external (struct arm32_cpu *, uint32_t);
 uint32_t arm32_cpu_find_region (const struct arm32_cpu *, uint32_t, uint32_t);
+int arm32_cpu_region_is_free (const struct arm32_cpu *, uint32_t, uint32_t);
 void arm32_dbg (unsigned int, const char *, ...);
 
 #endif /* _ARM_CPU_H */
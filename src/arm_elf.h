@@ -21,6 +21,9 @@
 #define _ARM_ELF_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <util.h>
 #include <elf.h>
 
@@ -29,9 +32,42 @@
 #define ARMPROTO(sname) \
   int ARMSYM (sname) (struct arm32_cpu *cpu, const char *name, void *data, uint32_t prev)
 
+#define ARM32_ELF_PAGE_SIZE 0x1000
+
+/* Directory of relocated ET_DYN images, keyed by file identity and bias.
+   The image starts at the first host page boundary after the header. */
+#define ARM32_ELF_PRELINK_ENV     "ARMETTE_PRELINK_DIR"
+#define ARM32_ELF_PRELINK_MAGIC   "ARMPRELK"
+#define ARM32_ELF_PRELINK_VERSION 2
+
+/* Bytes hashed at each end of a file to tell rewritten files apart */
+#define ARM32_ELF_CHECK_SIZE 4096
+
+/* Directory of decoded instructions, keyed by file identity */
+#define ARM32_ELF_DECODE_CACHE_ENV "ARMETTE_DECODE_CACHE_DIR"
+
+/* Profile hooks from load time, and report on guest exit, if set */
+#define ARM32_ELF_PROFILE_ENV "ARMETTE_PROFILE"
+
+/* Load flags: send imports found in the hook registry to their native
+   hooks as they are defined */
+#define ARM32_ELF_STDLIB_HOOKS 1
+
+/* Auxiliary vector passed to _start: AT_PHDR, AT_PHENT, AT_PHNUM,
+   AT_PAGESZ, AT_RANDOM and AT_NULL */
+#define ARM32_ELF_AUXV_COUNT  6
+#define ARM32_ELF_RANDOM_SIZE 16
+
 #define ARMETTE_OVERRIDE(cpu, name) arm32_cpu_override_symbol (cpu, STRINGIFY (name), ARMSYM (name), NULL);
 struct arm32_cpu;
 
+struct arm32_elf_override_stats
+{
+  uint64_t calls;
+  uint64_t ticks; /* Host timestamp counter */
+  uint64_t bytes; /* Moved by memory and I/O hooks */
+};
+
 struct arm32_elf_instruction_override
 {
   char *name;
@@ -39,6 +75,100 @@ struct arm32_elf_instruction_override
   uint32_t *phys;
   int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t prev);
   void *data;
+
+  struct arm32_elf_override_stats stats; /* Only kept while profiling */
+};
+
+struct arm32_stdlib_hook
+{
+  const char *name;
+  int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t prev);
+  void *data;
+};
+
+/* Typed hooks. Instead of pulling its arguments from the registers, a
+   native function is called by arm32_hook_typed_call with them already
+   read and translated, as described by a signature string:
+
+     ret[!]:arg,arg,...
+
+   Return types are v (none), i (32 bit), l (64 bit, r0:r1) and p (guest
+   pointer). A trailing ! copies the host errno to the guest when the
+   native function returns -1. Arguments are i (32 bit), l (64 bit, even
+   register pair or aligned stack slot), s (string, NUL terminated inside
+   its segment) and p / w (buffer, readable / writable). A buffer may be
+   followed by the index of the argument holding its size, which is
+   checked against the segment; otherwise its size is what is left of
+   the segment, and NULL is passed as is. */
+
+#define ARM32_HOOK_ARGS  8
+#define ARM32_HOOK_WORDS 16 /* Core registers included */
+
+struct arm32_hook_arg
+{
+  uint64_t value; /* Integers, and guest address of buffers and strings */
+  void    *ptr;   /* Host address of buffers and strings */
+  uint32_t size;  /* Bytes accessible at ptr, or string length */
+};
+
+struct arm32_hook_sig
+{
+  const char *spec;
+  int (*native) (struct arm32_cpu *, const struct arm32_hook_arg *, uint64_t *);
+
+  /* Filled by arm32_hook_sig_parse */
+  int    ready;
+  char   ret;
+  int    set_errno;
+  int    argc;
+  int    words;
+  char   type[ARM32_HOOK_ARGS];
+  int8_t word[ARM32_HOOK_ARGS];     /* First argument word */
+  int8_t size_arg[ARM32_HOOK_ARGS]; /* Size of a buffer, or -1 */
+};
+
+#define ARMNATIVE(sname) JOIN (arm32_native_, sname)
+#define ARMSIG(sname)    JOIN (arm32_sig_, sname)
+
+/* Declares the signature of a native function and starts its body */
+#define ARMTYPED(sname, spec)                                              \
+  static int ARMNATIVE (sname) (struct arm32_cpu *, const struct arm32_hook_arg *, uint64_t *); \
+  static struct arm32_hook_sig ARMSIG (sname) = { spec, ARMNATIVE (sname) }; \
+  static int ARMNATIVE (sname) (struct arm32_cpu *cpu, const struct arm32_hook_arg *arg, uint64_t *result)
+
+/* Relocated image of a file, saved by the first CPU loaded from it and
+   mapped copy-on-write by the next ones */
+struct arm32_elf_template
+{
+  FILE    *file; /* Unlinked, prelink cache format */
+  uint64_t key;
+  int      ready;
+};
+
+struct arm32_elf_prelink_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t bias;
+  uint64_t key;    /* File identity */
+  uint64_t check;  /* Hash of both ends of the file */
+  uint64_t size;
+  uint64_t offset; /* Of the image, page aligned */
+};
+
+struct arm32_elf_symbol_addr
+{
+  uint32_t addr;
+  uint32_t size;
+  int      index;
+};
+
+/* Host memory of a PT_LOAD segment larger in memory than in file */
+struct arm32_elf_load
+{
+  void  *map;  /* Page aligned mapping */
+  size_t size;
+  void  *data; /* Segment start inside map */
 };
 
 struct arm32_elf
@@ -46,12 +176,19 @@ struct arm32_elf
   void *base;
   size_t size;
 
+  struct arm32_elf_load *load_list; /* One per phdr, unused if data is NULL */
+
   void *stack_base;
   size_t stack_size;
   
   Elf32_Ehdr *ehdr;
   Elf32_Phdr *phdr;
 
+  uint32_t bias;  /* Load address - link address (ET_DYN only) */
+  uint64_t file_key;   /* Hash of device, inode, size, mtime and ctime */
+  uint64_t file_check; /* Hash of both ends of the file as read */
+  int prelinked;  /* Image comes relocated from the prelink cache */
+
   uint32_t *got; /* Global offset table */
 
   /* Used for dynamic linking */
@@ -64,28 +201,105 @@ struct arm32_elf
   int        symtab_first;
   int        symtab_sane;
 
+  uint32_t  *hash;     /* DT_HASH: nbucket, nchain, buckets, chains */
+  uint32_t  *gnu_hash; /* DT_GNU_HASH, only covers defined symbols */
+
+  int       *name_index; /* Symbols not covered by hash tables (index + 1) */
+  uint32_t   name_index_mask;
+
+  int       *sym_override; /* Symbol index to override index, or -1 */
+
   Elf32_Sym *debug_symtab;
   int        debug_symtab_size;
 
-  Elf32_Rel *rel;
+  Elf32_Rel *rel;    /* DT_JMPREL */
   int        rel_size;
+  Elf32_Rel *dynrel; /* DT_REL */
+  int        dynrel_size;
   uint32_t   tramp_vaddr;
   void      *tramp_paddr;
+  int        tramp_count;
+  int        tramp_used;
   
   char      *debug_strtab;
   int        debug_strtab_size;
 
-  PTR_LIST (struct arm32_elf_instruction_override, override);
+  int       *debug_name_index;
+  uint32_t   debug_name_index_mask;
+
+  struct arm32_elf_symbol_addr *debug_addr_list; /* Sorted by address */
+  int        debug_addr_count;
+  int        debug_indexed; /* Indexes are built on first use */
+
+  PTR_LIST (struct arm32_elf_instruction_override, override); /* Main image only */
+  int override_alloc;
+  int        stdlib_hooks; /* Imports go to native hooks, main image only */
+  int        static_hooks; /* Static string functions hooked */
+  int       *override_index; /* Named overrides by name (index + 1) */
+  uint32_t   override_index_mask;
+  int        override_named;
+
+  int        profile;     /* Keep override stats, main image only */
+  uint64_t   profile_tsc; /* Timestamp and host time profiling started at */
+  uint64_t   profile_ns;
+
+  char      *decode_cache_path; /* Saved on destroy if anything new was decoded */
+  uint64_t   decode_cache_key;
+  struct arm32_decode_cache *dcache;
+  unsigned int decode_fill_mark;
+
+  uint32_t   brk_base; /* Program break, main image only */
+  uint32_t   brk;
+  struct arm32_segment *brk_seg;
+
+  struct arm32_elf *owner; /* Main image, if this is a library */
+  PTR_LIST (struct arm32_elf, library);
 };
 
+#define ARM32_ELF_OWNER(elf) ((elf)->owner != NULL ? (elf)->owner : (elf))
+
 struct arm32_cpu *arm32_cpu_new_from_elf (const char *);
+struct arm32_cpu *arm32_cpu_new_from_elf_flags (const char *, int);
+struct arm32_cpu *arm32_cpu_new_from_elf_fd (int);
+struct arm32_cpu *arm32_cpu_new_from_elf_template (int, struct arm32_elf_template *, int);
+int arm32_cpu_new_from_elf_batch (const char **, int, int, int, struct arm32_cpu **, int *);
+int arm32_cpu_load_library (struct arm32_cpu *, const char *);
+int arm32_elf_lookup_symbol (const struct arm32_elf *, const char *);
 int arm32_cpu_get_symbol_index (struct arm32_cpu *, const char *);
 int arm32_cpu_define_symbol (struct arm32_elf *, const char *, int, int (*) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *);
 int arm32_cpu_override_symbol (struct arm32_cpu *, const char *, int (*) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *);
 int arm32_cpu_restore_symbol (struct arm32_cpu *, const char *);
 int arm32_cpu_prepare_main (struct arm32_cpu *, int, char **);
 void arm32_init_stdlib_hooks (struct arm32_cpu *);
+void arm32_elf_segment_dtor (void *, void *, uint32_t);
+int arm32_elf_hook_defined_function (struct arm32_elf *, const struct arm32_stdlib_hook *);
+const struct arm32_stdlib_hook *arm32_stdlib_hook_lookup (const char *);
+int arm32_hook_sig_parse (struct arm32_hook_sig *);
+int arm32_hook_typed_call (struct arm32_cpu *, const char *, void *, uint32_t);
+uint32_t arm32_stdlib_data_import (struct arm32_cpu *, const char *);
+const char *arm32_stdlib_translate_string (struct arm32_cpu *, uint32_t, uint32_t *);
+ssize_t arm32_stdlib_host_preadv (int, const struct iovec *, int, off_t);
+ssize_t arm32_stdlib_host_pwritev (int, const struct iovec *, int, off_t);
+ssize_t arm32_stdlib_host_sendfile (int, int, off_t *, size_t);
+ssize_t arm32_stdlib_read_guest (struct arm32_cpu *, int, uint32_t, uint32_t, int, off_t);
+ssize_t arm32_stdlib_write_guest (struct arm32_cpu *, int, uint32_t, uint32_t, int, off_t);
+ssize_t arm32_stdlib_readv_guest (struct arm32_cpu *, int, uint32_t, uint32_t);
+ssize_t arm32_stdlib_writev_guest (struct arm32_cpu *, int, uint32_t, uint32_t);
+off_t arm32_stdlib_seek (struct arm32_cpu *, int, off_t, int);
+uint32_t arm32_stdlib_map (struct arm32_cpu *, uint32_t, uint32_t, int, int, int, off_t);
+void arm32_stdlib_unmap (struct arm32_cpu *, uint32_t, uint32_t);
+uint32_t arm32_stdlib_remap (struct arm32_cpu *, uint32_t, uint32_t, uint32_t, int);
+int arm32_stdlib_protect (struct arm32_cpu *, uint32_t, uint32_t, int);
+int arm32_stdlib_advise (struct arm32_cpu *, uint32_t, uint32_t, int);
+struct arm32_elf *arm32_stdlib_brk_init (struct arm32_cpu *);
+int arm32_stdlib_set_brk (struct arm32_cpu *, uint32_t);
+uint32_t arm32_elf_gnu_hash (const char *);
+uint64_t arm32_elf_content_hash (const void *, size_t);
 uint32_t arm32_elf_resolve_debug_symbol (struct arm32_elf *, const char *);
+const char *arm32_elf_symbolize (struct arm32_elf *, uint32_t, uint32_t *);
+void arm32_cpu_set_profiling (struct arm32_cpu *, int);
+void arm32_cpu_reset_profile (struct arm32_cpu *);
+int arm32_cpu_dump_profile (struct arm32_cpu *, FILE *);
 int arm32_elf_replace_instruction (struct arm32_elf *elf, const char *name, uint32_t vaddr, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data);
 
 static inline uint32_t
@@ -94,6 +308,12 @@ arm32_cpu_resolve_debug_symbol (struct arm32_cpu *cpu, const char *name)
   return arm32_elf_resolve_debug_symbol ((struct arm32_elf *) cpu->data, name);
 }
 
+static inline const char *
+arm32_cpu_symbolize (struct arm32_cpu *cpu, uint32_t addr, uint32_t *offset)
+{
+  return arm32_elf_symbolize ((struct arm32_elf *) cpu->data, addr, offset);
+}
+
 static inline uint32_t
 arm32_cpu_override_debug_symbol (struct arm32_cpu *cpu, const char *name, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
 {
@@ -73,6 +73,65 @@ struct arm32_inst
   int (*callback) (struct arm32_cpu *, uint32_t);
 };
 
+#define ARM32_DECODE_CACHE_MAGIC   "ARMDCODE"
+#define ARM32_DECODE_CACHE_VERSION 1
+
+/* Decoded instruction, valid only while memory still holds word */
+struct arm32_decode_entry
+{
+  uint32_t word;
+  uint32_t inst; /* Index in the instruction table + 1, 0 if empty */
+};
+
+#define ARM32_DECODE_PAGE_BITS     10 /* Entries per page, 4 KiB of code */
+#define ARM32_DECODE_PAGE_ENTRIES  (1 << ARM32_DECODE_PAGE_BITS)
+
+/* One entry per word of an executable segment, in pages allocated the
+   first time code runs in them */
+struct arm32_decode_region
+{
+  uint32_t virt;
+  uint32_t count;
+
+  struct arm32_decode_entry **page_list;
+};
+
+struct arm32_decode_cache
+{
+  PTR_LIST (struct arm32_decode_region, region);
+  struct arm32_decode_region *last;
+
+  unsigned int fill_count; /* Instructions decoded so far */
+};
+
+/* On-disk format: header followed by count records */
+struct arm32_decode_cache_header
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t table_hash;
+  uint64_t key;        /* Identity of the file, not a hash of its contents */
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct arm32_decode_record
+{
+  uint32_t addr; /* Relative to the load bias */
+  uint32_t word;
+  uint32_t inst;
+};
+
 const struct arm32_inst *arm32_inst_decode (struct arm32_cpu *, uint32_t);
+const struct arm32_inst *arm32_inst_get (unsigned int);
+unsigned int arm32_inst_index (const struct arm32_inst *);
+uint32_t arm32_inst_table_hash (void);
+
+struct arm32_decode_cache *arm32_decode_cache_new (void);
+void arm32_decode_cache_destroy (struct arm32_decode_cache *);
+void arm32_decode_cache_drop (struct arm32_decode_cache *, uint32_t, uint32_t);
+const struct arm32_inst *arm32_inst_decode_cached (struct arm32_cpu *, uint32_t, uint32_t);
+int arm32_decode_cache_load (struct arm32_cpu *, const char *, uint64_t, uint32_t, uint32_t, uint32_t);
+int arm32_decode_cache_save (const struct arm32_decode_cache *, const char *, uint64_t, uint32_t, uint32_t, uint32_t);
 
 #endif /* _ARM_INST_H */
@@ -0,0 +1,87 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef _ARM_STDIO_H
+#define _ARM_STDIO_H
+
+#include <sys/types.h>
+
+#include "arm_cpu.h"
+
+#define ARM32_STDIO_BUFSIZ      65536
+#define ARM32_STDIO_MAX_STREAMS 256
+
+#define ARM32_STDIO_STDIN  0
+#define ARM32_STDIO_STDOUT 1
+#define ARM32_STDIO_STDERR 2
+
+/* Stream flags */
+#define ARM32_STDIO_READ  1
+#define ARM32_STDIO_WRITE 2
+#define ARM32_STDIO_EOF   4
+#define ARM32_STDIO_ERROR 8
+
+/* Buffering modes */
+#define ARM32_STDIO_FULL 0
+#define ARM32_STDIO_LINE 1
+#define ARM32_STDIO_NONE 2
+
+struct arm32_stdio;
+
+/* Host side of a guest FILE */
+struct arm32_stdio_stream
+{
+  int fd;
+  int flags;
+  int mode;
+
+  char  *wbuf; /* Pending output */
+  size_t wlen;
+
+  char  *rbuf; /* Input read ahead, not consumed yet */
+  size_t rpos;
+  size_t rlen;
+
+  struct arm32_stdio *owner;
+};
+
+/* Guest FILE pointers are addresses of slots in a guest table. Every slot
+   holds its own address, so the first ones double as the stdin, stdout
+   and stderr variables data imports are bound to. */
+struct arm32_stdio
+{
+  uint32_t virt;
+  struct arm32_stdio_stream *stream_list[ARM32_STDIO_MAX_STREAMS];
+};
+
+struct arm32_stdio *arm32_cpu_get_stdio (struct arm32_cpu *);
+void arm32_stdio_destroy (struct arm32_stdio *);
+
+uint32_t arm32_stdio_open (struct arm32_cpu *, const char *, const char *);
+int arm32_stdio_close (struct arm32_cpu *, uint32_t);
+struct arm32_stdio_stream *arm32_stdio_lookup (struct arm32_cpu *, uint32_t);
+uint32_t arm32_stdio_handle (struct arm32_cpu *, int);
+
+ssize_t arm32_stdio_write (struct arm32_stdio_stream *, const void *, size_t);
+ssize_t arm32_stdio_read (struct arm32_stdio_stream *, void *, size_t);
+ssize_t arm32_stdio_gets (struct arm32_stdio_stream *, char *, size_t);
+int arm32_stdio_flush (struct arm32_stdio_stream *);
+int arm32_stdio_flush_all (struct arm32_stdio *);
+
+#endif /* _ARM_STDIO_H */
@@ -0,0 +1,53 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef _ARM_SYSCALL_H
+#define _ARM_SYSCALL_H
+
+#include <stdint.h>
+
+#include "arm_cpu.h"
+
+/* EABI: svc #0, number in r7, arguments in r0-r6, result in r0 */
+#define ARM32_SYSCALL_ARGS 7
+
+/* Regular syscalls are numbered below this, ARM private ones from
+   ARM32_SYSCALL_PRIVATE_BASE on */
+#define ARM32_SYSCALL_MAX          512
+#define ARM32_SYSCALL_PRIVATE_BASE 0xf0000
+#define ARM32_SYSCALL_PRIVATE_MAX  8
+
+/* Kernel user helpers page, mapped read-only at the top of the address
+   space like the vectors page of the kernel */
+#define ARM32_SYSCALL_KUSER_BOTTOM 0xffff0fa0
+#define ARM32_SYSCALL_KUSER_SIZE   0x60
+
+/* Handlers return what the kernel would: a value, or -errno */
+struct arm32_syscall
+{
+  const char *name;
+  int32_t (*handler) (struct arm32_cpu *, const uint32_t *);
+  long host_nr; /* Passed through to the host as is, if there is no handler */
+};
+
+const struct arm32_syscall *arm32_syscall_lookup (uint32_t);
+void arm32_syscall_vector (struct arm32_cpu *, uint32_t, uint32_t);
+int arm32_syscall_install (struct arm32_cpu *);
+
+#endif /* _ARM_SYSCALL_H */
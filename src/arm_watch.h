@@ -19,6 +19,8 @@
 #ifndef _ARM_WATCH_H
 #define _ARM_WATCH_H
 
+#include <pthread.h>
+
 #include "arm_cpu.h"
 
 #define ARM32_WATCHPOINT_REG    0
@@ -30,6 +32,29 @@
 #define ARM32_WATCHPOINT_PRE_EXEC  1
 #define ARM32_WATCHPOINT_POST_EXEC 2
 
+#define ARM32_BRANCH_JUMP     0 /* Direct branch */
+#define ARM32_BRANCH_CALL     1 /* BL / BLX */
+#define ARM32_BRANCH_RETURN   2 /* BX LR, MOV PC, LR, pops to PC, hook returns */
+#define ARM32_BRANCH_INDIRECT 3 /* Any other write to PC */
+
+#define ARM32_WATCHPOINT_QUEUE_DEFAULT_SIZE 4096
+
+#define ARM32_WATCHPOINT_QUEUE_BLOCK 1 /* Wait for the consumer instead of stopping */
+
+struct arm32_pred_op
+{
+  uint8_t  op;
+  uint32_t arg;
+};
+
+/* Compiled watchpoint condition */
+struct arm32_predicate
+{
+  struct arm32_pred_op *code;
+  int length;
+  int alloc;
+};
+
 struct arm32_watchpoint
 {
   int type;    /* Watchpoint type */
@@ -50,14 +75,84 @@ struct arm32_watchpoint
   uint32_t *cached_phys; /* Cached translation for memory watchpoint */
   uint16_t affected; /* Affected registers */
   
-  int delay; /* Watchpoint delay before activation */
-  int reset; /* Times before resetting */
+  int delay; /* Hits to ignore before the first trigger */
+  int reset; /* Hits to ignore after each trigger */
+  int countdown; /* Hits left to ignore */
+
+  uint64_t hits; /* Hits, including the ignored ones */
 
   void *data; /* Callback data */
   
   int (*callback) (struct arm32_cpu *, struct arm32_watchpoint *, void *);
 
   int backidx; /* Back index in watchpoint list */
+
+  int async; /* Deliver hits through the event queue */
+
+  struct arm32_predicate *condition; /* Trigger only if this holds */
+
+  int arena; /* Allocated by a bulk install, released with the set */
+};
+
+/* Bulk install descriptor */
+struct arm32_watchpoint_desc
+{
+  int type;
+  int when; /* 0 means ARM32_WATCHPOINT_POST_EXEC */
+  const char *name;
+
+  uint32_t mask; /* Register / instruction mask */
+  union
+  {
+    uint32_t addr;
+    uint32_t inst;
+  };
+
+  int delay;
+  int reset;
+  int async;
+  const char *condition; /* May be NULL */
+
+  int (*callback) (struct arm32_cpu *, struct arm32_watchpoint *, void *);
+  void *data;
+};
+
+/* Compact record of a watchpoint hit, as delivered through the queue */
+struct arm32_watchpoint_event
+{
+  uint32_t pc;    /* Address of the triggering instruction */
+  uint32_t inst;  /* Triggering instruction */
+  uint32_t value; /* Affected registers, new memory value, branch target */
+  uint32_t index; /* Back index of the watchpoint */
+  uint8_t  type;  /* Watchpoint type */
+  uint8_t  when;  /* ARM32_WATCHPOINT_PRE_EXEC or ARM32_WATCHPOINT_POST_EXEC */
+  uint8_t  kind;  /* Branch watchpoints: ARM32_BRANCH_* */
+};
+
+/* Last block exit, as seen by branch watchpoints */
+struct arm32_branch
+{
+  uint32_t from;
+  uint32_t to;
+  int kind;
+};
+
+/* Single producer (the CPU), single consumer ring buffer */
+struct arm32_watchpoint_queue
+{
+  struct arm32_watchpoint_event *event_list;
+  unsigned int size;
+  int flags;
+
+  unsigned int head; /* Next event to pop, owned by the consumer */
+  unsigned int tail; /* Next free slot, owned by the producer */
+
+  int stop;   /* Consumer asked the CPU to stop */
+  int closed; /* No more events will be pushed */
+  int waiting; /* Either side sleeping on cond */
+
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
 };
 
 struct arm32_watchpoint_set
@@ -65,6 +160,19 @@ struct arm32_watchpoint_set
   uint16_t regmask; /* Accumulative register mask */
   
   struct arm32_regs regs_saved;
+  uint32_t pc; /* Address of the instruction being tested */
+
+  struct arm32_watchpoint_queue *queue; /* NULL: synchronous delivery */
+
+  struct arm32_branch branch; /* Valid inside branch watchpoint callbacks */
+
+  int watchpoint_alloc; /* Allocated entries in watchpoint_list */
+  int free_hint;        /* No free entries below this index */
+
+  PTR_LIST (void, arena); /* Memory of bulk installed watchpoints */
+
+  int live_count;   /* Registered watchpoints */
+  int branch_count; /* Registered branch watchpoints */
 
   PTR_LIST (struct arm32_watchpoint, watchpoint);
 };
@@ -72,6 +180,7 @@ struct arm32_watchpoint_set
 
 int arm32_cpu_watchpoint_set_test_pre (struct arm32_cpu *, uint32_t);
 int arm32_cpu_watchpoint_set_test_post (struct arm32_cpu *, uint32_t);
+int arm32_cpu_watchpoint_set_test_branch (struct arm32_cpu *, uint32_t, uint32_t, int);
 struct arm32_watchpoint_set *arm32_watchpoint_set_new (void);
 void arm32_watchpoint_set_destroy (struct arm32_watchpoint_set *);
 
@@ -81,7 +190,27 @@ struct arm32_watchpoint *arm32_cpu_watch_memory (struct arm32_cpu *, const char
 struct arm32_watchpoint *arm32_cpu_watch_step (struct arm32_cpu *, const char *, int (*) (struct arm32_cpu *, struct arm32_watchpoint *, void *), void *);
 struct arm32_watchpoint *arm32_cpu_watch_branch (struct arm32_cpu *, const char *, int (*) (struct arm32_cpu *, struct arm32_watchpoint *, void *), void *);
 
+void arm32_watchpoint_delete (struct arm32_watchpoint_set *, struct arm32_watchpoint *);
+int arm32_cpu_watch_bulk (struct arm32_cpu *, const struct arm32_watchpoint_desc *, int, struct arm32_watchpoint **);
+int arm32_cpu_watchpoint_clone (struct arm32_cpu *, const struct arm32_cpu *);
+
 void arm32_watchpoint_enable (struct arm32_watchpoint *);
 void arm32_watchpoint_disable (struct arm32_watchpoint *);
+void arm32_watchpoint_set_async (struct arm32_watchpoint *, int);
+void arm32_watchpoint_set_delay (struct arm32_watchpoint *, int, int);
+uint64_t arm32_watchpoint_get_hits (const struct arm32_watchpoint *);
+void arm32_watchpoint_reset_hits (struct arm32_watchpoint *);
+
+struct arm32_predicate *arm32_predicate_compile (const char *);
+struct arm32_predicate *arm32_predicate_dup (const struct arm32_predicate *);
+uint32_t arm32_predicate_eval (struct arm32_cpu *, const struct arm32_predicate *);
+void arm32_predicate_destroy (struct arm32_predicate *);
+int arm32_watchpoint_set_condition (struct arm32_watchpoint *, const char *);
+
+int arm32_cpu_watchpoint_queue_enable (struct arm32_cpu *, unsigned int, int);
+void arm32_cpu_watchpoint_queue_disable (struct arm32_cpu *);
+unsigned int arm32_watchpoint_queue_pop (struct arm32_watchpoint_queue *, struct arm32_watchpoint_event *, unsigned int, int);
+void arm32_watchpoint_queue_request_stop (struct arm32_watchpoint_queue *);
+void arm32_watchpoint_queue_close (struct arm32_watchpoint_queue *);
 
 #endif /* _ARM_WATCH_H */
@@ -24,6 +24,7 @@
 #include <arm_cpu.h>
 #include <arm_elf.h>
 #include <arm_inst.h>
+#include <arm_syscall.h>
 #include <arm_watch.h>
 
 #endif /* _ARMETTE_H */
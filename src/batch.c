@@ -0,0 +1,398 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <arm_cpu.h>
+#include <arm_elf.h>
+
+struct arm32_elf_batch_file
+{
+  const char *path;
+  int         fd;
+  dev_t       dev;
+  ino_t       ino;
+  off_t       size;
+  uint64_t    hash;
+  int         hashed; /* Shares its size with another file */
+  int         canon;  /* Index of the first identical file */
+  int         copies; /* Files identical to this one, if canonical */
+
+  struct arm32_elf_template tmpl;
+};
+
+/* Open addressing table of file indexes (entries are index + 1) */
+struct arm32_elf_batch_index
+{
+  int     *slot_list;
+  uint32_t mask;
+};
+
+struct arm32_elf_batch
+{
+  struct arm32_elf_batch_file *file_list;
+  int                          file_count;
+
+  struct arm32_cpu           **cpus;
+  int                         *errors;
+
+  int                          next;   /* Next file to be processed */
+  int                          copies; /* Load pass: copies, or canonical files */
+  int                          loaded;
+  int                          flags;  /* ARM32_ELF_* load flags */
+};
+
+static int
+arm32_elf_batch_open (struct arm32_elf_batch_file *file)
+{
+  struct stat sbuf;
+
+  if ((file->fd = open (file->path, O_RDONLY)) == -1)
+    return -1;
+
+  if (fstat (file->fd, &sbuf) == -1)
+    return -1;
+
+  file->dev  = sbuf.st_dev;
+  file->ino  = sbuf.st_ino;
+  file->size = sbuf.st_size;
+
+  if (file->size < sizeof (Elf32_Ehdr))
+  {
+    errno = ENOEXEC;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+arm32_elf_batch_hash (struct arm32_elf_batch_file *file)
+{
+  void *map;
+
+  if ((map = mmap (NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0)) == (caddr_t) -1)
+    return -1;
+
+  file->hash = arm32_elf_content_hash (map, file->size);
+
+  munmap (map, file->size);
+
+  return 0;
+}
+
+static int
+arm32_elf_batch_same_inode (const struct arm32_elf_batch_file *a, const struct arm32_elf_batch_file *b)
+{
+  return a->dev == b->dev && a->ino == b->ino;
+}
+
+static int
+arm32_elf_batch_same_size (const struct arm32_elf_batch_file *a, const struct arm32_elf_batch_file *b)
+{
+  return a->size == b->size;
+}
+
+static int
+arm32_elf_batch_same_content (const struct arm32_elf_batch_file *a, const struct arm32_elf_batch_file *b)
+{
+  void *map_a, *map_b;
+  int same = 0;
+
+  if (a->size != b->size || a->hash != b->hash)
+    return 0;
+
+  /* Hashes match, make sure it is not a collision */
+  if ((map_a = mmap (NULL, a->size, PROT_READ, MAP_SHARED, a->fd, 0)) == (caddr_t) -1)
+    return 0;
+
+  if ((map_b = mmap (NULL, b->size, PROT_READ, MAP_SHARED, b->fd, 0)) != (caddr_t) -1)
+  {
+    same = memcmp (map_a, map_b, a->size) == 0;
+
+    munmap (map_b, b->size);
+  }
+
+  munmap (map_a, a->size);
+
+  return same;
+}
+
+static int
+arm32_elf_batch_index_init (struct arm32_elf_batch_index *index, int count)
+{
+  uint32_t size = 16;
+
+  while (size < 2 * count)
+    size <<= 1;
+
+  if ((index->slot_list = calloc (size, sizeof (int))) == NULL)
+    return -1;
+
+  index->mask = size - 1;
+
+  return 0;
+}
+
+/* Returns the first file already in the index that is the same as the
+   i-th one. If there is none, i is added and returned. */
+static int
+arm32_elf_batch_index_insert (
+  struct arm32_elf_batch *batch,
+  struct arm32_elf_batch_index *index,
+  uint64_t key,
+  int i,
+  int (*same) (const struct arm32_elf_batch_file *, const struct arm32_elf_batch_file *))
+{
+  uint32_t slot;
+  int j;
+
+  for (slot = (key * 0x9e3779b97f4a7c15ull) >> 32 & index->mask;
+       (j = index->slot_list[slot]) != 0;
+       slot = (slot + 1) & index->mask)
+    if ((same) (&batch->file_list[j - 1], &batch->file_list[i]))
+      return j - 1;
+
+  index->slot_list[slot] = i + 1;
+
+  return i;
+}
+
+static void *
+arm32_elf_batch_open_worker (void *data)
+{
+  struct arm32_elf_batch *batch = (struct arm32_elf_batch *) data;
+  int i;
+
+  while ((i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_SEQ_CST)) < batch->file_count)
+    if (arm32_elf_batch_open (&batch->file_list[i]) == -1)
+      batch->errors[i] = errno;
+
+  return NULL;
+}
+
+static void *
+arm32_elf_batch_hash_worker (void *data)
+{
+  struct arm32_elf_batch *batch = (struct arm32_elf_batch *) data;
+  int i;
+
+  while ((i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_SEQ_CST)) < batch->file_count)
+    if (batch->errors[i] == 0 && batch->file_list[i].hashed)
+      if (arm32_elf_batch_hash (&batch->file_list[i]) == -1)
+        batch->errors[i] = errno;
+
+  return NULL;
+}
+
+/* Canonical files are loaded first, saving their relocated image if
+   they have copies. Copies are then loaded from it. */
+static void *
+arm32_elf_batch_load_worker (void *data)
+{
+  struct arm32_elf_batch *batch = (struct arm32_elf_batch *) data;
+  struct arm32_elf_batch_file *file;
+  struct arm32_elf_template *tmpl;
+  int i;
+
+  while ((i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_SEQ_CST)) < batch->file_count)
+  {
+    if (batch->errors[i] != 0 || (batch->file_list[i].canon != i) != batch->copies)
+      continue;
+
+    file = &batch->file_list[batch->file_list[i].canon];
+
+    if (batch->copies)
+      tmpl = file->tmpl.ready ? &file->tmpl : NULL;
+    else if (file->copies > 0)
+    {
+      file->tmpl.key = file->hash;
+      tmpl = &file->tmpl;
+    }
+    else
+      tmpl = NULL;
+
+    if ((batch->cpus[i] = arm32_cpu_new_from_elf_template (file->fd, tmpl, batch->flags)) == NULL)
+      batch->errors[i] = errno != 0 ? errno : ENOEXEC;
+    else
+      __atomic_fetch_add (&batch->loaded, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+/* Run worker over the batch using up to threads threads, the calling
+   one included */
+static void
+arm32_elf_batch_run (struct arm32_elf_batch *batch, int threads, void *(*worker) (void *))
+{
+  pthread_t *thread_list;
+  int thread_count = 0;
+  int i;
+
+  batch->next = 0;
+
+  if (threads > batch->file_count)
+    threads = batch->file_count;
+
+  if (threads > 1 && (thread_list = malloc ((threads - 1) * sizeof (pthread_t))) != NULL)
+  {
+    for (i = 0; i < threads - 1; ++i)
+      if (pthread_create (&thread_list[thread_count], NULL, worker, batch) == 0)
+        ++thread_count;
+
+    (worker) (batch);
+
+    for (i = 0; i < thread_count; ++i)
+      pthread_join (thread_list[i], NULL);
+
+    free (thread_list);
+  }
+  else
+    (worker) (batch);
+}
+
+/* Identical files are found by inode first. Files sharing their size
+   with another one are then hashed, and compared by content. */
+static int
+arm32_elf_batch_dedupe (struct arm32_elf_batch *batch, int threads)
+{
+  struct arm32_elf_batch_index index;
+  struct arm32_elf_batch_file *file;
+  int i, j;
+
+  if (arm32_elf_batch_index_init (&index, batch->file_count) == -1)
+    return -1;
+
+  for (i = 0; i < batch->file_count; ++i)
+    if (batch->errors[i] == 0)
+    {
+      file = &batch->file_list[i];
+      file->canon = arm32_elf_batch_index_insert (batch, &index, (uint64_t) file->dev * 0x100000001b3ull ^ file->ino, i, arm32_elf_batch_same_inode);
+    }
+
+  memset (index.slot_list, 0, (index.mask + 1) * sizeof (int));
+
+  for (i = 0; i < batch->file_count; ++i)
+    if (batch->errors[i] == 0 && batch->file_list[i].canon == i)
+      if ((j = arm32_elf_batch_index_insert (batch, &index, batch->file_list[i].size, i, arm32_elf_batch_same_size)) != i)
+        batch->file_list[i].hashed = batch->file_list[j].hashed = 1;
+
+  arm32_elf_batch_run (batch, threads, arm32_elf_batch_hash_worker);
+
+  memset (index.slot_list, 0, (index.mask + 1) * sizeof (int));
+
+  for (i = 0; i < batch->file_count; ++i)
+    if (batch->errors[i] == 0 && batch->file_list[i].hashed)
+    {
+      file = &batch->file_list[i];
+      file->canon = arm32_elf_batch_index_insert (batch, &index, file->hash ^ file->size, i, arm32_elf_batch_same_content);
+    }
+
+  free (index.slot_list);
+
+  /* Copies come after their canonical file, which is final by then */
+  for (i = 0; i < batch->file_count; ++i)
+    if (batch->errors[i] == 0 && batch->file_list[i].canon != i)
+    {
+      file = &batch->file_list[i];
+      file->canon = batch->file_list[file->canon].canon;
+      ++batch->file_list[file->canon].copies;
+    }
+
+  return 0;
+}
+
+/* Load count ELF files in parallel. cpus[i] receives the CPU for
+   paths[i], or NULL and an errno value in errors[i] if it could not be
+   loaded. Identical files are relocated once: the other copies map
+   the relocated image of the first one. threads <= 0 means one thread
+   per online processor. flags are ARM32_ELF_* load flags. Returns the number of CPUs loaded, or -1 if the
+   batch could not be started. */
+int
+arm32_cpu_new_from_elf_batch (const char **paths, int count, int threads, int flags, struct arm32_cpu **cpus, int *errors)
+{
+  struct arm32_elf_batch batch;
+  int i;
+
+  if (count <= 0)
+    return 0;
+
+  if (threads <= 0)
+    if ((threads = sysconf (_SC_NPROCESSORS_ONLN)) <= 0)
+      threads = 1;
+
+  memset (&batch, 0, sizeof (struct arm32_elf_batch));
+
+  if ((batch.file_list = calloc (count, sizeof (struct arm32_elf_batch_file))) == NULL)
+    return -1;
+
+  batch.file_count = count;
+  batch.cpus       = cpus;
+  batch.errors     = errors;
+  batch.flags      = flags;
+
+  for (i = 0; i < count; ++i)
+  {
+    batch.file_list[i].path  = paths[i];
+    batch.file_list[i].fd    = -1;
+    batch.file_list[i].canon = i;
+
+    cpus[i]   = NULL;
+    errors[i] = 0;
+  }
+
+  arm32_elf_batch_run (&batch, threads, arm32_elf_batch_open_worker);
+
+  if (arm32_elf_batch_dedupe (&batch, threads) == -1)
+  {
+    for (i = 0; i < count; ++i)
+      if (batch.file_list[i].fd != -1)
+        close (batch.file_list[i].fd);
+
+    free (batch.file_list);
+
+    return -1;
+  }
+
+  batch.copies = 0;
+  arm32_elf_batch_run (&batch, threads, arm32_elf_batch_load_worker);
+
+  batch.copies = 1;
+  arm32_elf_batch_run (&batch, threads, arm32_elf_batch_load_worker);
+
+  for (i = 0; i < count; ++i)
+  {
+    if (batch.file_list[i].fd != -1)
+      close (batch.file_list[i].fd);
+
+    if (batch.file_list[i].tmpl.file != NULL)
+      fclose (batch.file_list[i].tmpl.file);
+  }
+
+  free (batch.file_list);
+
+  return batch.loaded;
+}
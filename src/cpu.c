@@ -22,9 +22,12 @@
 #include <sys/mman.h>
 
 #include "arm_cpu.h"
+#include "arm_inst.h"
 #include "arm_watch.h"
+#include "arm_stdio.h"
+#include "arm_aio.h"
 
-struct arm32_cpu *curr_cpu;
+__thread struct arm32_cpu *curr_cpu; /* Running on this thread */
 
 unsigned int debuglevel = ARMETTE_ERROR;
 uint32_t arm_vdso[] = {ARM32_ARMETTE_RETURN_INSTRUCTION};
@@ -111,6 +114,39 @@ arm32_cpu_add_armette_vdso (struct arm32_cpu *cpu)
   return 0;
 }
 
+/* errno has a guest address from the start, so that &errno is valid
+   for arm32_cpu_call users that never run prepare_main */
+int
+arm32_cpu_add_runtime (struct arm32_cpu *cpu)
+{
+  struct arm32_segment *seg;
+  void *data;
+
+  if ((data = mmap (NULL, ARM32_DEFAULT_RUNTIME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0)) == (caddr_t) -1)
+    return -1;
+
+  if ((seg = arm32_segment_new (ARM32_DEFAULT_RUNTIME_BOTTOM, data, ARM32_DEFAULT_RUNTIME_SIZE, SA_R | SA_W)) == NULL)
+  {
+    munmap (data, ARM32_DEFAULT_RUNTIME_SIZE);
+
+    return -1;
+  }
+
+  arm32_segment_set_dtor (seg, __arm32_segment_mmap_dtor, NULL);
+
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    arm32_segment_destroy (seg);
+
+    return -1;
+  }
+
+  cpu->runtime.errno_ptr  = (uint32_t *) data;
+  cpu->runtime.errno_virt = ARM32_DEFAULT_RUNTIME_BOTTOM;
+
+  return 0;
+}
+
 struct arm32_cpu *
 arm32_cpu_new (void)
 {
@@ -119,14 +155,23 @@ arm32_cpu_new (void)
   if ((new = calloc (1, sizeof (struct arm32_cpu))) == NULL)
     return NULL;
 
+  new->runtime.optind       = &new->runtime.optind_local;
+  new->runtime.optind_local = 1;
+
   if (arm32_cpu_add_stack (new) == -1)
     goto fail;
   
   if (arm32_cpu_add_armette_vdso (new) == -1)
     goto fail;
 
+  if (arm32_cpu_add_runtime (new) == -1)
+    goto fail;
+
   if ((new->wps = arm32_watchpoint_set_new ()) == NULL)
     goto fail;
+
+  if ((new->dcache = arm32_decode_cache_new ()) == NULL)
+    goto fail;
   
   return new;
 
@@ -150,10 +195,8 @@ arm32_cpu_find_region (const struct arm32_cpu *cpu, uint32_t size, uint32_t alig
   {
     for (i = 0; i < cpu->segment_count; ++i)
       if (cpu->segment_list[i] != NULL)
-        if ((cpu->segment_list[i]->virt <= guess &&
-             guess < cpu->segment_list[i]->virt + cpu->segment_list[i]->size) ||
-            (cpu->segment_list[i]->virt <= guess + size - 1 &&
-             guess + size - 1 < cpu->segment_list[i]->virt + cpu->segment_list[i]->size))
+        if (cpu->segment_list[i]->virt <= guess + size - 1 &&
+            guess < cpu->segment_list[i]->virt + cpu->segment_list[i]->size)
           break;
     
     if (i < cpu->segment_count)
@@ -171,6 +214,24 @@ arm32_cpu_find_region (const struct arm32_cpu *cpu, uint32_t size, uint32_t alig
   return guess;
 }
 
+/* Nothing mapped in [virt, virt + size) */
+int
+arm32_cpu_region_is_free (const struct arm32_cpu *cpu, uint32_t virt, uint32_t size)
+{
+  int i;
+
+  if (virt + size < virt)
+    return 0;
+
+  for (i = 0; i < cpu->segment_count; ++i)
+    if (cpu->segment_list[i] != NULL)
+      if (cpu->segment_list[i]->virt < virt + size &&
+          virt < cpu->segment_list[i]->virt + cpu->segment_list[i]->size)
+        return 0;
+
+  return 1;
+}
+
 uint32_t
 arm32_map_rw_buffer (struct arm32_cpu *cpu, void *data, size_t size)
 {
@@ -306,6 +367,19 @@ arm32_cpu_destroy (struct arm32_cpu *cpu)
 
   if (cpu->wps != NULL)
     arm32_watchpoint_set_destroy (cpu->wps);
+
+  if (cpu->runtime.stdio != NULL)
+    arm32_stdio_destroy (cpu->runtime.stdio);
+
+  if (cpu->runtime.aio != NULL)
+    arm32_aio_destroy (cpu->runtime.aio);
+
+  if (cpu->runtime.iov_list != NULL)
+    free (cpu->runtime.iov_list);
+
+  /* Images may save it when destroyed, so it goes after them */
+  if (cpu->dcache != NULL)
+    arm32_decode_cache_destroy (cpu->dcache);
   
   free (cpu);
 }
@@ -0,0 +1,348 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "arm_cpu.h"
+#include "arm_inst.h"
+
+static void
+arm32_decode_region_destroy (struct arm32_decode_region *region)
+{
+  uint32_t i;
+
+  for (i = 0; i < (region->count + ARM32_DECODE_PAGE_ENTRIES - 1) >> ARM32_DECODE_PAGE_BITS; ++i)
+    if (region->page_list[i] != NULL)
+      free (region->page_list[i]);
+
+  free (region->page_list);
+  free (region);
+}
+
+struct arm32_decode_cache *
+arm32_decode_cache_new (void)
+{
+  return calloc (1, sizeof (struct arm32_decode_cache));
+}
+
+void
+arm32_decode_cache_destroy (struct arm32_decode_cache *cache)
+{
+  int i;
+
+  for (i = 0; i < cache->region_count; ++i)
+    if (cache->region_list[i] != NULL)
+      arm32_decode_region_destroy (cache->region_list[i]);
+
+  if (cache->region_list != NULL)
+    free (cache->region_list);
+
+  free (cache);
+}
+
+/* Forget the regions overlapping [virt, virt + size), as the segments
+   they were made for are unmapped or resized */
+void
+arm32_decode_cache_drop (struct arm32_decode_cache *cache, uint32_t virt, uint32_t size)
+{
+  struct arm32_decode_region *region;
+  int i;
+
+  for (i = 0; i < cache->region_count; ++i)
+    if ((region = cache->region_list[i]) != NULL)
+      if (region->virt < (uint64_t) virt + size && virt < (uint64_t) region->virt + ((uint64_t) region->count << 2))
+      {
+        if (cache->last == region)
+          cache->last = NULL;
+
+        arm32_decode_region_destroy (region);
+
+        cache->region_list[i] = NULL;
+      }
+}
+
+/* Regions cover whole executable segments, and are created the first
+   time code runs in them. Only their page directory is allocated then,
+   so large mappings holding little code stay cheap. */
+static struct arm32_decode_entry *
+arm32_decode_cache_lookup (struct arm32_cpu *cpu, uint32_t addr)
+{
+  struct arm32_decode_cache *cache = cpu->dcache;
+  struct arm32_decode_region *region;
+  struct arm32_decode_entry **page;
+  struct arm32_segment *seg;
+  uint32_t index;
+  int i;
+
+  if ((region = cache->last) == NULL || addr - region->virt >= region->count << 2)
+  {
+    for (i = 0; i < cache->region_count; ++i)
+      if ((region = cache->region_list[i]) != NULL)
+        if (addr - region->virt < region->count << 2)
+          break;
+
+    if (i == cache->region_count)
+    {
+      if ((seg = arm32_cpu_lookup_segment (cpu, addr)) == NULL || !(seg->flags & SA_X))
+        return NULL;
+
+      if ((region = malloc (sizeof (struct arm32_decode_region))) == NULL)
+        return NULL;
+
+      region->virt  = seg->virt;
+      region->count = seg->size >> 2;
+
+      if ((region->page_list = calloc ((region->count + ARM32_DECODE_PAGE_ENTRIES - 1) >> ARM32_DECODE_PAGE_BITS, sizeof (struct arm32_decode_entry *))) == NULL)
+      {
+        free (region);
+
+        return NULL;
+      }
+
+      if (PTR_LIST_APPEND_CHECK (cache->region, region) == -1)
+      {
+        arm32_decode_region_destroy (region);
+
+        return NULL;
+      }
+    }
+
+    cache->last = region;
+  }
+
+  index = (addr - region->virt) >> 2;
+  page  = &region->page_list[index >> ARM32_DECODE_PAGE_BITS];
+
+  if (*page == NULL)
+    if ((*page = calloc (ARM32_DECODE_PAGE_ENTRIES, sizeof (struct arm32_decode_entry))) == NULL)
+      return NULL;
+
+  return &(*page)[index & (ARM32_DECODE_PAGE_ENTRIES - 1)];
+}
+
+/* Entries are checked against the word just fetched, so code written
+   at runtime is decoded again */
+const struct arm32_inst *
+arm32_inst_decode_cached (struct arm32_cpu *cpu, uint32_t addr, uint32_t instruction)
+{
+  struct arm32_decode_entry *entry;
+  const struct arm32_inst *inst;
+
+  if ((entry = arm32_decode_cache_lookup (cpu, addr)) == NULL)
+    return arm32_inst_decode (cpu, instruction);
+
+  if (entry->inst != 0 && entry->word == instruction)
+    return arm32_inst_get (entry->inst - 1);
+
+  if ((inst = arm32_inst_decode (cpu, instruction)) != NULL)
+  {
+    entry->word = instruction;
+    entry->inst = arm32_inst_index (inst) + 1;
+
+    ++cpu->dcache->fill_count;
+  }
+
+  return inst;
+}
+
+/* Import records for [lo, hi) saved by a previous run. Records are only
+   trusted if guest memory still holds the same word and the instruction
+   they point to actually matches it, so a key that fails to tell two
+   files apart costs hits, never correctness. */
+int
+arm32_decode_cache_load (struct arm32_cpu *cpu, const char *path, uint64_t key, uint32_t bias, uint32_t lo, uint32_t hi)
+{
+  struct arm32_decode_cache_header header;
+  struct arm32_decode_record *record_list;
+  struct arm32_decode_entry *entry;
+  const struct arm32_inst *inst;
+  struct arm32_segment *seg;
+  uint32_t addr;
+  int fd;
+  int i, loaded = 0;
+
+  if ((fd = open (path, O_RDONLY)) == -1)
+    return -1;
+
+  if (read (fd, &header, sizeof (struct arm32_decode_cache_header)) != sizeof (struct arm32_decode_cache_header) ||
+      memcmp (header.magic, ARM32_DECODE_CACHE_MAGIC, sizeof (header.magic)) != 0 ||
+      header.version != ARM32_DECODE_CACHE_VERSION ||
+      header.table_hash != arm32_inst_table_hash () ||
+      header.key != key ||
+      header.count > (hi - lo) >> 2)
+  {
+    close (fd);
+
+    return -1;
+  }
+
+  if ((record_list = malloc (header.count * sizeof (struct arm32_decode_record))) == NULL)
+  {
+    close (fd);
+
+    return -1;
+  }
+
+  if (read (fd, record_list, header.count * sizeof (struct arm32_decode_record)) != header.count * sizeof (struct arm32_decode_record))
+  {
+    free (record_list);
+    close (fd);
+
+    return -1;
+  }
+
+  close (fd);
+
+  for (i = 0; i < header.count; ++i)
+  {
+    addr = record_list[i].addr + bias;
+
+    if (addr < lo || addr >= hi || (addr & 3))
+      continue;
+
+    if ((inst = arm32_inst_get (record_list[i].inst)) == NULL)
+      continue;
+
+    if (((record_list[i].word >> 4) & 0xffffff & inst->mask) != inst->opcode)
+      continue;
+
+    if ((seg = arm32_cpu_lookup_segment (cpu, addr)) == NULL || !(seg->flags & SA_X))
+      continue;
+
+    if (*(uint32_t *) arm32_segment_translate (seg, addr) != record_list[i].word)
+      continue;
+
+    if ((entry = arm32_decode_cache_lookup (cpu, addr)) == NULL)
+      continue;
+
+    entry->word = record_list[i].word;
+    entry->inst = record_list[i].inst + 1;
+
+    ++loaded;
+  }
+
+  free (record_list);
+
+  debug ("%s: %d of %d decoded instructions reused\n", path, loaded, header.count);
+
+  return loaded;
+}
+
+/* Written to a temporary file first, so concurrent runs never see it
+   incomplete */
+int
+arm32_decode_cache_save (const struct arm32_decode_cache *cache, const char *path, uint64_t key, uint32_t bias, uint32_t lo, uint32_t hi)
+{
+  struct arm32_decode_cache_header header;
+  struct arm32_decode_record record;
+  const struct arm32_decode_region *region;
+  const struct arm32_decode_entry *entry;
+  uint32_t addr;
+  uint32_t j;
+  FILE *fp;
+  char *tmp;
+  int fd;
+  int failed = 0;
+  int i;
+
+  if ((tmp = strbuild ("%s.XXXXXX", path)) == NULL)
+    return -1;
+
+  if ((fd = mkstemp (tmp)) == -1 || (fp = fdopen (fd, "wb")) == NULL)
+  {
+    warning ("Cannot create decode cache file %s: %s\n", tmp, strerror (errno));
+
+    if (fd != -1)
+    {
+      close (fd);
+      unlink (tmp);
+    }
+
+    free (tmp);
+
+    return -1;
+  }
+
+  memset (&header, 0, sizeof (struct arm32_decode_cache_header));
+
+  memcpy (header.magic, ARM32_DECODE_CACHE_MAGIC, sizeof (header.magic));
+
+  header.version    = ARM32_DECODE_CACHE_VERSION;
+  header.table_hash = arm32_inst_table_hash ();
+  header.key        = key;
+
+  /* Header is rewritten once the record count is known */
+  fwrite (&header, sizeof (struct arm32_decode_cache_header), 1, fp);
+
+  for (i = 0; i < cache->region_count; ++i)
+    if ((region = cache->region_list[i]) != NULL)
+      for (j = 0; j < region->count; ++j)
+      {
+        /* Skip whole pages never run */
+        if (region->page_list[j >> ARM32_DECODE_PAGE_BITS] == NULL)
+        {
+          j |= ARM32_DECODE_PAGE_ENTRIES - 1;
+          continue;
+        }
+
+        entry = &region->page_list[j >> ARM32_DECODE_PAGE_BITS][j & (ARM32_DECODE_PAGE_ENTRIES - 1)];
+
+        if (entry->inst != 0)
+        {
+          addr = region->virt + (j << 2);
+
+          if (addr < lo || addr >= hi)
+            continue;
+
+          record.addr = addr - bias;
+          record.word = entry->word;
+          record.inst = entry->inst - 1;
+
+          fwrite (&record, sizeof (struct arm32_decode_record), 1, fp);
+
+          ++header.count;
+        }
+      }
+
+  if (fseek (fp, 0, SEEK_SET) == -1 ||
+      fwrite (&header, sizeof (struct arm32_decode_cache_header), 1, fp) != 1 ||
+      fchmod (fd, 0644) == -1)
+    failed = 1;
+
+  if (fclose (fp) == EOF)
+    failed = 1;
+
+  if (failed || rename (tmp, path) == -1)
+  {
+    warning ("Cannot write decode cache file %s: %s\n", path, strerror (errno));
+    unlink (tmp);
+    free (tmp);
+
+    return -1;
+  }
+
+  free (tmp);
+
+  return header.count;
+}
@@ -17,17 +17,25 @@
  */
 
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#  include <x86intrin.h>
+#endif
 
 #include <arm_cpu.h>
 #include <arm_inst.h>
 #include <arm_elf.h>
+#include <arm_syscall.h>
 
-uint32_t arm_errno_virt;
-uint32_t *arm_errno;
+extern char **environ;
 
 static int
 arm32_elf_is_sane (const struct arm32_elf *elf)
@@ -67,11 +75,61 @@ arm32_elf_phdr_is_sane (const struct arm32_elf *elf, const Elf32_Phdr *phdr)
   return phdr->p_offset + phdr->p_filesz <= elf->size;    
 }
 
+static void
+arm32_elf_free_loads (struct arm32_elf_load *load_list, int count)
+{
+  int i;
+
+  if (load_list == NULL)
+    return;
+
+  for (i = 0; i < count; ++i)
+    if (load_list[i].map != NULL)
+      munmap (load_list[i].map, load_list[i].size);
+
+  free (load_list);
+}
+
+/* Address range of the executable segments */
+static void
+arm32_elf_exec_range (const struct arm32_elf *elf, uint32_t *lo, uint32_t *hi)
+{
+  int i;
+
+  *lo = 0xffffffff;
+  *hi = 0;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD && (elf->phdr[i].p_flags & PF_X))
+    {
+      if (elf->phdr[i].p_vaddr + elf->bias < *lo)
+        *lo = elf->phdr[i].p_vaddr + elf->bias;
+
+      if (elf->phdr[i].p_vaddr + elf->bias + elf->phdr[i].p_memsz > *hi)
+        *hi = elf->phdr[i].p_vaddr + elf->bias + elf->phdr[i].p_memsz;
+    }
+
+  if (*hi < *lo)
+    *lo = *hi = 0;
+}
+
 void
 arm32_elf_destroy (struct arm32_elf *elf)
 {
+  uint32_t lo, hi;
   int i;
 
+  if (elf->decode_cache_path != NULL)
+  {
+    if (elf->dcache != NULL && elf->dcache->fill_count != elf->decode_fill_mark)
+    {
+      arm32_elf_exec_range (elf, &lo, &hi);
+      arm32_decode_cache_save (elf->dcache, elf->decode_cache_path, elf->decode_cache_key, elf->bias, lo, hi);
+    }
+
+    free (elf->decode_cache_path);
+  }
+
   for (i = 0; i < elf->override_count; ++i)
     if (elf->override_list[i] != NULL)
     {
@@ -83,6 +141,30 @@ arm32_elf_destroy (struct arm32_elf *elf)
 
   if (elf->override_list != NULL)
     free (elf->override_list);
+
+  if (elf->override_index != NULL)
+    free (elf->override_index);
+
+  for (i = 0; i < elf->library_count; ++i)
+    if (elf->library_list[i] != NULL)
+      arm32_elf_destroy (elf->library_list[i]);
+
+  if (elf->library_list != NULL)
+    free (elf->library_list);
+
+  if (elf->name_index != NULL)
+    free (elf->name_index);
+
+  if (elf->sym_override != NULL)
+    free (elf->sym_override);
+
+  if (elf->debug_name_index != NULL)
+    free (elf->debug_name_index);
+
+  if (elf->debug_addr_list != NULL)
+    free (elf->debug_addr_list);
+
+  arm32_elf_free_loads (elf->load_list, elf->ehdr != NULL ? elf->ehdr->e_phnum : 0);
   
   if (elf->base != NULL && elf->base != (caddr_t) -1)
     munmap (elf->base, elf->size);
@@ -104,9 +186,18 @@ arm32_elf_segment_dtor (void *data, void *phys, uint32_t size)
 {
   struct arm32_elf *elf;
 
+  int i;
+
   elf = (struct arm32_elf *) data;
 
-  /* Segment is bigger in memory */
+  /* Segments with BSS are released along with the image, also when
+     mprotect has split them */
+  if (elf->load_list != NULL)
+    for (i = 0; i < elf->ehdr->e_phnum; ++i)
+      if (elf->load_list[i].map != NULL &&
+          elf->load_list[i].map <= phys && phys < elf->load_list[i].map + elf->load_list[i].size)
+        return;
+
   if (phys < elf->base || (elf->base + elf->size) <= phys)
     munmap (phys, size);
 }
@@ -116,17 +207,246 @@ arm32_elf_translate (struct arm32_elf *elf, uint32_t virt)
 {
   int i;
 
-  if (elf->rel != NULL && elf->tramp_vaddr <= virt && virt < elf->tramp_vaddr + elf->rel_size * 4)
+  if (elf->tramp_paddr != NULL && elf->tramp_vaddr <= virt && virt < elf->tramp_vaddr + elf->tramp_count * 4)
     return elf->tramp_paddr + (virt - elf->tramp_vaddr);
+
+  /* Program headers keep link addresses */
+  virt -= elf->bias;
   
   for (i = 0; i < elf->ehdr->e_phnum; ++i)
     if (elf->phdr[i].p_type == PT_LOAD)
-      if (elf->phdr[i].p_vaddr <= virt && virt < elf->phdr[i].p_vaddr + elf->phdr[i].p_filesz && elf->phdr[i].p_offset + elf->phdr[i].p_filesz <= elf->size)
+    {
+      if (elf->load_list != NULL && elf->load_list[i].data != NULL)
+      {
+        if (elf->phdr[i].p_vaddr <= virt && virt < elf->phdr[i].p_vaddr + elf->phdr[i].p_memsz)
+          return virt - elf->phdr[i].p_vaddr + elf->load_list[i].data;
+      }
+      else if (elf->phdr[i].p_vaddr <= virt && virt < elf->phdr[i].p_vaddr + elf->phdr[i].p_filesz && elf->phdr[i].p_offset + elf->phdr[i].p_filesz <= elf->size)
         return virt - elf->phdr[i].p_vaddr + elf->base + elf->phdr[i].p_offset;
+    }
 
   return NULL;
 }
 
+/* FNV-1a */
+uint64_t
+arm32_elf_content_hash (const void *data, size_t size)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i;
+
+  for (i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+  return hash;
+}
+
+static uint32_t
+arm32_elf_sysv_hash (const char *name)
+{
+  uint32_t h = 0;
+  uint32_t g;
+
+  while (*name)
+  {
+    h = (h << 4) + (uint8_t) *name++;
+
+    if ((g = h & 0xf0000000) != 0)
+      h ^= g >> 24;
+
+    h &= ~g;
+  }
+
+  return h;
+}
+
+uint32_t
+arm32_elf_gnu_hash (const char *name)
+{
+  uint32_t h = 5381;
+
+  while (*name)
+    h = (h << 5) + h + (uint8_t) *name++;
+
+  return h;
+}
+
+static const char *
+arm32_elf_symbol_name (const struct arm32_elf *elf, int idx)
+{
+  if (idx < 0 || idx >= elf->symtab_size || elf->symtab[idx].st_name >= elf->strtab_size)
+    return NULL;
+
+  return elf->strtab + elf->symtab[idx].st_name;
+}
+
+static int
+arm32_elf_sysv_lookup (const struct arm32_elf *elf, const char *name)
+{
+  const uint32_t *bucket = elf->hash + 2;
+  const uint32_t *chain  = bucket + elf->hash[0];
+  const char *symname;
+  uint32_t idx;
+  int steps = 0;
+
+  for (idx = bucket[arm32_elf_sysv_hash (name) % elf->hash[0]];
+       idx != STN_UNDEF && idx < elf->hash[1] && steps++ < elf->hash[1];
+       idx = chain[idx])
+    if ((symname = arm32_elf_symbol_name (elf, idx)) != NULL && strcmp (symname, name) == 0)
+      return idx;
+
+  return -1;
+}
+
+static int
+arm32_elf_gnu_lookup (const struct arm32_elf *elf, const char *name)
+{
+  uint32_t nbuckets  = elf->gnu_hash[0];
+  uint32_t symoffset = elf->gnu_hash[1];
+  uint32_t bloomsize = elf->gnu_hash[2];
+  uint32_t shift     = elf->gnu_hash[3];
+  const uint32_t *bloom  = elf->gnu_hash + 4;
+  const uint32_t *bucket = bloom + bloomsize;
+  const uint32_t *chain  = bucket + nbuckets - symoffset;
+  const char *symname;
+  uint32_t h, word, mask;
+  uint32_t idx;
+
+  if (nbuckets == 0 || bloomsize == 0)
+    return -1;
+
+  h = arm32_elf_gnu_hash (name);
+
+  word = bloom[(h / 32) % bloomsize];
+  mask = (1u << (h % 32)) | (1u << ((h >> shift) % 32));
+
+  if ((word & mask) != mask)
+    return -1;
+
+  if ((idx = bucket[h % nbuckets]) < symoffset)
+    return -1;
+
+  for (; idx < elf->symtab_size; ++idx)
+  {
+    if ((chain[idx] | 1) == (h | 1))
+      if ((symname = arm32_elf_symbol_name (elf, idx)) != NULL && strcmp (symname, name) == 0)
+        return idx;
+
+    if (chain[idx] & 1)
+      break;
+  }
+
+  return -1;
+}
+
+/* Open addressing name index over a symbol table (entries are index + 1) */
+static int *
+arm32_elf_name_index_new (const Elf32_Sym *symtab, const char *strtab, int strtab_size, int count, uint32_t *mask)
+{
+  int *index;
+  uint32_t size = 16;
+  uint32_t slot;
+  int i;
+
+  while (size < 2 * count)
+    size <<= 1;
+
+  if ((index = calloc (size, sizeof (int))) == NULL)
+    return NULL;
+
+  *mask = size - 1;
+
+  for (i = 1; i < count; ++i)
+    if (symtab[i].st_name < strtab_size && strtab[symtab[i].st_name] != '\0')
+    {
+      for (slot = arm32_elf_gnu_hash (strtab + symtab[i].st_name) & *mask;
+           index[slot] != 0;
+           slot = (slot + 1) & *mask);
+
+      index[slot] = i + 1;
+    }
+
+  return index;
+}
+
+static int
+arm32_elf_name_index_lookup (const int *index, uint32_t mask, const Elf32_Sym *symtab, const char *strtab, int strtab_size, const char *name)
+{
+  uint32_t slot;
+
+  for (slot = arm32_elf_gnu_hash (name) & mask;
+       index[slot] != 0;
+       slot = (slot + 1) & mask)
+    if (symtab[index[slot] - 1].st_name < strtab_size)
+      if (strcmp (strtab + symtab[index[slot] - 1].st_name, name) == 0)
+        return index[slot] - 1;
+
+  return -1;
+}
+
+int
+arm32_elf_lookup_symbol (const struct arm32_elf *elf, const char *name)
+{
+  int idx;
+
+  if (!elf->symtab_sane)
+    return -1;
+
+  if (elf->hash != NULL)
+    return arm32_elf_sysv_lookup (elf, name);
+
+  if (elf->gnu_hash != NULL)
+    if ((idx = arm32_elf_gnu_lookup (elf, name)) != -1)
+      return idx;
+
+  if (elf->name_index != NULL)
+    return arm32_elf_name_index_lookup (elf->name_index, elf->name_index_mask, elf->symtab, elf->strtab, elf->strtab_size, name);
+
+  return -1;
+}
+
+/* Move link addresses in the dynamic section to load addresses, much
+   like ld.so does */
+static void
+arm32_elf_bias_dynamic (struct arm32_elf *elf, Elf32_Dyn *dyn, int count)
+{
+  int i;
+
+  for (i = 0; i < count && dyn[i].d_tag != DT_NULL; ++i)
+    switch (dyn[i].d_tag)
+    {
+    case DT_PLTGOT:
+    case DT_HASH:
+    case DT_GNU_HASH:
+    case DT_STRTAB:
+    case DT_SYMTAB:
+    case DT_RELA:
+    case DT_REL:
+    case DT_JMPREL:
+    case DT_INIT:
+    case DT_FINI:
+    case DT_INIT_ARRAY:
+    case DT_FINI_ARRAY:
+    case DT_PREINIT_ARRAY:
+    case DT_VERSYM:
+    case DT_VERDEF:
+    case DT_VERNEED:
+      dyn[i].d_un.d_ptr += elf->bias;
+      break;
+    }
+}
+
+static void
+arm32_elf_bias_symbols (struct arm32_elf *elf, Elf32_Sym *symtab, int count)
+{
+  int i;
+
+  for (i = 1; i < count; ++i)
+    if (symtab[i].st_shndx != SHN_UNDEF && symtab[i].st_shndx < SHN_LORESERVE)
+      symtab[i].st_value += elf->bias;
+}
+
 void
 arm32_elf_dynamic_init (struct arm32_elf *elf)
 {
@@ -136,8 +456,11 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
   Elf32_Phdr *dynamic = NULL;
   Elf32_Dyn *dyn;
 
-  uint32_t *hash;
+  uint32_t *chain;
   uint32_t strtab_virt;
+  uint32_t hash_virt = 0;
+  uint32_t gnu_hash_virt = 0;
+  uint32_t last;
   
   for (i = 0; i < elf->ehdr->e_phnum; ++i)
     if (elf->phdr[i].p_type == PT_DYNAMIC)
@@ -157,7 +480,13 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
   }
     
   dynamic_entries = dynamic->p_filesz / sizeof (Elf32_Dyn);
-  dyn = (Elf32_Dyn *) (elf->base + dynamic->p_offset);
+  /* Go through the segment, in case it is not backed by the file image */
+  if ((dyn = (Elf32_Dyn *) arm32_elf_translate (elf, dynamic->p_vaddr + elf->bias)) == NULL)
+    dyn = (Elf32_Dyn *) (elf->base + dynamic->p_offset);
+
+  /* Prelinked images have this done already */
+  if (elf->bias != 0 && !elf->prelinked)
+    arm32_elf_bias_dynamic (elf, dyn, dynamic_entries);
   
   for (i = 0; i < dynamic_entries; ++i)
   {
@@ -176,26 +505,13 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
       break;
 
     case DT_HASH:
-      if ((hash = (uint32_t *) arm32_elf_translate (elf, dyn[i].d_un.d_ptr)) != NULL)
-        elf->symtab_size = hash[1];
-      else
+      if ((elf->hash = (uint32_t *) arm32_elf_translate (elf, hash_virt = dyn[i].d_un.d_ptr)) == NULL)
         error ("arm32_elf_dynamic_init: cannot translate DT_HASH address (0x%x)\n", dyn[i].d_un.d_ptr);
             
       break;
 
     case DT_GNU_HASH:
-      if ((hash = (uint32_t *) arm32_elf_translate (elf, dyn[i].d_un.d_ptr)) != NULL)
-      {
-	/* Extremely dangerous. Check whether traversing hash[0] entries is safe */
-        elf->symtab_size = 0;
-	elf->symtab_first = hash[1] - 1;
-	for (j = 0; j < hash[0]; ++j)
-	  if (elf->symtab_size < hash[4 + hash[2] + j])
-	    elf->symtab_size = hash[4 + hash[2] + j];
-
-	++elf->symtab_size;
-      }
-      else
+      if ((elf->gnu_hash = (uint32_t *) arm32_elf_translate (elf, gnu_hash_virt = dyn[i].d_un.d_ptr)) == NULL)
         error ("arm32_elf_dynamic_init: cannot translate DT_GNU_HASH address (0x%x)\n", dyn[i].d_un.d_ptr);
             
       break;
@@ -214,6 +530,15 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
       elf->rel_size = dyn[i].d_un.d_val / sizeof (Elf32_Rel);
       break;
 
+    case DT_REL:
+      if ((elf->dynrel = (Elf32_Rel *) arm32_elf_translate (elf, dyn[i].d_un.d_ptr)) == NULL)
+	error ("arm32_elf_dynamic_init: broken DT_REL relocations\n");
+      break;
+
+    case DT_RELSZ:
+      elf->dynrel_size = dyn[i].d_un.d_val / sizeof (Elf32_Rel);
+      break;
+
     case DT_STRTAB:
       if ((elf->strtab = (char *) arm32_elf_translate (elf, strtab_virt = dyn[i].d_un.d_ptr)) == NULL)
         error ("arm32_elf_dynamic_init: cannot translate DT_STRTAB address (0x%x)\n", dyn[i].d_un.d_ptr);
@@ -229,6 +554,59 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
 
       elf->rel = NULL;
     }
+
+  if (elf->dynrel != NULL)
+    if ((void *) elf->dynrel + elf->dynrel_size * sizeof (Elf32_Rel) > elf->base + elf->size)
+    {
+      warning ("arm32_elf_dynamic_init: broken DT_REL relocations\n");
+
+      elf->dynrel = NULL;
+    }
+  
+  /* Both tables must be fully accessible before trusting them */
+  if (elf->gnu_hash != NULL)
+  {
+    if (arm32_elf_translate (elf, gnu_hash_virt + 16 * sizeof (uint32_t) - 1) == NULL ||
+        arm32_elf_translate (elf, gnu_hash_virt + (4 + elf->gnu_hash[2] + elf->gnu_hash[0]) * sizeof (uint32_t) - 1) == NULL)
+    {
+      error ("arm32_elf_dynamic_init: broken DT_GNU_HASH\n");
+      elf->gnu_hash = NULL;
+    }
+    else
+    {
+      /* Symbol count: follow the chain of the highest bucket to its end */
+      last = 0;
+
+      for (j = 0; j < elf->gnu_hash[0]; ++j)
+        if (last < elf->gnu_hash[4 + elf->gnu_hash[2] + j])
+          last = elf->gnu_hash[4 + elf->gnu_hash[2] + j];
+
+      if (last < elf->gnu_hash[1])
+        elf->symtab_size = elf->gnu_hash[1];
+      else
+      {
+        chain = elf->gnu_hash + 4 + elf->gnu_hash[2] + elf->gnu_hash[0] - elf->gnu_hash[1];
+
+        while (arm32_elf_translate (elf, gnu_hash_virt + (chain + last - elf->gnu_hash) * sizeof (uint32_t) + 3) != NULL && !(chain[last] & 1))
+          ++last;
+
+        elf->symtab_size = last + 1;
+      }
+    }
+  }
+
+  if (elf->hash != NULL)
+  {
+    if (arm32_elf_translate (elf, hash_virt + 2 * sizeof (uint32_t) - 1) == NULL ||
+        arm32_elf_translate (elf, hash_virt + (2 + elf->hash[0] + elf->hash[1]) * sizeof (uint32_t) - 1) == NULL ||
+        elf->hash[0] == 0)
+    {
+      error ("arm32_elf_dynamic_init: broken DT_HASH\n");
+      elf->hash = NULL;
+    }
+    else
+      elf->symtab_size = elf->hash[1];
+  }
   
   if (elf->got != NULL && elf->symtab != NULL && elf->symtab_size > 0 && elf->strtab != NULL && elf->strtab_size > 0)
   {
@@ -238,6 +616,31 @@ arm32_elf_dynamic_init (struct arm32_elf *elf)
     else
       elf->symtab_sane = 1;
   }
+
+  if (elf->symtab_sane)
+  {
+    if (elf->bias != 0 && !elf->prelinked)
+      arm32_elf_bias_symbols (elf, elf->symtab, elf->symtab_size);
+    
+    if ((elf->sym_override = malloc (elf->symtab_size * sizeof (int))) == NULL)
+    {
+      elf->symtab_sane = 0;
+      return;
+    }
+
+    for (i = 0; i < elf->symtab_size; ++i)
+      elf->sym_override[i] = -1;
+
+    /* GNU hash tables leave undefined symbols out */
+    if (elf->hash == NULL)
+      if ((elf->name_index = arm32_elf_name_index_new (
+             elf->symtab,
+             elf->strtab,
+             elf->strtab_size,
+             elf->gnu_hash != NULL ? elf->gnu_hash[1] : elf->symtab_size,
+             &elf->name_index_mask)) == NULL)
+        elf->symtab_sane = 0;
+  }
 }
 
 int
@@ -254,98 +657,396 @@ __pltdtor (void *data, void *addr, uint32_t size)
   free (addr);
 }
 
-int
-arm32_elf_fix_relocations (struct arm32_cpu *cpu, struct arm32_elf *elf)
+/* Relocations that can be applied to the file image once and for all:
+   they do not depend on imports and their target is in the file */
+static int
+arm32_elf_reloc_is_static (struct arm32_elf *elf, const Elf32_Rel *rel)
 {
-  int i;
-  uint32_t tramp_seg;
-  struct arm32_segment *seg;
-  void *mem;
-  uint32_t *unit;
-  
-  /* Fix relocations shall create an executable segment
-     with a set of trampolines to be filled with fix_imports.
+  uint32_t sym = ELF32_R_SYM (rel->r_info);
 
-     Symbol addresses will hold the trampoline location. No
-     further modifications should be necessary.
-  */
+  if (arm32_elf_translate (elf, rel->r_offset + elf->bias) == NULL ||
+      arm32_elf_translate (elf, rel->r_offset + elf->bias + 3) == NULL)
+    return 0;
 
-  if (elf->rel != NULL)
+  if (sym != STN_UNDEF)
+    if (!elf->symtab_sane || sym >= elf->symtab_size || elf->symtab[sym].st_shndx == SHN_UNDEF)
+      return 0;
+
+  return 1;
+}
+
+static int
+arm32_elf_apply_reloc (struct arm32_elf *elf, const Elf32_Rel *rel, uint32_t *unit, uint32_t value)
+{
+  switch (ELF32_R_TYPE (rel->r_info))
   {
+  case R_ARM_RELATIVE:
+    *unit += elf->bias;
+    break;
+
+  case R_ARM_ABS32:
+    *unit += value;
+    break;
+
+  case R_ARM_GLOB_DAT:
+  case R_ARM_JUMP_SLOT:
+    *unit = value;
+    break;
+
+  case R_ARM_NONE:
+  case R_ARM_COPY: /* See arm32_elf_copy_import */
+    break;
     
-    if ((tramp_seg = arm32_cpu_find_region (cpu, elf->rel_size * 4, 4)) == -1)
-    {
-      error ("Cannot find address for plt trampolines\n");
+  default:
+    return -1;
+  }
 
-      return -1;
-    }
+  return 0;
+}
 
-    if ((mem = malloc (elf->rel_size * 4)) == NULL)
-    {
-      error ("Memory exhausted\n");
+/* Apply DT_REL relocations against the file image. This is what the
+   prelink cache saves. */
+static void
+arm32_elf_relocate_image (struct arm32_elf *elf)
+{
+  uint32_t sym;
+  int i;
 
-      return -1;
-    }
-    
-    if ((seg = arm32_segment_new (tramp_seg, mem, elf->rel_size * 4, SA_R | SA_X)) == NULL)
+  for (i = 0; i < elf->dynrel_size; ++i)
+    if (arm32_elf_reloc_is_static (elf, &elf->dynrel[i]))
     {
-      free (mem);
-
-      error ("Memory exhausted\n");
-
-      return -1;
+      sym = ELF32_R_SYM (elf->dynrel[i].r_info);
+    
+      if (arm32_elf_apply_reloc (
+            elf,
+            &elf->dynrel[i],
+            arm32_elf_translate (elf, elf->dynrel[i].r_offset + elf->bias),
+            sym == STN_UNDEF ? 0 : elf->symtab[sym].st_value) == -1)
+        error ("Unsupported relocation type for DT_REL #%d (%d)\n", i, ELF32_R_TYPE (elf->dynrel[i].r_info));
     }
+}
 
-    arm32_segment_set_dtor (seg, __pltdtor, NULL);
+/* Address of an undefined symbol: its trampoline, created on demand,
+   or the emulator's own copy of the object for data imports */
+static uint32_t
+arm32_elf_import_address (struct arm32_cpu *cpu, struct arm32_elf *elf, uint32_t sym)
+{
+  const char *name;
+  
+  if (elf->symtab[sym].st_value != 0)
+    return elf->symtab[sym].st_value;
 
-    if (arm32_cpu_add_segment (cpu, seg) == -1)
-    {
-      arm32_segment_destroy (seg);
+  name = elf->symtab[sym].st_name < elf->strtab_size ? elf->strtab + elf->symtab[sym].st_name : "<unknown>";
 
-      error ("Memory exhausted\n");
+  if ((elf->symtab[sym].st_value = arm32_stdlib_data_import (cpu, name)) != 0)
+    return elf->symtab[sym].st_value;
 
-      return -1;
-    }
-    
-    elf->tramp_vaddr = tramp_seg;
-    elf->tramp_paddr = mem;
+  /* Unprovided weak symbols stay NULL, as programs test for them */
+  if (ELF32_ST_BIND (elf->symtab[sym].st_info) == STB_WEAK && arm32_stdlib_hook_lookup (name) == NULL)
+    return 0;
+  
+  if (ELF32_ST_TYPE (elf->symtab[sym].st_info) == STT_OBJECT)
+  {
+    warning ("Data import `%s' cannot be resolved\n", name);
     
-    for (i = 0; i < elf->rel_size; ++i)
-    {
-      if ((unit = arm32_cpu_translate_write_size (cpu, elf->rel[i].r_offset, 4)) == NULL)
-      {
-	error ("Broken relocation for symbol #%d (addr 0x%x unmapped)\n", i, elf->rel[i].r_offset);
-	continue;
-      }
-      
-      elf->symtab[ELF32_R_SYM (elf->rel[i].r_info)].st_value = tramp_seg + i * 4;
-
-      switch (ELF32_R_TYPE (elf->rel[i].r_info))
-      {
-      case R_ARM_JUMP_SLOT:
-	*unit = elf->symtab[ELF32_R_SYM (elf->rel[i].r_info)].st_value;
-	break;
+    return 0;
+  }
 
-      default:
-	error ("Unsupported relocation type for symbol #%d (%d)\n", i, ELF32_R_TYPE (elf->rel[i].r_info));
+  if (elf->tramp_used == elf->tramp_count)
+    return 0;
+  
+  return elf->symtab[sym].st_value = elf->tramp_vaddr + 4 * elf->tramp_used++;
+}
 
-	continue;
-      }
+/* Relocation targets may live in read-only segments (text relocations
+   against imported data), so guest permissions are not checked here */
+static uint32_t *
+arm32_elf_reloc_target (struct arm32_cpu *cpu, uint32_t virt)
+{
+  struct arm32_segment *seg;
+
+  if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL)
+    return NULL;
+
+  if (seg->virt + seg->size < virt + 4)
+    return NULL;
+
+  return (uint32_t *) arm32_segment_translate (seg, virt);
+}
+
+/* Executables keep their own copy of the data objects they import.
+   Only those the emulator provides can be filled in. */
+static void
+arm32_elf_copy_import (struct arm32_cpu *cpu, struct arm32_elf *elf, const Elf32_Rel *rel)
+{
+  const Elf32_Sym *sym;
+  const void *src;
+  void *dest;
+  uint32_t virt;
+
+  if (ELF32_R_SYM (rel->r_info) >= elf->symtab_size)
+    return;
+
+  sym = &elf->symtab[ELF32_R_SYM (rel->r_info)];
+
+  if (sym->st_name >= elf->strtab_size || sym->st_size == 0)
+    return;
+
+  if ((virt = arm32_stdlib_data_import (cpu, elf->strtab + sym->st_name)) == 0)
+    return;
+
+  if ((src = arm32_cpu_translate_read_size (cpu, virt, sym->st_size)) == NULL ||
+      (dest = arm32_cpu_translate_write_size (cpu, rel->r_offset + elf->bias, sym->st_size)) == NULL)
+  {
+    error ("Cannot copy data import `%s' to 0x%x\n", elf->strtab + sym->st_name, rel->r_offset + elf->bias);
+    return;
+  }
+
+  memcpy (dest, src, sym->st_size);
+}
+
+int
+arm32_elf_fix_relocations (struct arm32_cpu *cpu, struct arm32_elf *elf)
+{
+  int i;
+  uint32_t tramp_seg;
+  uint32_t sym;
+  uint32_t value;
+  struct arm32_segment *seg;
+  void *mem;
+  uint32_t *unit;
+  
+  /* Fix relocations shall create an executable segment
+     with a set of trampolines to be filled with fix_imports.
+
+     Symbol addresses will hold the trampoline location. No
+     further modifications should be necessary.
+
+     DT_REL relocations on the file image are done already
+     (see arm32_elf_relocate_image), only the ones against
+     imports or outside the file are left.
+  */
+
+  if (!elf->symtab_sane)
+    return 0;
+  
+  if (elf->rel == NULL)
+    elf->rel_size = 0;
+
+  if (elf->dynrel == NULL)
+    elf->dynrel_size = 0;
+  
+  /* One trampoline per imported PLT slot, plus room for imports only
+     referenced from DT_REL. Slots of defined symbols point to them. */
+  elf->tramp_count = elf->dynrel_size;
+
+  for (i = 0; i < elf->rel_size; ++i)
+    if ((sym = ELF32_R_SYM (elf->rel[i].r_info)) < elf->symtab_size &&
+        elf->symtab[sym].st_shndx == SHN_UNDEF)
+      ++elf->tramp_count;
+  
+  if (elf->tramp_count > 0)
+  {
+    if ((tramp_seg = arm32_cpu_find_region (cpu, elf->tramp_count * 4, 4)) == -1)
+    {
+      error ("Cannot find address for plt trampolines\n");
+
+      return -1;
+    }
+
+    if ((mem = malloc (elf->tramp_count * 4)) == NULL)
+    {
+      error ("Memory exhausted\n");
+
+      return -1;
+    }
+    
+    if ((seg = arm32_segment_new (tramp_seg, mem, elf->tramp_count * 4, SA_R | SA_X)) == NULL)
+    {
+      free (mem);
+
+      error ("Memory exhausted\n");
+
+      return -1;
+    }
+
+    arm32_segment_set_dtor (seg, __pltdtor, elf);
+
+    if (arm32_cpu_add_segment (cpu, seg) == -1)
+    {
+      arm32_segment_destroy (seg);
+
+      error ("Memory exhausted\n");
+
+      return -1;
+    }
+    
+    elf->tramp_vaddr = tramp_seg;
+    elf->tramp_paddr = mem;
+    elf->tramp_used  = 0;
+  }
+    
+  for (i = 0; i < elf->rel_size; ++i)
+  {
+    if ((sym = ELF32_R_SYM (elf->rel[i].r_info)) >= elf->symtab_size)
+    {
+      error ("Broken relocation for symbol #%d (symbol %d out of bounds)\n", i, sym);
+      continue;
+    }
+    
+    if ((unit = arm32_elf_reloc_target (cpu, elf->rel[i].r_offset + elf->bias)) == NULL)
+    {
+      error ("Broken relocation for symbol #%d (addr 0x%x unmapped)\n", i, elf->rel[i].r_offset + elf->bias);
+      continue;
+    }
+      
+    switch (ELF32_R_TYPE (elf->rel[i].r_info))
+    {
+    case R_ARM_JUMP_SLOT:
+      /* Defined symbols are biased already (see arm32_elf_bias_symbols),
+         imports may hold their PLT stub address until given a trampoline */
+      if (elf->symtab[sym].st_shndx == SHN_UNDEF &&
+          (elf->symtab[sym].st_value < elf->tramp_vaddr ||
+           elf->symtab[sym].st_value >= elf->tramp_vaddr + 4 * elf->tramp_used))
+        elf->symtab[sym].st_value = elf->tramp_vaddr + 4 * elf->tramp_used++;
+      
+      *unit = elf->symtab[sym].st_value;
+      break;
+
+    default:
+      error ("Unsupported relocation type for symbol #%d (%d)\n", i, ELF32_R_TYPE (elf->rel[i].r_info));
+
+      continue;
+    }
+  }
+
+  for (i = 0; i < elf->dynrel_size; ++i)
+  {
+    if (ELF32_R_TYPE (elf->dynrel[i].r_info) == R_ARM_COPY)
+    {
+      arm32_elf_copy_import (cpu, elf, &elf->dynrel[i]);
+      continue;
     }
+
+    if (arm32_elf_reloc_is_static (elf, &elf->dynrel[i]))
+      continue;
+    
+    if ((sym = ELF32_R_SYM (elf->dynrel[i].r_info)) >= elf->symtab_size)
+    {
+      error ("Broken DT_REL relocation #%d (symbol %d out of bounds)\n", i, sym);
+      continue;
+    }
+    
+    if ((unit = arm32_elf_reloc_target (cpu, elf->dynrel[i].r_offset + elf->bias)) == NULL)
+    {
+      error ("Broken DT_REL relocation #%d (addr 0x%x unmapped)\n", i, elf->dynrel[i].r_offset + elf->bias);
+      continue;
+    }
+
+    if (sym == STN_UNDEF)
+      value = 0;
+    else if (elf->symtab[sym].st_shndx == SHN_UNDEF)
+      value = arm32_elf_import_address (cpu, elf, sym);
+    else
+      value = elf->symtab[sym].st_value;
+
+    if (arm32_elf_apply_reloc (elf, &elf->dynrel[i], unit, value) == -1)
+      error ("Unsupported relocation type for DT_REL #%d (%d)\n", i, ELF32_R_TYPE (elf->dynrel[i].r_info));
   }
 
   return 0;
 }
 
+/* Imports with a native hook are bound to it right away if the main
+   image was loaded with ARM32_ELF_STDLIB_HOOKS */
 void
 arm32_elf_fix_imports (struct arm32_elf *elf)
 {
+  struct arm32_elf *owner = ARM32_ELF_OWNER (elf);
+  const struct arm32_stdlib_hook *hook;
   int i;
 
   if (elf->symtab_sane)
     for (i = elf->symtab_first; i < elf->symtab_size; ++i)
-      if (elf->symtab[i].st_name < elf->strtab_size)
-	arm32_cpu_define_symbol (elf, elf->strtab + elf->symtab[i].st_name, i, arm32_elf_dummy_import, NULL);
+      if (elf->symtab[i].st_name < elf->strtab_size && elf->symtab[i].st_shndx == SHN_UNDEF)
+      {
+        hook = arm32_stdlib_hook_lookup (elf->strtab + elf->symtab[i].st_name);
+
+        if (hook != NULL && owner->stdlib_hooks)
+          arm32_cpu_define_symbol (elf, hook->name, i, hook->callback, hook->data);
+        else
+          arm32_cpu_define_symbol (elf, elf->strtab + elf->symtab[i].st_name, i, arm32_elf_dummy_import, NULL);
+      }
+}
+
+static int
+arm32_elf_symbol_addr_cmp (const void *a, const void *b)
+{
+  const struct arm32_elf_symbol_addr *sa = (const struct arm32_elf_symbol_addr *) a;
+  const struct arm32_elf_symbol_addr *sb = (const struct arm32_elf_symbol_addr *) b;
+
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+
+  /* Aliases: sized symbols go last, so they survive deduplication */
+  if ((sa->size != 0) != (sb->size != 0))
+    return sa->size != 0 ? 1 : -1;
+
+  return sa->index - sb->index;
+}
+
+static void
+arm32_elf_index_debug_symbols (struct arm32_elf *elf)
+{
+  const Elf32_Sym *sym;
+  const char *name;
+  int i, j;
+  
+  elf->debug_name_index = arm32_elf_name_index_new (
+    elf->debug_symtab,
+    elf->debug_strtab,
+    elf->debug_strtab_size,
+    elf->debug_symtab_size,
+    &elf->debug_name_index_mask);
+
+  if ((elf->debug_addr_list = malloc (elf->debug_symtab_size * sizeof (struct arm32_elf_symbol_addr))) == NULL)
+    return;
+
+  for (i = 1; i < elf->debug_symtab_size; ++i)
+  {
+    sym = &elf->debug_symtab[i];
+    
+    if (sym->st_name >= elf->debug_strtab_size || sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE)
+      continue;
+
+    /* Skip ARM mapping symbols ($a, $d, $t) and unnamed symbols */
+    name = elf->debug_strtab + sym->st_name;
+    
+    if (*name == '\0' || *name == '$')
+      continue;
+    
+    switch (ELF32_ST_TYPE (sym->st_info))
+    {
+    case STT_FUNC:
+    case STT_OBJECT:
+    case STT_NOTYPE:
+      elf->debug_addr_list[elf->debug_addr_count].addr  = sym->st_value & (ELF32_ST_TYPE (sym->st_info) == STT_FUNC ? ~1 : ~0);
+      elf->debug_addr_list[elf->debug_addr_count].size  = sym->st_size;
+      elf->debug_addr_list[elf->debug_addr_count].index = i;
+      
+      ++elf->debug_addr_count;
+      break;
+    }
+  }
+
+  qsort (elf->debug_addr_list, elf->debug_addr_count, sizeof (struct arm32_elf_symbol_addr), arm32_elf_symbol_addr_cmp);
+
+  /* Keep one symbol per address */
+  for (i = j = 0; i < elf->debug_addr_count; ++i)
+    if (i + 1 == elf->debug_addr_count || elf->debug_addr_list[i].addr != elf->debug_addr_list[i + 1].addr)
+      elf->debug_addr_list[j++] = elf->debug_addr_list[i];
+
+  elf->debug_addr_count = j;
 }
 
 void
@@ -374,250 +1075,1084 @@ arm32_elf_init_debug_symbols (struct arm32_elf *elf)
             
             elf->debug_symtab_size = shdrs[i].sh_size / sizeof (Elf32_Sym);
             elf->debug_strtab_size = shdrs[shdrs[i].sh_link].sh_size;
-            
+
             return;
           }
     
   }
 }
 
-uint32_t
-arm32_elf_resolve_debug_symbol (struct arm32_elf *elf, const char *name)
+/* Large symbol tables are only walked if somebody asks for symbols */
+static void
+arm32_elf_prepare_debug_symbols (struct arm32_elf *elf)
+{
+  if (elf->debug_indexed)
+    return;
+
+  elf->debug_indexed = 1;
+
+  if (elf->debug_symtab == NULL)
+    return;
+
+  if (elf->bias != 0 && !elf->prelinked)
+    arm32_elf_bias_symbols (elf, elf->debug_symtab, elf->debug_symtab_size);
+
+  arm32_elf_index_debug_symbols (elf);
+}
+
+static int
+arm32_elf_find_debug_symbol (struct arm32_elf *elf, const char *name)
 {
   int i;
 
+  arm32_elf_prepare_debug_symbols (elf);
+
+  if (elf->debug_name_index != NULL)
+    return arm32_elf_name_index_lookup (elf->debug_name_index, elf->debug_name_index_mask, elf->debug_symtab, elf->debug_strtab, elf->debug_strtab_size, name);
+  
   for (i = 0; i < elf->debug_symtab_size; ++i)
     if (elf->debug_symtab[i].st_name < elf->debug_strtab_size)
       if (strcmp (elf->debug_strtab + elf->debug_symtab[i].st_name, name) == 0)
-        return elf->debug_symtab[i].st_value;
+        return i;
 
-  return 0;
+  return -1;
 }
 
+static uint32_t
+arm32_elf_resolve_own_debug_symbol (struct arm32_elf *elf, const char *name)
+{
+  int i;
 
-struct arm32_cpu *
-arm32_cpu_new_from_elf (const char *path)
+  if ((i = arm32_elf_find_debug_symbol (elf, name)) == -1)
+    return 0;
+
+  return elf->debug_symtab[i].st_value;
+}
+
+uint32_t
+arm32_elf_resolve_debug_symbol (struct arm32_elf *elf, const char *name)
 {
-  struct arm32_cpu *new = NULL;
-  struct arm32_segment *seg;
-  
-  void *base;
-  void *seg_base;
+  uint32_t addr;
+  int i;
 
-  size_t size;
-  size_t seg_size;
+  if ((addr = arm32_elf_resolve_own_debug_symbol (elf, name)) != 0)
+    return addr;
 
-  uint8_t seg_flags;
-  
-  int fd;
+  for (i = 0; i < elf->library_count; ++i)
+    if (elf->library_list[i] != NULL)
+      if ((addr = arm32_elf_resolve_own_debug_symbol (elf->library_list[i], name)) != 0)
+        return addr;
+
+  return 0;
+}
+
+static int
+arm32_elf_contains (const struct arm32_elf *elf, uint32_t addr)
+{
   int i;
-  
-  struct arm32_elf *elf = NULL; 
-  
-  if ((fd = open (path, O_RDONLY)) == -1)
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD)
+      if (elf->phdr[i].p_vaddr + elf->bias <= addr && addr - (elf->phdr[i].p_vaddr + elf->bias) < elf->phdr[i].p_memsz)
+        return 1;
+
+  return 0;
+}
+
+static const char *
+arm32_elf_symbolize_own (struct arm32_elf *elf, uint32_t addr, uint32_t *offset)
+{
+  const struct arm32_elf_symbol_addr *sym;
+  int lo, hi, mid;
+
+  arm32_elf_prepare_debug_symbols (elf);
+
+  if (elf->debug_addr_count == 0 || addr < elf->debug_addr_list[0].addr || !arm32_elf_contains (elf, addr))
     return NULL;
 
-  size = lseek (fd, 0, SEEK_END);
+  /* Last symbol whose address is <= addr */
+  lo = 0;
+  hi = elf->debug_addr_count - 1;
 
-  if (size < sizeof (Elf32_Ehdr))
+  while (lo < hi)
   {
-    close (fd);
-    
-    errno = ENOEXEC;
+    mid = lo + (hi - lo + 1) / 2;
 
-    return NULL;
+    if (elf->debug_addr_list[mid].addr <= addr)
+      lo = mid;
+    else
+      hi = mid - 1;
   }
 
-  base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-  
-  close (fd);
+  sym = &elf->debug_addr_list[lo];
 
-  if (base == (caddr_t) -1)
+  /* Past the end of a sized symbol */
+  if (sym->size != 0 && addr - sym->addr >= sym->size)
     return NULL;
 
-  if ((elf = calloc (1, sizeof (struct arm32_elf))) == NULL)
-  {
-    munmap (base, size);
+  if (offset != NULL)
+    *offset = addr - sym->addr;
 
-    return NULL;
-  }
+  return elf->debug_strtab + elf->debug_symtab[sym->index].st_name;
+}
 
-  elf->base = base;
-  elf->size = size;
+/* Find the symbol addr belongs to, in the image or its libraries.
+   Returns its name and, if offset is not NULL, the distance from the
+   symbol start. */
+const char *
+arm32_elf_symbolize (struct arm32_elf *elf, uint32_t addr, uint32_t *offset)
+{
+  const char *name;
+  int i;
 
-  elf->ehdr = (Elf32_Ehdr *) base;
-  elf->phdr = (Elf32_Phdr *) (base + elf->ehdr->e_phoff);
+  if ((name = arm32_elf_symbolize_own (elf, addr, offset)) != NULL)
+    return name;
 
-  if (!arm32_elf_is_sane (elf))
-  {
-    errno = ENOEXEC;
-    
-    goto fail;
-  }
-  
-  if ((new = arm32_cpu_new ()) == NULL)
-    goto fail;
+  for (i = 0; i < elf->library_count; ++i)
+    if (elf->library_list[i] != NULL)
+      if ((name = arm32_elf_symbolize_own (elf->library_list[i], addr, offset)) != NULL)
+        return name;
+
+  return NULL;
+}
+
+
+/* Segments larger in memory than in file get a zero filled anonymous
+   mapping with their file pages mapped on top of it, so nothing is read
+   or allocated until the guest touches it */
+static int
+arm32_elf_map_loads (struct arm32_elf *elf, int fd, off_t offset)
+{
+  struct arm32_elf_load *load_list;
+  const Elf32_Phdr *phdr;
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t skip, tail;
+  int i;
+
+  if ((load_list = calloc (elf->ehdr->e_phnum, sizeof (struct arm32_elf_load))) == NULL)
+    return -1;
 
-  arm32_cpu_set_dtor (new, arm32_elf_dtor, elf);
-  
   for (i = 0; i < elf->ehdr->e_phnum; ++i)
   {
-    if (elf->phdr[i].p_type == PT_LOAD)
-    {
-      if (!arm32_elf_phdr_is_sane (elf, &elf->phdr[i]))
-      {
-	errno = ENOEXEC;
-	
-	goto fail;
-      }
-      
-      seg_size = elf->phdr[i].p_memsz;
+    phdr = &elf->phdr[i];
 
-      seg_flags = 0;
+    if (phdr->p_type != PT_LOAD || phdr->p_memsz <= phdr->p_filesz)
+      continue;
 
-      if (elf->phdr[i].p_flags & PF_X)
-	seg_flags |= SA_X;
+    skip = (offset + phdr->p_offset) & (page - 1);
 
-      if (elf->phdr[i].p_flags & PF_W)
-	seg_flags |= SA_W;
+    load_list[i].size = __ALIGN (skip + phdr->p_memsz, page);
+
+    if ((load_list[i].map = mmap (NULL, load_list[i].size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == (caddr_t) -1)
+    {
+      load_list[i].map = NULL;
+
+      goto fail;
+    }
+
+    if (phdr->p_filesz > 0)
+    {
+      if (mmap (load_list[i].map, skip + phdr->p_filesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset + phdr->p_offset - skip) == (caddr_t) -1)
+        goto fail;
+
+      /* Whatever follows the segment in its last file page is BSS */
+      if ((tail = (skip + phdr->p_filesz) & (page - 1)) != 0)
+        memset (load_list[i].map + skip + phdr->p_filesz, 0, page - tail);
+    }
+
+    load_list[i].data = load_list[i].map + skip;
+  }
+
+  arm32_elf_free_loads (elf->load_list, elf->ehdr->e_phnum);
+
+  elf->load_list = load_list;
+
+  return 0;
+
+fail:
+  arm32_elf_free_loads (load_list, elf->ehdr->e_phnum);
+
+  return -1;
+}
+
+static char *
+arm32_elf_prelink_path (const struct arm32_elf *elf)
+{
+  const char *dir;
+
+  if (elf->ehdr->e_type != ET_DYN || (dir = getenv (ARM32_ELF_PRELINK_ENV)) == NULL)
+    return NULL;
+
+  return strbuild ("%s/%016llx-%08x.prelink", dir, (unsigned long long) elf->file_key, elf->bias);
+}
+
+/* First host page boundary after the header */
+static off_t
+arm32_elf_prelink_offset (void)
+{
+  size_t page = sysconf (_SC_PAGESIZE);
+
+  return __ALIGN (sizeof (struct arm32_elf_prelink_header), page);
+}
+
+/* Replace the file image by a relocated copy in prelink cache format */
+static int
+arm32_elf_prelink_load_fd (struct arm32_elf *elf, int fd, uint64_t key)
+{
+  struct arm32_elf_prelink_header header;
+  void *base, *old_base;
+  off_t offset;
+
+  if (pread (fd, &header, sizeof (struct arm32_elf_prelink_header), 0) != sizeof (struct arm32_elf_prelink_header) ||
+      memcmp (header.magic, ARM32_ELF_PRELINK_MAGIC, sizeof (header.magic)) != 0 ||
+      header.version != ARM32_ELF_PRELINK_VERSION ||
+      header.key != key ||
+      header.check != elf->file_check ||
+      header.bias != elf->bias ||
+      header.size != elf->size ||
+      header.offset != (offset = arm32_elf_prelink_offset ()) ||
+      lseek (fd, 0, SEEK_END) < offset + elf->size)
+    return -1;
+
+  base = mmap (NULL, elf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+
+  if (base == (caddr_t) -1)
+    return -1;
+
+  old_base = elf->base;
+
+  elf->base = base;
+  elf->ehdr = (Elf32_Ehdr *) base;
+  elf->phdr = (Elf32_Phdr *) (base + elf->ehdr->e_phoff);
+
+  /* Segments with BSS must come from the relocated copy too */
+  if (arm32_elf_map_loads (elf, fd, offset) == -1)
+  {
+    elf->base = old_base;
+    elf->ehdr = (Elf32_Ehdr *) old_base;
+    elf->phdr = (Elf32_Phdr *) (old_base + elf->ehdr->e_phoff);
+
+    munmap (base, elf->size);
+
+    return -1;
+  }
+
+  munmap (old_base, elf->size);
+
+  elf->prelinked = 1;
+
+  return 0;
+}
+
+static int
+arm32_elf_prelink_load (struct arm32_elf *elf, const char *path)
+{
+  int fd;
+  int ret;
+
+  if ((fd = open (path, O_RDONLY)) == -1)
+    return -1;
+
+  ret = arm32_elf_prelink_load_fd (elf, fd, elf->file_key);
+
+  close (fd);
+
+  return ret;
+}
+
+/* Segments with BSS were relocated in their own mapping */
+static int
+arm32_elf_prelink_save_loads (const struct arm32_elf *elf, int fd, off_t offset)
+{
+  int i;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->load_list[i].data != NULL)
+      if (pwrite (fd, elf->load_list[i].data, elf->phdr[i].p_filesz, offset + elf->phdr[i].p_offset) != elf->phdr[i].p_filesz)
+        return -1;
+
+  return 0;
+}
+
+static int
+arm32_elf_prelink_write (const struct arm32_elf *elf, int fd, uint64_t key)
+{
+  struct arm32_elf_prelink_header header;
+  off_t offset = arm32_elf_prelink_offset ();
+
+  memset (&header, 0, sizeof (struct arm32_elf_prelink_header));
+
+  memcpy (header.magic, ARM32_ELF_PRELINK_MAGIC, sizeof (header.magic));
+
+  header.version = ARM32_ELF_PRELINK_VERSION;
+  header.bias    = elf->bias;
+  header.key     = key;
+  header.check   = elf->file_check;
+  header.size    = elf->size;
+  header.offset  = offset;
+
+  if (pwrite (fd, &header, sizeof (struct arm32_elf_prelink_header), 0) != sizeof (struct arm32_elf_prelink_header) ||
+      pwrite (fd, elf->base, elf->size, offset) != elf->size ||
+      arm32_elf_prelink_save_loads (elf, fd, offset) == -1)
+    return -1;
+
+  return 0;
+}
+
+/* Save the relocated image. Written to a temporary file first, so
+   concurrent loaders never see it incomplete. */
+static void
+arm32_elf_prelink_save (const struct arm32_elf *elf, const char *path)
+{
+  char *tmp;
+  int fd;
+
+  if ((tmp = strbuild ("%s.XXXXXX", path)) == NULL)
+    return;
+
+  if ((fd = mkstemp (tmp)) == -1)
+  {
+    warning ("Cannot create prelink cache file %s: %s\n", tmp, strerror (errno));
+    free (tmp);
+
+    return;
+  }
+
+  if (arm32_elf_prelink_write (elf, fd, elf->file_key) == -1 ||
+      fchmod (fd, 0644) == -1 ||
+      rename (tmp, path) == -1)
+  {
+    warning ("Cannot write prelink cache file %s: %s\n", path, strerror (errno));
+    unlink (tmp);
+  }
+
+  close (fd);
+  free (tmp);
+}
+
+/* ET_DYN images are placed at the first free region */
+static int
+arm32_elf_choose_bias (struct arm32_cpu *cpu, struct arm32_elf *elf)
+{
+  uint32_t lo = 0xffffffff;
+  uint32_t hi = 0;
+  uint32_t addr;
+  int i;
+
+  if (elf->ehdr->e_type != ET_DYN)
+    return 0;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD)
+    {
+      if (elf->phdr[i].p_vaddr < lo)
+        lo = elf->phdr[i].p_vaddr;
+
+      if (elf->phdr[i].p_vaddr + elf->phdr[i].p_memsz > hi)
+        hi = elf->phdr[i].p_vaddr + elf->phdr[i].p_memsz;
+    }
+
+  if (hi <= lo)
+    return 0;
+
+  lo &= ~(ARM32_ELF_PAGE_SIZE - 1);
+  
+  if ((addr = arm32_cpu_find_region (cpu, hi - lo, ARM32_ELF_PAGE_SIZE)) == -1)
+    return -1;
+
+  elf->bias = addr - lo;
+
+  return 0;
+}
+
+/* Files are told apart by where they live and when they last changed,
+   without reading them. The inode change time is part of it: any write
+   sets it, and unlike mtime user space cannot put it back (cp -p, rsync
+   and fixed build timestamps all do that with mtime). Both ends are
+   hashed as well. */
+static void
+arm32_elf_identify (struct arm32_elf *elf, const struct stat *sbuf)
+{
+  uint64_t id[7];
+  size_t check;
+
+  id[0] = sbuf->st_dev;
+  id[1] = sbuf->st_ino;
+  id[2] = sbuf->st_size;
+  id[3] = sbuf->st_mtim.tv_sec;
+  id[4] = sbuf->st_mtim.tv_nsec;
+  id[5] = sbuf->st_ctim.tv_sec;
+  id[6] = sbuf->st_ctim.tv_nsec;
+
+  elf->file_key = arm32_elf_content_hash (id, sizeof (id));
+
+  check = elf->size < ARM32_ELF_CHECK_SIZE ? elf->size : ARM32_ELF_CHECK_SIZE;
+
+  elf->file_check = arm32_elf_content_hash (elf->base, check) ^
+    arm32_elf_content_hash (elf->base + elf->size - check, check) * 0x100000001b3ull;
+}
+
+static struct arm32_elf *
+arm32_elf_open_fd (int fd)
+{
+  struct arm32_elf *elf;
+  struct stat sbuf;
+  void *base;
+  off_t size;
+  int i;
+  
+  if (fstat (fd, &sbuf) == -1)
+    return NULL;
+
+  size = sbuf.st_size;
+
+  if (size < sizeof (Elf32_Ehdr))
+  {
+    errno = ENOEXEC;
+
+    return NULL;
+  }
+
+  base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  
+  if (base == (caddr_t) -1)
+    return NULL;
+
+  if ((elf = calloc (1, sizeof (struct arm32_elf))) == NULL)
+  {
+    munmap (base, size);
+
+    return NULL;
+  }
+
+  elf->base = base;
+  elf->size = size;
+
+  arm32_elf_identify (elf, &sbuf);
+
+  elf->ehdr = (Elf32_Ehdr *) base;
+  elf->phdr = (Elf32_Phdr *) (base + elf->ehdr->e_phoff);
+
+  if (!arm32_elf_is_sane (elf))
+    goto fail;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD && !arm32_elf_phdr_is_sane (elf, &elf->phdr[i]))
+      goto fail;
+
+  if (arm32_elf_map_loads (elf, fd, 0) == -1)
+  {
+    arm32_elf_destroy (elf);
+
+    return NULL;
+  }
+
+  return elf;
+
+fail:
+  arm32_elf_destroy (elf);
+
+  errno = ENOEXEC;
+  
+  return NULL;
+}
+
+/* Place an image in the address space of cpu: relocate it, map its
+   segments and hook its imports. If tmpl is given, the relocated image
+   is taken from it, or saved to it for the next copies of the file. */
+static int
+arm32_elf_load (struct arm32_cpu *cpu, struct arm32_elf *elf, struct arm32_elf_template *tmpl)
+{
+  struct arm32_segment *seg;
+  void *seg_base;
+  size_t seg_size;
+  uint8_t seg_flags;
+
+  char *prelink_path = NULL;
+  const char *dir;
+  uint32_t lo, hi;
+  
+  int i;
+  
+  if (arm32_elf_choose_bias (cpu, elf) == -1)
+  {
+    errno = ENOMEM;
+
+    return -1;
+  }
+
+  /* Copies of a file loaded before start from its relocated image */
+  if (tmpl != NULL && tmpl->ready)
+    arm32_elf_prelink_load_fd (elf, fileno (tmpl->file), tmpl->key);
+
+  /* Relocated images are reused across runs if allowed */
+  if (!elf->prelinked)
+    if ((prelink_path = arm32_elf_prelink_path (elf)) != NULL)
+      arm32_elf_prelink_load (elf, prelink_path);
+  
+  arm32_elf_dynamic_init (elf);
+
+  if (!elf->prelinked)
+    arm32_elf_relocate_image (elf);
+
+  arm32_elf_init_debug_symbols (elf);
+
+  /* The cached copies have their debug symbols relocated as well */
+  if (!elf->prelinked && (prelink_path != NULL || tmpl != NULL))
+    arm32_elf_prepare_debug_symbols (elf);
+
+  if (prelink_path != NULL)
+  {
+    if (!elf->prelinked)
+      arm32_elf_prelink_save (elf, prelink_path);
+
+    free (prelink_path);
+  }
+
+  if (tmpl != NULL && !tmpl->ready && !elf->prelinked)
+    if ((tmpl->file = tmpfile ()) != NULL)
+    {
+      if (arm32_elf_prelink_write (elf, fileno (tmpl->file), tmpl->key) == 0)
+        tmpl->ready = 1;
+      else
+      {
+        fclose (tmpl->file);
+        tmpl->file = NULL;
+      }
+    }
+  
+  /* Segments are built from the final image */
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+  {
+    if (elf->phdr[i].p_type == PT_LOAD)
+    {
+      seg_size = elf->phdr[i].p_memsz;
+
+      seg_flags = 0;
+
+      if (elf->phdr[i].p_flags & PF_X)
+	seg_flags |= SA_X;
+
+      if (elf->phdr[i].p_flags & PF_W)
+	seg_flags |= SA_W;
 
       if (elf->phdr[i].p_flags & PF_R)
 	seg_flags |= SA_R;
       
-      if (seg_size != elf->phdr[i].p_filesz)
+      if (elf->load_list[i].data != NULL)
+	seg_base = elf->load_list[i].data;
+      else
+	seg_base = elf->base + elf->phdr[i].p_offset;
+      
+      if ((seg = arm32_segment_new (elf->phdr[i].p_vaddr + elf->bias, seg_base, seg_size, seg_flags)) == NULL)
+	return -1;
+
+      arm32_segment_set_dtor (seg, arm32_elf_segment_dtor, elf);
+
+      if (arm32_cpu_add_segment (cpu, seg) == -1)
       {
-	if ((seg_base = mmap (NULL, seg_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0)) == (caddr_t) -1)
-	  goto fail;
+	arm32_segment_destroy (seg);
 
-	memcpy (seg_base, base + elf->phdr[i].p_offset, elf->phdr[i].p_filesz);
+	return -1;
       }
-      else
-	seg_base = base + elf->phdr[i].p_offset;
-      
-      if ((seg = arm32_segment_new (elf->phdr[i].p_vaddr, seg_base, seg_size, seg_flags)) == NULL)
+    }
+  }
+
+  if (arm32_elf_fix_relocations (cpu, elf) == -1)
+    return -1;
+  
+  arm32_elf_fix_imports (elf);
+
+  /* Start with whatever previous runs of this image decoded. Files are
+     found by identity rather than content hash, which would mean reading
+     all of it on every load. */
+  if ((dir = getenv (ARM32_ELF_DECODE_CACHE_ENV)) != NULL)
+    if ((elf->decode_cache_path = strbuild ("%s/%016llx.decode", dir, (unsigned long long) elf->file_key)) != NULL)
+    {
+      arm32_elf_exec_range (elf, &lo, &hi);
+      arm32_decode_cache_load (cpu, elf->decode_cache_path, elf->file_key, elf->bias, lo, hi);
+
+      elf->decode_cache_key = elf->file_key;
+      elf->dcache            = cpu->dcache;
+      elf->decode_fill_mark  = cpu->dcache->fill_count;
+    }
+
+  return 0;
+}
+
+/* The descriptor is not closed, and can be shared by several CPUs:
+   each one gets its own private mapping of the file */
+struct arm32_cpu *
+arm32_cpu_new_from_elf_fd (int fd)
+{
+  return arm32_cpu_new_from_elf_template (fd, NULL, 0);
+}
+
+/* Not thread safe until the template is ready. flags are ARM32_ELF_*
+   load flags. */
+struct arm32_cpu *
+arm32_cpu_new_from_elf_template (int fd, struct arm32_elf_template *tmpl, int flags)
+{
+  struct arm32_cpu *new;
+  struct arm32_elf *elf; 
+  
+  if ((elf = arm32_elf_open_fd (fd)) == NULL)
+    return NULL;
+  
+  if ((new = arm32_cpu_new ()) == NULL)
+  {
+    arm32_elf_destroy (elf);
+
+    return NULL;
+  }
+
+  arm32_cpu_set_dtor (new, arm32_elf_dtor, elf);
+
+  elf->stdlib_hooks = (flags & ARM32_ELF_STDLIB_HOOKS) != 0;
+
+  if (arm32_elf_load (new, elf, tmpl) == -1)
+  {
+    arm32_cpu_destroy (new);
+
+    return NULL;
+  }
+  
+  /* svc #0 goes to the host kernel, so static binaries run as well */
+  if (arm32_syscall_install (new) == -1)
+  {
+    arm32_cpu_destroy (new);
+
+    return NULL;
+  }
+
+  if (getenv (ARM32_ELF_PROFILE_ENV) != NULL)
+    arm32_cpu_set_profiling (new, 1);
+
+  new->next_pc = elf->ehdr->e_entry + elf->bias;
+  
+  arm32_cpu_jump (new, elf->ehdr->e_entry + elf->bias);
+
+  return new;
+}
+
+/* Imports resolved to a library symbol jump straight to it */
+static int
+arm32_elf_library_call (struct arm32_cpu *cpu, const char *name, void *data, uint32_t prev)
+{
+  arm32_cpu_jump (cpu, (uint32_t) (uintptr_t) data);
+
+  return 0;
+}
+
+/* Global scope: main image first, then libraries in load order */
+static uint32_t
+arm32_elf_scope_lookup (struct arm32_elf *main, const char *name)
+{
+  struct arm32_elf *image;
+  int i, idx;
+
+  for (i = -1; i < main->library_count; ++i)
+  {
+    if ((image = i < 0 ? main : main->library_list[i]) == NULL)
+      continue;
+
+    if ((idx = arm32_elf_lookup_symbol (image, name)) != -1)
+      if (image->symtab[idx].st_shndx != SHN_UNDEF &&
+          image->symtab[idx].st_value != 0 &&
+          ELF32_ST_BIND (image->symtab[idx].st_info) != STB_LOCAL)
+        return image->symtab[idx].st_value;
+  }
+
+  return 0;
+}
+
+/* Point the DT_REL relocations against an unresolved symbol to addr */
+static void
+arm32_elf_rebind_relocs (struct arm32_cpu *cpu, struct arm32_elf *elf, uint32_t sym, uint32_t addr)
+{
+  uint32_t *unit;
+  int i;
+
+  for (i = 0; i < elf->dynrel_size; ++i)
+    if (ELF32_R_SYM (elf->dynrel[i].r_info) == sym)
+      if ((unit = arm32_elf_reloc_target (cpu, elf->dynrel[i].r_offset + elf->bias)) != NULL)
+        arm32_elf_apply_reloc (elf, &elf->dynrel[i], unit, addr);
+}
+
+/* Resolve imports left to the dummy hook against the global scope.
+   Native hooks (and user overrides) are never replaced. */
+static void
+arm32_elf_link_imports (struct arm32_cpu *cpu, struct arm32_elf *main)
+{
+  struct arm32_elf_instruction_override *override;
+  struct arm32_elf *image;
+  const char *name;
+  uint32_t addr;
+  int i, j;
+
+  for (i = -1; i < main->library_count; ++i)
+  {
+    if ((image = i < 0 ? main : main->library_list[i]) == NULL || !image->symtab_sane)
+      continue;
+
+    for (j = 1; j < image->symtab_size; ++j)
+    {
+      if (image->symtab[j].st_shndx != SHN_UNDEF || image->symtab[j].st_name >= image->strtab_size)
+        continue;
+
+      name = image->strtab + image->symtab[j].st_name;
+
+      if (image->sym_override[j] != -1)
+      {
+        override = main->override_list[image->sym_override[j]];
+
+        if (override != NULL && override->callback == arm32_elf_dummy_import)
+          if ((addr = arm32_elf_scope_lookup (main, name)) != 0)
+          {
+            override->callback = arm32_elf_library_call;
+            override->data = (void *) (uintptr_t) addr;
+          }
+      }
+      else if (image->symtab[j].st_value == 0)
+      {
+        /* Data imports and unprovided weak symbols */
+        if ((addr = arm32_elf_scope_lookup (main, name)) != 0)
+        {
+          image->symtab[j].st_value = addr;
+          
+          arm32_elf_rebind_relocs (cpu, image, j, addr);
+        }
+      }
+    }
+  }
+}
+
+/* Overrides appended after mark are discarded. Their indices are free
+   again, so this is only safe while no code refers to them yet. Name
+   index entries stay and point to NULL (or to a later override, which
+   is told apart by its name). */
+static void
+arm32_elf_truncate_overrides (struct arm32_elf *elf, int mark)
+{
+  struct arm32_elf_instruction_override *override;
+
+  while (elf->override_count > mark)
+    if ((override = elf->override_list[--elf->override_count]) != NULL)
+    {
+      if (override->name != NULL)
+        free (override->name);
+
+      free (override);
+
+      elf->override_list[elf->override_count] = NULL;
+    }
+}
+
+/* Load an ARM shared object in the address space of a CPU created by
+   arm32_cpu_new_from_elf. Pending imports of every loaded image are
+   then resolved against it. */
+int
+arm32_cpu_load_library (struct arm32_cpu *cpu, const char *path)
+{
+  struct arm32_elf *main = (struct arm32_elf *) cpu->data;
+  struct arm32_elf *lib;
+  int mark;
+  int fd;
+  int i;
+
+  if ((fd = open (path, O_RDONLY)) == -1)
+    return -1;
+
+  lib = arm32_elf_open_fd (fd);
+
+  close (fd);
+
+  if (lib == NULL)
+    return -1;
+
+  if (lib->ehdr->e_type != ET_DYN)
+  {
+    arm32_elf_destroy (lib);
+
+    errno = ENOEXEC;
+
+    return -1;
+  }
+
+  lib->owner = main;
+
+  /* Imports of the library are appended to the overrides of the main
+     image, past mark. They are only kept if the whole load succeeds. */
+  mark = main->override_count;
+
+  if (arm32_elf_load (cpu, lib, NULL) == -1 || PTR_LIST_APPEND_CHECK (main->library, lib) == -1)
+  {
+    arm32_elf_truncate_overrides (main, mark);
+
+    /* Undo whatever got mapped */
+    for (i = 0; i < cpu->segment_count; ++i)
+      if (cpu->segment_list[i] != NULL && cpu->segment_list[i]->data == lib)
       {
-	if (seg_size != elf->phdr[i].p_filesz)
-	  munmap (seg_base, seg_size);
+        arm32_segment_destroy (cpu->segment_list[i]);
+        cpu->segment_list[i] = NULL;
+      }
+
+    arm32_elf_destroy (lib);
+
+    return -1;
+  }
+
+  arm32_elf_link_imports (cpu, main);
+
+  return 0;
+}
+
+struct arm32_cpu *
+arm32_cpu_new_from_elf_flags (const char *path, int flags)
+{
+  struct arm32_cpu *new;
+  int fd;
+  int saved_errno;
+  
+  if ((fd = open (path, O_RDONLY)) == -1)
+    return NULL;
+
+  new = arm32_cpu_new_from_elf_template (fd, NULL, flags);
+
+  saved_errno = errno;
+  close (fd);
+  errno = saved_errno;
+
+  return new;
+}
+
+struct arm32_cpu *
+arm32_cpu_new_from_elf (const char *path)
+{
+  return arm32_cpu_new_from_elf_flags (path, 0);
+}
+
+int
+arm32_cpu_get_symbol_index (struct arm32_cpu *cpu, const char *name)
+{
+  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
 
-	goto fail;
-      }
+  return arm32_elf_lookup_symbol (elf, name);
+}
 
-      arm32_segment_set_dtor (seg, arm32_elf_segment_dtor, elf);
+void
+arm32_elf_remove_symbol (struct arm32_elf *elf, const char *name)
+{
+  struct arm32_elf *owner = ARM32_ELF_OWNER (elf);
+  struct arm32_elf_instruction_override *override;
+  uint32_t slot;
+  int i;
 
-      if (arm32_cpu_add_segment (new, seg) == -1)
+  /* Index entries of removed overrides stay, pointing to NULL */
+  if (owner->override_index != NULL)
+    for (slot = arm32_elf_gnu_hash (name) & owner->override_index_mask;
+         (i = owner->override_index[slot]) != 0;
+         slot = (slot + 1) & owner->override_index_mask)
+      if ((override = owner->override_list[i - 1]) != NULL && strcmp (override->name, name) == 0)
       {
-	arm32_segment_destroy (seg);
-
-	goto fail;
+        free (override->name);
+        free (override);
+        owner->override_list[i - 1] = NULL;
       }
-    }
-  }
-
-  new->next_pc = elf->ehdr->e_entry;
-  
-  arm32_cpu_jump (new, elf->ehdr->e_entry);
 
-  arm32_elf_dynamic_init (elf);
+  if (elf->sym_override != NULL && (i = arm32_elf_lookup_symbol (elf, name)) != -1)
+    elf->sym_override[i] = -1;
+}
 
-  if (arm32_elf_fix_relocations (new, elf) == -1)
-    goto fail;
-  
-  arm32_elf_fix_imports (elf);
+/* Override of an import of this image, through its symbol index */
+static struct arm32_elf_instruction_override *
+arm32_elf_find_import_override (struct arm32_elf *elf, const char *name)
+{
+  int i;
 
-  arm32_elf_init_debug_symbols (elf);
-  
-  return new;
-  
-fail:
-  if (new != NULL)
-    arm32_cpu_destroy (new);
-  else if (elf != NULL)
-    arm32_elf_destroy (elf);
+  if (elf->sym_override != NULL && (i = arm32_elf_lookup_symbol (elf, name)) != -1)
+    if (elf->sym_override[i] != -1)
+      return ARM32_ELF_OWNER (elf)->override_list[elf->sym_override[i]];
 
   return NULL;
 }
 
-int
-arm32_cpu_get_symbol_index (struct arm32_cpu *cpu, const char *name)
+/* Anything else (debug symbols) is found by name. The first override
+   appended with that name wins. */
+static struct arm32_elf_instruction_override *
+arm32_elf_find_override (struct arm32_elf *elf, const char *name)
 {
+  struct arm32_elf_instruction_override *override;
+  uint32_t slot;
+  int first = 0;
   int i;
 
-  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+  if (elf->override_index == NULL)
+    return NULL;
 
-  if (!elf->symtab_sane)
-    return -1;
-  
-  for (i = elf->symtab_first; i < elf->symtab_size; ++i)
-    if (elf->symtab[i].st_name < elf->strtab_size)
-      if (strcmp (name, elf->strtab + elf->symtab[i].st_name) == 0)
-	return i;
+  for (slot = arm32_elf_gnu_hash (name) & elf->override_index_mask;
+       (i = elf->override_index[slot]) != 0;
+       slot = (slot + 1) & elf->override_index_mask)
+    if ((override = elf->override_list[i - 1]) != NULL && strcmp (override->name, name) == 0)
+      if (first == 0 || i < first)
+        first = i;
 
-  return -1;
+  return first == 0 ? NULL : elf->override_list[first - 1];
 }
 
-void
-arm32_elf_remove_symbol (struct arm32_elf *elf, const char *name)
+/* Every image importing name gets the change. If none does, the first
+   override with that name is used */
+static int
+arm32_elf_update_override (struct arm32_elf *elf, const char *name, int restore, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
 {
+  struct arm32_elf_instruction_override *override;
+  struct arm32_elf *image;
+  int found = 0;
   int i;
 
-  for (i = 0; i < elf->override_count; ++i)
-    if (strcmp (elf->override_list[i]->name, name) == 0)
+  for (i = -1; i < elf->library_count; ++i)
+  {
+    if ((image = i < 0 ? elf : elf->library_list[i]) == NULL)
+      continue;
+    
+    if ((override = arm32_elf_find_import_override (image, name)) != NULL)
     {
-      free (elf->override_list[i]->name);
-      free (elf->override_list[i]);
-      elf->override_list[i] = NULL;
+      if (restore)
+        *override->phys = override->prev;
+      else
+      {
+        override->callback = callback;
+        override->data = data;
+      }
+      
+      ++found;
     }
+  }
+
+  if (!found)
+  {
+    if ((override = arm32_elf_find_override (elf, name)) == NULL)
+      return -1;
+
+    if (restore)
+      *override->phys = override->prev;
+    else
+    {
+      override->callback = callback;
+      override->data = data;
+    }
+  }
+
+  return 0;
 }
 
 int
 arm32_cpu_override_symbol (struct arm32_cpu *cpu, const char *name, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
 {
-  int i;
-  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
-  
-  for (i = 0; i < elf->override_count; ++i)
-    if (elf->override_list[i] != NULL && elf->override_list[i]->name != NULL)
-      if (strcmp (elf->override_list[i]->name, name) == 0)
-      {
-	elf->override_list[i]->callback = callback;
-	elf->override_list[i]->data = data;
-
-	return 0;
-      }
-
-  return -1;
+  return arm32_elf_update_override ((struct arm32_elf *) cpu->data, name, 0, callback, data);
 }
 
 int
 arm32_cpu_restore_symbol (struct arm32_cpu *cpu, const char *name)
 {
+  return arm32_elf_update_override ((struct arm32_elf *) cpu->data, name, 1, NULL, NULL);
+}
+
+static void
+arm32_elf_override_index_insert (int *index, uint32_t mask, const char *name, int idx)
+{
+  uint32_t slot;
+
+  for (slot = arm32_elf_gnu_hash (name) & mask;
+       index[slot] != 0;
+       slot = (slot + 1) & mask);
+
+  index[slot] = idx + 1;
+}
+
+/* Keep the name index at most half full, entries of removed overrides
+   are dropped when it grows */
+static int
+arm32_elf_override_index_reserve (struct arm32_elf *elf)
+{
+  uint32_t size;
+  int *index;
   int i;
-  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
-  
+
+  size = elf->override_index == NULL ? 0 : elf->override_index_mask + 1;
+
+  if (2 * (elf->override_named + 1) <= size)
+    return 0;
+
+  for (size = size ? size : 64; size < 2 * (elf->override_named + 1); size <<= 1);
+
+  if ((index = calloc (size, sizeof (int))) == NULL)
+    return -1;
+
+  elf->override_named = 0;
+
   for (i = 0; i < elf->override_count; ++i)
     if (elf->override_list[i] != NULL && elf->override_list[i]->name != NULL)
-      if (strcmp (elf->override_list[i]->name, name) == 0)
-      {
-	*elf->override_list[i]->phys = elf->override_list[i]->prev;
+    {
+      arm32_elf_override_index_insert (index, size - 1, elf->override_list[i]->name, i);
+      ++elf->override_named;
+    }
 
-        
-	return 0;
-      }
+  if (elf->override_index != NULL)
+    free (elf->override_index);
 
-  return -1;
+  elf->override_index      = index;
+  elf->override_index_mask = size - 1;
+
+  return 0;
 }
 
-int
-arm32_elf_replace_instruction (struct arm32_elf *elf, const char *name, uint32_t vaddr, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
+/* Overrides are appended, never reused: their index lives in the code */
+static int
+arm32_elf_append_override (struct arm32_elf *elf, struct arm32_elf_instruction_override *override)
+{
+  struct arm32_elf_instruction_override **list;
+  int alloc;
+
+  if (elf->override_count == elf->override_alloc)
+  {
+    alloc = elf->override_alloc ? elf->override_alloc << 1 : 64;
+
+    if ((list = realloc (elf->override_list, alloc * sizeof (struct arm32_elf_instruction_override *))) == NULL)
+      return -1;
+
+    elf->override_list  = list;
+    elf->override_alloc = alloc;
+  }
+
+  if (override->name != NULL)
+  {
+    if (arm32_elf_override_index_reserve (elf) == -1)
+      return -1;
+
+    arm32_elf_override_index_insert (elf->override_index, elf->override_index_mask, override->name, elf->override_count);
+    ++elf->override_named;
+  }
+
+  elf->override_list[elf->override_count] = override;
+
+  return elf->override_count++;
+}
+
+static int
+arm32_elf_add_override (struct arm32_elf *elf, const char *name, uint32_t vaddr, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
 {
   struct arm32_elf_instruction_override *new;
   uint32_t *addr;
   int sym_idx;
   
   if ((addr = arm32_elf_translate (elf, vaddr)) == NULL)
-    return 1;
+    return -1;
+
+  if (callback == arm32_hook_typed_call && arm32_hook_sig_parse (data) == -1)
+    return -1;
 
-  if ((new = malloc (sizeof (struct arm32_elf_instruction_override))) == NULL)
+  if ((new = calloc (1, sizeof (struct arm32_elf_instruction_override))) == NULL)
     return -1;
 
   if (name == NULL)
@@ -632,7 +2167,7 @@ arm32_elf_replace_instruction (struct arm32_elf *elf, const char *name, uint32_t
   new->callback = callback;
   new->data = data;
 
-  if ((sym_idx = PTR_LIST_APPEND_CHECK (elf->override, new)) == -1)
+  if ((sym_idx = arm32_elf_append_override (ARM32_ELF_OWNER (elf), new)) == -1)
   {
     free (new->name);
     free (new);
@@ -645,87 +2180,352 @@ arm32_elf_replace_instruction (struct arm32_elf *elf, const char *name, uint32_t
 
   *addr = 0xef000000 + ((sym_idx + ARM32_IMPORT_HOOK_BASE) & 0xffffff);
 
-  return 0;
+  return sym_idx;
+}
+
+int
+arm32_elf_replace_instruction (struct arm32_elf *elf, const char *name, uint32_t vaddr, int (*callback) (struct arm32_cpu *, const char *name, void *data, uint32_t), void *data)
+{
+  if (arm32_elf_translate (elf, vaddr) == NULL)
+    return 1;
+
+  return arm32_elf_add_override (elf, name, vaddr, callback, data) == -1 ? -1 : 0;
+}
+
+/* Copies of a hooked function linked into the image itself (static
+   binaries) get the native hook too. Returns 1 if there is none. */
+int
+arm32_elf_hook_defined_function (struct arm32_elf *elf, const struct arm32_stdlib_hook *hook)
+{
+  const Elf32_Sym *sym;
+  int i;
+
+  if ((i = arm32_elf_find_debug_symbol (elf, hook->name)) == -1)
+    return 1;
+
+  sym = &elf->debug_symtab[i];
+
+  /* IFUNC symbols point to their resolver, and Thumb code cannot
+     hold the hook instruction */
+  if (sym->st_shndx == SHN_UNDEF || ELF32_ST_TYPE (sym->st_info) != STT_FUNC || (sym->st_value & 1))
+    return 1;
+
+  return arm32_elf_replace_instruction (elf, hook->name, sym->st_value, hook->callback, hook->data);
 }
 
 int
 arm32_cpu_define_symbol (struct arm32_elf *elf, const char *name, int sym_idx, int (*callback) (struct arm32_cpu *, const char *, void *, uint32_t), void *data)
 {
-  return arm32_elf_replace_instruction (elf, name, elf->symtab[sym_idx].st_value, callback, NULL);
+  int idx;
+
+  if (arm32_elf_translate (elf, elf->symtab[sym_idx].st_value) == NULL)
+    return 1;
+
+  if ((idx = arm32_elf_add_override (elf, name, elf->symtab[sym_idx].st_value, callback, data)) == -1)
+    return -1;
+
+  /* No dynamic symbols, no import map */
+  if (elf->sym_override != NULL)
+    elf->sym_override[sym_idx] = idx;
+
+  return 0;
+}
+
+/* Cheap enough to take around every hook call */
+static inline uint64_t
+arm32_elf_timestamp (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+  return __rdtsc ();
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
 }
 
 int
 arm32_elf_call_external (struct arm32_cpu *cpu, uint32_t sym)
 {
   struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+  struct arm32_elf_instruction_override *override;
+  uint64_t start, bytes;
   int ret;
-  
-  /* Regular SWI interrupt */
-  if (sym < ARM32_IMPORT_HOOK_BASE || (sym - ARM32_IMPORT_HOOK_BASE > elf->override_count))
+
+  /* Regular SWI interrupt: up to the vector, if any */
+  if (sym < ARM32_IMPORT_HOOK_BASE)
+  {
+    if (arm32_cpu_except (cpu, ARM32_EXCEPTION_SWI, PC (cpu), sym) == -1)
+      EXCEPT (ARM32_EXCEPTION_SWI);
+
+    return 0;
+  }
+
+  if (sym - ARM32_IMPORT_HOOK_BASE >= elf->override_count)
     EXCEPT (ARM32_EXCEPTION_SWI);
 
-  if (elf->override_list[sym - ARM32_IMPORT_HOOK_BASE] == NULL)
+  if ((override = elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]) == NULL)
     EXCEPT (ARM32_EXCEPTION_UNDEF);
-  else
+
+  debug ("  Call overriden %s()\n", override->name == NULL ? "<unknown>" : override->name);
+
+  if (!elf->profile)
+    return (override->callback) (cpu, override->name, override->data, override->prev);
+
+  start = arm32_elf_timestamp ();
+  bytes = cpu->runtime.bytes;
+
+  ++override->stats.calls;
+
+  ret = (override->callback) (cpu, override->name, override->data, override->prev);
+
+  override->stats.ticks += arm32_elf_timestamp () - start;
+  override->stats.bytes += cpu->runtime.bytes - bytes;
+
+  return ret;
+}
+
+/* Monotonic host time in nanoseconds */
+static uint64_t
+arm32_elf_host_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+arm32_cpu_reset_profile (struct arm32_cpu *cpu)
+{
+  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+  int i;
+
+  for (i = 0; i < elf->override_count; ++i)
+    if (elf->override_list[i] != NULL)
+      memset (&elf->override_list[i]->stats, 0, sizeof (struct arm32_elf_override_stats));
+
+  elf->profile_tsc = arm32_elf_timestamp ();
+  elf->profile_ns  = arm32_elf_host_ns ();
+}
+
+/* Profiling can be switched on and off while the CPU runs. Stats are
+   kept across switches, until reset. */
+void
+arm32_cpu_set_profiling (struct arm32_cpu *cpu, int enable)
+{
+  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+
+  if (enable && elf->profile_ns == 0)
+    arm32_cpu_reset_profile (cpu);
+
+  elf->profile = enable;
+}
+
+static int
+arm32_elf_override_cost_cmp (const void *a, const void *b)
+{
+  const struct arm32_elf_instruction_override *oa = *(const struct arm32_elf_instruction_override **) a;
+  const struct arm32_elf_instruction_override *ob = *(const struct arm32_elf_instruction_override **) b;
+
+  if (oa->stats.ticks != ob->stats.ticks)
+    return oa->stats.ticks < ob->stats.ticks ? 1 : -1;
+
+  return oa->stats.calls < ob->stats.calls ? 1 : oa->stats.calls > ob->stats.calls ? -1 : 0;
+}
+
+/* Every override called so far, most expensive first. Timestamps are
+   converted to nanoseconds against the host clock over the whole
+   profiling period. */
+int
+arm32_cpu_dump_profile (struct arm32_cpu *cpu, FILE *fp)
+{
+  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+  struct arm32_elf_instruction_override **sorted;
+  struct arm32_elf_override_stats total = {0, 0, 0};
+  uint64_t tsc, ns;
+  double ns_per_tick = 1.0;
+  int count = 0;
+  int i;
+
+  if ((sorted = malloc ((elf->override_count + 1) * sizeof (struct arm32_elf_instruction_override *))) == NULL)
+    return -1;
+
+  for (i = 0; i < elf->override_count; ++i)
+    if (elf->override_list[i] != NULL && elf->override_list[i]->stats.calls > 0)
+    {
+      sorted[count++] = elf->override_list[i];
+
+      total.calls += elf->override_list[i]->stats.calls;
+      total.ticks += elf->override_list[i]->stats.ticks;
+      total.bytes += elf->override_list[i]->stats.bytes;
+    }
+
+  qsort (sorted, count, sizeof (struct arm32_elf_instruction_override *), arm32_elf_override_cost_cmp);
+
+  tsc = arm32_elf_timestamp () - elf->profile_tsc;
+  ns  = arm32_elf_host_ns () - elf->profile_ns;
+
+  if (tsc > 0)
+    ns_per_tick = (double) ns / tsc;
+
+  fprintf (fp, "%-24s %12s %14s %10s %14s\n", "hook", "calls", "ns", "ns/call", "bytes");
+
+  for (i = 0; i < count; ++i)
+    fprintf (
+        fp,
+        "%-24s %12llu %14.0f %10.1f %14llu\n",
+        sorted[i]->name == NULL ? "<unknown>" : sorted[i]->name,
+        (unsigned long long) sorted[i]->stats.calls,
+        sorted[i]->stats.ticks * ns_per_tick,
+        sorted[i]->stats.ticks * ns_per_tick / sorted[i]->stats.calls,
+        (unsigned long long) sorted[i]->stats.bytes);
+
+  fprintf (
+      fp,
+      "%-24s %12llu %14.0f %10s %14llu\n",
+      "total",
+      (unsigned long long) total.calls,
+      total.ticks * ns_per_tick,
+      "",
+      (unsigned long long) total.bytes);
+
+  free (sorted);
+
+  return 0;
+}
+
+/* Where the program headers of the main image end up in guest memory */
+static uint32_t
+arm32_elf_phdr_virt (const struct arm32_elf *elf)
+{
+  uint32_t phoff = elf->ehdr->e_phoff;
+  int i;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_PHDR)
+      return elf->phdr[i].p_vaddr + elf->bias;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD &&
+        elf->phdr[i].p_offset <= phoff &&
+        phoff - elf->phdr[i].p_offset < elf->phdr[i].p_filesz)
+      return phoff - elf->phdr[i].p_offset + elf->phdr[i].p_vaddr + elf->bias;
+
+  return 0;
+}
+
+/* AT_RANDOM bytes, seeding the stack protector and pointer guards */
+static void
+arm32_elf_fill_random (uint8_t *buf, size_t size)
+{
+  int fd;
+  size_t i;
+
+  if ((fd = open ("/dev/urandom", O_RDONLY)) != -1)
   {
-    debug ("  Call overriden %s()\n", elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->name == NULL ? "<unknown>" : elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->name);
+    if (read (fd, buf, size) == size)
+    {
+      close (fd);
+
+      return;
+    }
 
-    if ((ret = (elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->callback)
-         (
-           cpu,
-           elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->name,
-           elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->data,
-           elf->override_list[sym - ARM32_IMPORT_HOOK_BASE]->prev)
-          ) < 0)
-      return ret;
+    close (fd);
   }
-  return ret;
+
+  for (i = 0; i < size; ++i)
+    buf[i] = random ();
 }
 
+/* Initial process stack, as the kernel leaves it for _start:
+
+   argc, argv[], NULL, envp[], NULL, auxv pairs, AT_NULL
+   AT_RANDOM bytes, argument and environment strings */
 int
 arm32_cpu_prepare_main (struct arm32_cpu *cpu, int argc, char **argv)
 {
+  struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
   uint8_t *main_context;
   uint32_t *virt_argv;
+  uint32_t *auxv;
+  uint32_t words;
+  uint32_t rand_off;
+  uint32_t p;
+  int envc = 0;
   int i;
-  int p = 0;
   struct arm32_segment *seg;
-  uint32_t required_len = 12;
-  
-  /* TODO: predict the size of the whole array, this is ok by now, but not in general */
+  uint32_t required_len;
+
+  while (environ[envc] != NULL)
+    ++envc;
+
+  words    = 1 + (argc + 1) + (envc + 1) + 2 * ARM32_ELF_AUXV_COUNT;
+  rand_off = words * sizeof (uint32_t);
+
+  required_len = rand_off + ARM32_ELF_RANDOM_SIZE;
 
   for (i = 0; i < argc; ++i)
-    required_len += strlen (argv[i]) + 1 + sizeof (uint32_t);
-  
+    required_len += strlen (argv[i]) + 1;
+
+  for (i = 0; i < envc; ++i)
+    required_len += strlen (environ[i]) + 1;
+
   if ((main_context = mmap (NULL, required_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0)) == (uint8_t *) -1)
     return -1;
 
   virt_argv = (uint32_t *) main_context;
+  p         = rand_off + ARM32_ELF_RANDOM_SIZE;
 
   /* Value in the top of the stack corresponds to argc */
   virt_argv[0] = argc;
 
   for (i = 0; i < argc; ++i)
   {
-    memcpy (&main_context[sizeof (uint32_t) * (argc + 2) + p],
-	    argv[i],
-	    strlen (argv[i]) + 1);
+    memcpy (&main_context[p], argv[i], strlen (argv[i]) + 1);
 
-    virt_argv[i + 1] = ARM32_DEFAULT_STACK_BOTTOM + sizeof (uint32_t) * (argc + 2) + p;
+    virt_argv[i + 1] = ARM32_DEFAULT_STACK_BOTTOM + p;
 
     debug ("Put argument \"%s\" --> 0x%x\n", argv[i], virt_argv[i + 1]);
     
     p += strlen (argv[i]) + 1;
   }
   
-  /* Argv ends in NULL */
+  /* Argv ends in NULL, and so does envp right after it */
   virt_argv[argc + 1] = 0;
 
-  /* ARM errno goes here */
-  arm_errno = &virt_argv[argc + 2 + __UNITS (p, sizeof (uint32_t))];  
-  arm_errno_virt = ARM32_DEFAULT_STACK_BOTTOM +(sizeof (uint32_t) * (argc + 2 + __UNITS (p, sizeof (uint32_t))));
+  for (i = 0; i < envc; ++i)
+  {
+    memcpy (&main_context[p], environ[i], strlen (environ[i]) + 1);
+
+    virt_argv[argc + 2 + i] = ARM32_DEFAULT_STACK_BOTTOM + p;
+
+    p += strlen (environ[i]) + 1;
+  }
+
+  virt_argv[argc + 2 + envc] = 0;
+
+  arm32_elf_fill_random (&main_context[rand_off], ARM32_ELF_RANDOM_SIZE);
+
+  auxv = &virt_argv[argc + envc + 3];
+
+  auxv[0]  = AT_PHDR;
+  auxv[1]  = arm32_elf_phdr_virt (elf);
+  auxv[2]  = AT_PHENT;
+  auxv[3]  = sizeof (Elf32_Phdr);
+  auxv[4]  = AT_PHNUM;
+  auxv[5]  = elf->ehdr->e_phnum;
+  auxv[6]  = AT_PAGESZ;
+  auxv[7]  = ARM32_ELF_PAGE_SIZE;
+  auxv[8]  = AT_RANDOM;
+  auxv[9]  = ARM32_DEFAULT_STACK_BOTTOM + rand_off;
+  auxv[10] = AT_NULL;
+  auxv[11] = 0;
 
-  *arm_errno = 0;
+  ERRNO (cpu) = 0;
 						
   if ((seg = arm32_segment_new (ARM32_DEFAULT_STACK_BOTTOM, main_context, __ALIGN (required_len, 4096), SA_R | SA_W)) == NULL)
   {
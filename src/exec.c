@@ -17,11 +17,13 @@
  */
 
 
+#include <string.h>
+
 #include "arm_cpu.h"
 #include "arm_inst.h"
 #include "arm_watch.h"
 
-extern struct arm32_cpu *curr_cpu;
+extern __thread struct arm32_cpu *curr_cpu;
 
 int
 arm32_check_condition (struct arm32_cpu *cpu, uint32_t op)
@@ -152,16 +154,68 @@ arm32_cpu_callproc (struct arm32_cpu *cpu, uint32_t addr)
   return arm32_cpu_run (cpu);
 }
 
+/* Call the guest function at addr following the AAPCS: the first four
+   arguments go in r0-r3, the rest are pushed on the stack. The 64 bit
+   result is taken from r0 (low) and r1 (high). Registers are restored
+   afterwards, so this can be called from hooks while the CPU is running. */
 int
-arm32_cpu_run (struct arm32_cpu *cpu)
+arm32_cpu_call (struct arm32_cpu *cpu, uint32_t addr, const uint32_t *args, unsigned int argc, uint64_t *result)
+{
+  struct arm32_regs saved_regs;
+  uint32_t saved_next_pc;
+  uint32_t *stack;
+  unsigned int i;
+  int ret;
+
+  saved_regs    = cpu->regs;
+  saved_next_pc = cpu->next_pc;
+
+  for (i = 0; i < argc && i < 4; ++i)
+    REG (cpu, i) = args[i];
+
+  /* The stack must be 8 byte aligned at the call */
+  SP (cpu) &= ~7;
+
+  if (argc > 4)
+  {
+    SP (cpu) = (SP (cpu) - (argc - 4) * sizeof (uint32_t)) & ~7;
+
+    if ((stack = arm32_cpu_translate_write_size (cpu, SP (cpu), (argc - 4) * sizeof (uint32_t))) == NULL)
+    {
+      ret = -1;
+      goto done;
+    }
+
+    memcpy (stack, args + 4, (argc - 4) * sizeof (uint32_t));
+  }
+
+  LR (cpu) = ARM32_DEFAULT_VDSO_BOTTOM;
+
+  arm32_cpu_jump (cpu, addr);
+
+  ret = arm32_cpu_run (cpu);
+
+  if (result != NULL)
+    *result = R0 (cpu) | ((uint64_t) R1 (cpu) << 32);
+
+done:
+  cpu->regs    = saved_regs;
+  cpu->next_pc = saved_next_pc;
+
+  return ret;
+}
+
+static int
+arm32_cpu_run_loop (struct arm32_cpu *cpu)
 {
   const struct arm32_inst *inst;
   uint32_t instruction;
   int ret;
+  int jumped;
+  int trapped;
   uint32_t sym;
+  uint32_t addr;
 
-  curr_cpu = cpu;
-  
   /* TODO: get a better way to retrieve error codes */
   for (;;)
   {
@@ -169,18 +223,42 @@ arm32_cpu_run (struct arm32_cpu *cpu)
       if (arm32_cpu_except (cpu, EXCODE (ret), PC (cpu), 0) == -1)
         break;
 
+    addr = PC (cpu);
+
     if (instruction == ARM32_ARMETTE_RETURN_INSTRUCTION)
     {
       ret = 0;
       break;
     }
 
-    if ((inst = arm32_inst_decode (cpu, instruction)) == NULL)
+    /* Import trampoline: call the hook right away, no need to decode
+       it and go through the SWI exception */
+    if (ARM32_IS_HOOK_INSTRUCTION (instruction))
+    {
+      /* Watchpoints see the pipeline PC, as in the decoded path */
+      PC (cpu) += 8;
+      trapped = arm32_cpu_watchpoint_set_test_pre (cpu, instruction);
+      PC (cpu) -= 8;
+
+      if (trapped)
+        EXCEPT (ARM32_EXCEPTION_TRAP);
+
+      if ((ret = arm32_elf_call_external (cpu, instruction & 0xffffff)) < 0)
+        break;
+
+      if (cpu->wps->branch_count > 0 && cpu->next_pc != addr + 4)
+        if (arm32_cpu_watchpoint_set_test_branch (cpu, instruction, addr, 1))
+          EXCEPT (ARM32_EXCEPTION_TRAP);
+
+      if (arm32_cpu_watchpoint_set_test_post (cpu, instruction))
+        EXCEPT (ARM32_EXCEPTION_TRAP);
+
+      continue;
+    }
+
+    if ((inst = arm32_inst_decode_cached (cpu, addr, instruction)) == NULL)
       if (arm32_cpu_except (cpu, ARM32_EXCEPTION_UNDEF, PC (cpu), instruction) == -1)
-      {
-        curr_cpu = NULL;
 	EXCEPT (ARM32_EXCEPTION_UNDEF);
-      }
     
     cpu->c = IF_C (cpu);
     cpu->z = IF_Z (cpu);
@@ -197,7 +275,7 @@ arm32_cpu_run (struct arm32_cpu *cpu)
       ret = arm32_inst_execute (cpu, inst, instruction);
 
       /* Jump happened, readjust PC */
-      if (PC (cpu) - 8 != cpu->next_pc - 4)
+      if ((jumped = PC (cpu) - 8 != cpu->next_pc - 4))
         cpu->next_pc = PC (cpu);
       else
         PC (cpu) -= 8;
@@ -208,18 +286,43 @@ arm32_cpu_run (struct arm32_cpu *cpu)
 
 	if ((ret = arm32_elf_call_external (cpu, sym)) < 0)
           break;
+
+        /* Hooks return by setting next_pc */
+        if (cpu->wps->branch_count > 0 && cpu->next_pc != addr + 4)
+          if (arm32_cpu_watchpoint_set_test_branch (cpu, instruction, addr, 1))
+            EXCEPT (ARM32_EXCEPTION_TRAP);
       }
       else if (ret < 0)
      	if (arm32_cpu_except (cpu, EXCODE (ret), PC (cpu), 0) == -1)
           break;
 
+      /* Block exit */
+      if (jumped && cpu->wps->branch_count > 0)
+        if (arm32_cpu_watchpoint_set_test_branch (cpu, instruction, addr, 0))
+          EXCEPT (ARM32_EXCEPTION_TRAP);
+
       if (arm32_cpu_watchpoint_set_test_post (cpu, instruction))
         EXCEPT (ARM32_EXCEPTION_TRAP);
     }
   }
 
-  curr_cpu = NULL;
-  
+  return ret;
+}
+
+/* Runs nest when hooks call back into the guest (see arm32_cpu_call),
+   the outer CPU is current again on every way out of the inner one */
+int
+arm32_cpu_run (struct arm32_cpu *cpu)
+{
+  struct arm32_cpu *prev_cpu = curr_cpu;
+  int ret;
+
+  curr_cpu = cpu;
+
+  ret = arm32_cpu_run_loop (cpu);
+
+  curr_cpu = prev_cpu;
+
   return ret;
 }
 
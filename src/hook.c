@@ -0,0 +1,239 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "arm_cpu.h"
+#include "arm_inst.h"
+#include "arm_elf.h"
+
+int
+arm32_hook_sig_parse (struct arm32_hook_sig *sig)
+{
+  const char *p = sig->spec;
+  int words = 0;
+  int argc = 0;
+  int i;
+
+  if (sig->ready)
+    return 0;
+
+  switch (*p)
+  {
+    case 'v':
+    case 'i':
+    case 'l':
+    case 'p':
+      sig->ret = *p++;
+      break;
+
+    default:
+      goto fail;
+  }
+
+  if ((sig->set_errno = *p == '!'))
+    ++p;
+
+  if (*p++ != ':')
+    goto fail;
+
+  while (*p != '\0')
+  {
+    if (argc == ARM32_HOOK_ARGS)
+      goto fail;
+
+    sig->type[argc]     = *p;
+    sig->size_arg[argc] = -1;
+
+    switch (*p++)
+    {
+      case 'l':
+        words = __ALIGN (words, 2);
+        sig->word[argc] = words;
+        words += 2;
+        break;
+
+      case 'p':
+      case 'w':
+        if (isdigit (*p))
+          sig->size_arg[argc] = *p++ - '0';
+
+        /* Fall through */
+
+      case 'i':
+      case 's':
+        sig->word[argc] = words++;
+        break;
+
+      default:
+        goto fail;
+    }
+
+    ++argc;
+
+    if (*p == ',')
+    {
+      if (*++p == '\0')
+        goto fail;
+    }
+    else if (*p != '\0')
+      goto fail;
+  }
+
+  if (words > ARM32_HOOK_WORDS)
+    goto fail;
+
+  /* Sizes are 32 bit integers */
+  for (i = 0; i < argc; ++i)
+    if (sig->size_arg[i] != -1 &&
+        (sig->size_arg[i] >= argc || sig->type[sig->size_arg[i]] != 'i'))
+      goto fail;
+
+  sig->argc  = argc;
+  sig->words = words;
+  sig->ready = 1;
+
+  return 0;
+
+fail:
+  error ("malformed hook signature \"%s\"\n", sig->spec);
+
+  return -1;
+}
+
+/* One segment lookup per buffer */
+static int
+arm32_hook_translate (struct arm32_cpu *cpu, struct arm32_hook_arg *arg, uint8_t access, const struct arm32_hook_arg *size)
+{
+  struct arm32_segment *seg;
+  uint32_t virt = arg->value;
+  uint32_t avail;
+
+  /* Nothing is accessed: memcpy (dst, NULL, 0) is valid, and so is an
+     empty buffer ending right at a segment end */
+  if ((virt == 0 && size == NULL) || (size != NULL && size->value == 0))
+    return 0;
+
+  if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL)
+    return -1;
+
+  if (arm32_segment_check_access (seg, access) == -1)
+    return -1;
+
+  avail = seg->virt + seg->size - virt;
+
+  if (size != NULL)
+  {
+    if ((uint32_t) size->value > avail)
+      return -1;
+
+    avail = size->value;
+  }
+
+  arg->ptr  = arm32_segment_translate (seg, virt);
+  arg->size = avail;
+
+  return 0;
+}
+
+/* Generic thunk of typed hooks, data is their struct arm32_hook_sig */
+int
+arm32_hook_typed_call (struct arm32_cpu *cpu, const char *name, void *data, uint32_t prev)
+{
+  const struct arm32_hook_sig *sig = (const struct arm32_hook_sig *) data;
+  struct arm32_hook_arg arg[ARM32_HOOK_ARGS];
+  uint32_t word[ARM32_HOOK_WORDS];
+  const uint32_t *stack;
+  uint64_t result = 0;
+  int64_t failed;
+  int code;
+  int i;
+
+  if (!sig->ready)
+    EXCEPT (ARM32_EXCEPTION_UNDEF);
+
+  for (i = 0; i < sig->words && i < 4; ++i)
+    word[i] = REG (cpu, i);
+
+  /* Stacked arguments, all of them at once */
+  if (sig->words > 4)
+  {
+    if ((stack = arm32_cpu_translate_read_size (cpu, SP (cpu), (sig->words - 4) * sizeof (uint32_t))) == NULL)
+      EXCEPT (ARM32_EXCEPTION_DATA);
+
+    memcpy (word + 4, stack, (sig->words - 4) * sizeof (uint32_t));
+  }
+
+  /* Integers first, buffer sizes may come after the buffer */
+  for (i = 0; i < sig->argc; ++i)
+  {
+    arg[i].value = word[sig->word[i]];
+    arg[i].ptr   = NULL;
+    arg[i].size  = 0;
+
+    if (sig->type[i] == 'l')
+      arg[i].value |= (uint64_t) word[sig->word[i] + 1] << 32;
+  }
+
+  for (i = 0; i < sig->argc; ++i)
+    switch (sig->type[i])
+    {
+      case 's':
+        if ((arg[i].ptr = (void *) arm32_stdlib_translate_string (cpu, arg[i].value, &arg[i].size)) == NULL)
+          EXCEPT (ARM32_EXCEPTION_DATA);
+        break;
+
+      case 'p':
+      case 'w':
+        if (arm32_hook_translate (cpu, &arg[i],
+                                  sig->type[i] == 'w' ? SA_W : SA_R,
+                                  sig->size_arg[i] == -1 ? NULL : &arg[sig->size_arg[i]]) == -1)
+          EXCEPT (ARM32_EXCEPTION_DATA);
+        break;
+    }
+
+  if ((code = (sig->native) (cpu, arg, &result)) != 0)
+    return code;
+
+  switch (sig->ret)
+  {
+    case 'l':
+      R1 (cpu) = result >> 32;
+      failed   = (int64_t) result;
+      R0 (cpu) = result;
+      break;
+
+    case 'i':
+    case 'p':
+      failed   = (int32_t) result;
+      R0 (cpu) = result;
+      break;
+
+    default:
+      failed = 0;
+  }
+
+  if (sig->set_errno && failed == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
@@ -826,8 +826,25 @@ IFPROTO (codoper)
   EXCEPT (ARM32_EXCEPTION_UNDEF);
 }
 
+/* Of CP15 only the user read-only thread ID register (TPIDRURO) is
+   there, reading back what set_tls stored */
 IFPROTO (cortrans)
 {
+  uint32_t opc1 = UINT32_GET_FIELD (instruction, 21, 3);
+  uint32_t load = UINT32_GET_FIELD (instruction, 20, 1);
+  uint32_t crn  = UINT32_GET_FIELD (instruction, 16, 4);
+  uint32_t rd   = UINT32_GET_FIELD (instruction, 12, 4);
+  uint32_t cp   = UINT32_GET_FIELD (instruction,  8, 4);
+  uint32_t opc2 = UINT32_GET_FIELD (instruction,  5, 3);
+  uint32_t crm  = UINT32_GET_FIELD (instruction,  0, 4);
+
+  if (cp == 15 && opc1 == 0 && load && crn == 13 && crm == 0 && opc2 == 3 && rd != 15)
+  {
+    REG (cpu, rd) = cpu->runtime.tls;
+
+    return 0;
+  }
+
   error ("Coprocessor register transfer instruction issued\n");
   
   EXCEPT (ARM32_EXCEPTION_UNDEF);
@@ -856,3 +873,34 @@ arm32_inst_decode (struct arm32_cpu *cpu, uint32_t inst)
   return NULL;
 }
 
+const struct arm32_inst *
+arm32_inst_get (unsigned int index)
+{
+  if (index >= sizeof (inst_list) / sizeof (inst_list[0]))
+    return NULL;
+
+  return &inst_list[index];
+}
+
+unsigned int
+arm32_inst_index (const struct arm32_inst *inst)
+{
+  return inst - inst_list;
+}
+
+/* Identifies the layout of the instruction table, so decode caches
+   written by a different build are not trusted */
+uint32_t
+arm32_inst_table_hash (void)
+{
+  uint32_t hash = 2166136261u;
+  int i;
+
+  for (i = 0; i < sizeof (inst_list) / sizeof (inst_list[0]); ++i)
+  {
+    hash = (hash ^ inst_list[i].mask) * 16777619u;
+    hash = (hash ^ inst_list[i].opcode) * 16777619u;
+  }
+
+  return hash;
+}
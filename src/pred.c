@@ -0,0 +1,507 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "arm_cpu.h"
+#include "arm_watch.h"
+
+/*
+ * Watchpoint conditions are small expressions compiled to a stack
+ * bytecode, like:
+ *
+ *   r0 == 0x1234 && pc >= 0x8000 && pc < 0x8100
+ *   [sp + 4] != 0 || !(cpsr & 0x40000000)
+ *
+ * Operands are numbers (C syntax), registers (r0-r15, sp, lr, pc, cpsr)
+ * and memory words ([expr]). All arithmetic is unsigned 32 bit. pc
+ * always holds the address of the instruction being tested.
+ *
+ * Operators bind as in C, tightest first:
+ *
+ *   ! - ~ (unary)   * / %   + -   << >>   < <= > >=   == !=   &   ^   |
+ *   &&   ||
+ *
+ * Division by zero and shifts by 32 or more give 0.
+ */
+
+#define ARM32_PRED_CONST 0
+#define ARM32_PRED_REG   1
+#define ARM32_PRED_PC    2
+#define ARM32_PRED_CPSR  3
+#define ARM32_PRED_LOAD  4
+#define ARM32_PRED_NOT   5
+#define ARM32_PRED_NEG   6
+#define ARM32_PRED_INV   7
+#define ARM32_PRED_ADD   8
+#define ARM32_PRED_SUB   9
+#define ARM32_PRED_AND   10
+#define ARM32_PRED_OR    11
+#define ARM32_PRED_XOR   12
+#define ARM32_PRED_MUL   13
+#define ARM32_PRED_DIV   14
+#define ARM32_PRED_MOD   15
+#define ARM32_PRED_SHL   16
+#define ARM32_PRED_SHR   17
+#define ARM32_PRED_EQ    18
+#define ARM32_PRED_NE    19
+#define ARM32_PRED_LT    20
+#define ARM32_PRED_LE    21
+#define ARM32_PRED_GT    22
+#define ARM32_PRED_GE    23
+#define ARM32_PRED_JZ    24 /* Jump if top is zero, pop otherwise */
+#define ARM32_PRED_JNZ   25 /* Jump if top is not zero, pop otherwise */
+#define ARM32_PRED_BOOL  26
+
+#define ARM32_PRED_MAX_DEPTH 32
+
+struct arm32_pred_parser
+{
+  const char *expr;
+  const char *ptr;
+
+  struct arm32_predicate *pred;
+
+  int depth;
+  int failed;
+};
+
+static void
+arm32_pred_error (struct arm32_pred_parser *parser, const char *what)
+{
+  if (!parser->failed)
+    error ("Condition \"%s\": %s at offset %d\n", parser->expr, what, (int) (parser->ptr - parser->expr));
+
+  parser->failed = 1;
+}
+
+static int
+arm32_pred_emit (struct arm32_pred_parser *parser, uint8_t op, uint32_t arg)
+{
+  struct arm32_predicate *pred = parser->pred;
+  struct arm32_pred_op *tmp;
+
+  if (pred->length == pred->alloc)
+  {
+    if ((tmp = realloc (pred->code, (pred->alloc + 16) * sizeof (struct arm32_pred_op))) == NULL)
+    {
+      arm32_pred_error (parser, "memory exhausted");
+
+      return -1;
+    }
+
+    pred->code = tmp;
+    pred->alloc += 16;
+  }
+
+  pred->code[pred->length].op  = op;
+  pred->code[pred->length].arg = arg;
+
+  /* Keep track of the stack usage */
+  if (op <= ARM32_PRED_CPSR)
+  {
+    if (++parser->depth > ARM32_PRED_MAX_DEPTH)
+      arm32_pred_error (parser, "expression too complex");
+  }
+  else if (op >= ARM32_PRED_ADD && op <= ARM32_PRED_JNZ)
+    --parser->depth;
+
+  return pred->length++;
+}
+
+static void
+arm32_pred_skip_spaces (struct arm32_pred_parser *parser)
+{
+  while (isspace ((unsigned char) *parser->ptr))
+    ++parser->ptr;
+}
+
+static int
+arm32_pred_accept (struct arm32_pred_parser *parser, const char *token)
+{
+  size_t len = strlen (token);
+
+  arm32_pred_skip_spaces (parser);
+
+  if (strncmp (parser->ptr, token, len) != 0)
+    return 0;
+
+  /* Don't mistake & for && or < for << */
+  if (len == 1 && strchr ("&|<>", *token) != NULL && parser->ptr[1] == *token)
+    return 0;
+
+  /* Nor ! for != */
+  if (len == 1 && *token == '!' && parser->ptr[1] == '=')
+    return 0;
+
+  parser->ptr += len;
+
+  return 1;
+}
+
+static void arm32_pred_parse_or (struct arm32_pred_parser *);
+
+static void
+arm32_pred_parse_primary (struct arm32_pred_parser *parser)
+{
+  char ident[8];
+  char *end;
+  uint32_t value;
+  int i;
+
+  arm32_pred_skip_spaces (parser);
+
+  if (arm32_pred_accept (parser, "("))
+  {
+    arm32_pred_parse_or (parser);
+
+    if (!arm32_pred_accept (parser, ")"))
+      arm32_pred_error (parser, "expected `)'");
+  }
+  else if (arm32_pred_accept (parser, "["))
+  {
+    arm32_pred_parse_or (parser);
+
+    if (!arm32_pred_accept (parser, "]"))
+      arm32_pred_error (parser, "expected `]'");
+
+    arm32_pred_emit (parser, ARM32_PRED_LOAD, 0);
+  }
+  else if (isdigit ((unsigned char) *parser->ptr))
+  {
+    value = strtoul (parser->ptr, &end, 0);
+    parser->ptr = end;
+
+    arm32_pred_emit (parser, ARM32_PRED_CONST, value);
+  }
+  else if (isalpha ((unsigned char) *parser->ptr))
+  {
+    for (i = 0; i < sizeof (ident) - 1 && isalnum ((unsigned char) *parser->ptr); ++i)
+      ident[i] = tolower ((unsigned char) *parser->ptr++);
+
+    ident[i] = '\0';
+
+    if (strcmp (ident, "pc") == 0 || strcmp (ident, "r15") == 0)
+      arm32_pred_emit (parser, ARM32_PRED_PC, 0);
+    else if (strcmp (ident, "cpsr") == 0)
+      arm32_pred_emit (parser, ARM32_PRED_CPSR, 0);
+    else if (strcmp (ident, "sp") == 0)
+      arm32_pred_emit (parser, ARM32_PRED_REG, 13);
+    else if (strcmp (ident, "lr") == 0)
+      arm32_pred_emit (parser, ARM32_PRED_REG, 14);
+    else if (ident[0] == 'r' && isdigit ((unsigned char) ident[1]) && (value = strtoul (ident + 1, &end, 10)) < 15 && *end == '\0')
+      arm32_pred_emit (parser, ARM32_PRED_REG, value);
+    else
+      arm32_pred_error (parser, "unknown identifier");
+  }
+  else
+    arm32_pred_error (parser, "expected operand");
+}
+
+static void
+arm32_pred_parse_unary (struct arm32_pred_parser *parser)
+{
+  if (arm32_pred_accept (parser, "!"))
+  {
+    arm32_pred_parse_unary (parser);
+    arm32_pred_emit (parser, ARM32_PRED_NOT, 0);
+  }
+  else if (arm32_pred_accept (parser, "-"))
+  {
+    arm32_pred_parse_unary (parser);
+    arm32_pred_emit (parser, ARM32_PRED_NEG, 0);
+  }
+  else if (arm32_pred_accept (parser, "~"))
+  {
+    arm32_pred_parse_unary (parser);
+    arm32_pred_emit (parser, ARM32_PRED_INV, 0);
+  }
+  else
+    arm32_pred_parse_primary (parser);
+}
+
+/* Binary operators by precedence level, tightest first. Longest tokens
+   come first within a level. */
+static const struct arm32_pred_binop
+{
+  const char *token;
+  uint8_t op;
+  uint8_t level;
+}
+arm32_pred_binop_list[] =
+{
+  {"*",  ARM32_PRED_MUL, 0}, {"/",  ARM32_PRED_DIV, 0}, {"%",  ARM32_PRED_MOD, 0},
+  {"+",  ARM32_PRED_ADD, 1}, {"-",  ARM32_PRED_SUB, 1},
+  {"<<", ARM32_PRED_SHL, 2}, {">>", ARM32_PRED_SHR, 2},
+  {"<=", ARM32_PRED_LE,  3}, {">=", ARM32_PRED_GE,  3},
+  {"<",  ARM32_PRED_LT,  3}, {">",  ARM32_PRED_GT,  3},
+  {"==", ARM32_PRED_EQ,  4}, {"!=", ARM32_PRED_NE,  4},
+  {"&",  ARM32_PRED_AND, 5},
+  {"^",  ARM32_PRED_XOR, 6},
+  {"|",  ARM32_PRED_OR,  7}
+};
+
+#define ARM32_PRED_BINOP_LEVELS 8
+
+/* Left associative operators of the given level and tighter ones */
+static void
+arm32_pred_parse_binary (struct arm32_pred_parser *parser, int level)
+{
+  int i;
+
+  if (level < 0)
+  {
+    arm32_pred_parse_unary (parser);
+
+    return;
+  }
+
+  arm32_pred_parse_binary (parser, level - 1);
+
+  while (!parser->failed)
+  {
+    for (i = 0; i < sizeof (arm32_pred_binop_list) / sizeof (arm32_pred_binop_list[0]); ++i)
+      if (arm32_pred_binop_list[i].level == level &&
+          arm32_pred_accept (parser, arm32_pred_binop_list[i].token))
+        break;
+
+    if (i == sizeof (arm32_pred_binop_list) / sizeof (arm32_pred_binop_list[0]))
+      break;
+
+    arm32_pred_parse_binary (parser, level - 1);
+    arm32_pred_emit (parser, arm32_pred_binop_list[i].op, 0);
+  }
+}
+
+static void
+arm32_pred_parse_and (struct arm32_pred_parser *parser)
+{
+  int jump;
+
+  arm32_pred_parse_binary (parser, ARM32_PRED_BINOP_LEVELS - 1);
+
+  while (!parser->failed && arm32_pred_accept (parser, "&&"))
+  {
+    arm32_pred_emit (parser, ARM32_PRED_BOOL, 0);
+
+    if ((jump = arm32_pred_emit (parser, ARM32_PRED_JZ, 0)) == -1)
+      return;
+
+    arm32_pred_parse_binary (parser, ARM32_PRED_BINOP_LEVELS - 1);
+    arm32_pred_emit (parser, ARM32_PRED_BOOL, 0);
+
+    /* Short circuit: skip the right operand if the left one is false */
+    parser->pred->code[jump].arg = parser->pred->length;
+  }
+}
+
+static void
+arm32_pred_parse_or (struct arm32_pred_parser *parser)
+{
+  int jump;
+
+  arm32_pred_parse_and (parser);
+
+  while (!parser->failed && arm32_pred_accept (parser, "||"))
+  {
+    arm32_pred_emit (parser, ARM32_PRED_BOOL, 0);
+
+    if ((jump = arm32_pred_emit (parser, ARM32_PRED_JNZ, 0)) == -1)
+      return;
+
+    arm32_pred_parse_and (parser);
+    arm32_pred_emit (parser, ARM32_PRED_BOOL, 0);
+
+    parser->pred->code[jump].arg = parser->pred->length;
+  }
+}
+
+void
+arm32_predicate_destroy (struct arm32_predicate *pred)
+{
+  if (pred->code != NULL)
+    free (pred->code);
+
+  free (pred);
+}
+
+struct arm32_predicate *
+arm32_predicate_compile (const char *expr)
+{
+  struct arm32_pred_parser parser;
+  struct arm32_predicate *new;
+
+  if ((new = calloc (1, sizeof (struct arm32_predicate))) == NULL)
+    return NULL;
+
+  memset (&parser, 0, sizeof (struct arm32_pred_parser));
+
+  parser.expr = expr;
+  parser.ptr  = expr;
+  parser.pred = new;
+
+  arm32_pred_parse_or (&parser);
+
+  arm32_pred_skip_spaces (&parser);
+
+  if (*parser.ptr != '\0')
+    arm32_pred_error (&parser, "trailing characters");
+
+  if (parser.failed)
+  {
+    arm32_predicate_destroy (new);
+
+    return NULL;
+  }
+
+  return new;
+}
+
+struct arm32_predicate *
+arm32_predicate_dup (const struct arm32_predicate *pred)
+{
+  struct arm32_predicate *new;
+
+  if ((new = calloc (1, sizeof (struct arm32_predicate))) == NULL)
+    return NULL;
+
+  if ((new->code = malloc (pred->length * sizeof (struct arm32_pred_op))) == NULL)
+  {
+    free (new);
+
+    return NULL;
+  }
+
+  memcpy (new->code, pred->code, pred->length * sizeof (struct arm32_pred_op));
+
+  new->length = new->alloc = pred->length;
+
+  return new;
+}
+
+/* Non-zero if the condition holds. Unmapped memory makes it false. */
+uint32_t
+arm32_predicate_eval (struct arm32_cpu *cpu, const struct arm32_predicate *pred)
+{
+  uint32_t stack[ARM32_PRED_MAX_DEPTH];
+  uint32_t *word;
+  int sp = -1;
+  int i;
+
+  for (i = 0; i < pred->length; ++i)
+    switch (pred->code[i].op)
+    {
+    case ARM32_PRED_CONST:
+      stack[++sp] = pred->code[i].arg;
+      break;
+
+    case ARM32_PRED_REG:
+      stack[++sp] = REG (cpu, pred->code[i].arg);
+      break;
+
+    case ARM32_PRED_PC:
+      stack[++sp] = cpu->wps->pc;
+      break;
+
+    case ARM32_PRED_CPSR:
+      stack[++sp] = CPSR (cpu);
+      break;
+
+    case ARM32_PRED_LOAD:
+      if ((word = arm32_cpu_translate_read_size (cpu, stack[sp], sizeof (uint32_t))) == NULL)
+        return 0;
+
+      stack[sp] = *word;
+      break;
+
+    case ARM32_PRED_NOT:
+      stack[sp] = !stack[sp];
+      break;
+
+    case ARM32_PRED_NEG:
+      stack[sp] = -stack[sp];
+      break;
+
+    case ARM32_PRED_INV:
+      stack[sp] = ~stack[sp];
+      break;
+
+    case ARM32_PRED_BOOL:
+      stack[sp] = !!stack[sp];
+      break;
+
+#define BINARY(op, expr)                        \
+      case op:                                  \
+        --sp;                                   \
+        stack[sp] = (expr);                     \
+        break
+
+      BINARY (ARM32_PRED_ADD, stack[sp] + stack[sp + 1]);
+      BINARY (ARM32_PRED_SUB, stack[sp] - stack[sp + 1]);
+      BINARY (ARM32_PRED_AND, stack[sp] & stack[sp + 1]);
+      BINARY (ARM32_PRED_OR,  stack[sp] | stack[sp + 1]);
+      BINARY (ARM32_PRED_XOR, stack[sp] ^ stack[sp + 1]);
+      BINARY (ARM32_PRED_MUL, stack[sp] * stack[sp + 1]);
+      BINARY (ARM32_PRED_DIV, stack[sp + 1] ? stack[sp] / stack[sp + 1] : 0);
+      BINARY (ARM32_PRED_MOD, stack[sp + 1] ? stack[sp] % stack[sp + 1] : 0);
+      BINARY (ARM32_PRED_SHL, stack[sp + 1] < 32 ? stack[sp] << stack[sp + 1] : 0);
+      BINARY (ARM32_PRED_SHR, stack[sp + 1] < 32 ? stack[sp] >> stack[sp + 1] : 0);
+      BINARY (ARM32_PRED_EQ,  stack[sp] == stack[sp + 1]);
+      BINARY (ARM32_PRED_NE,  stack[sp] != stack[sp + 1]);
+      BINARY (ARM32_PRED_LT,  stack[sp] <  stack[sp + 1]);
+      BINARY (ARM32_PRED_LE,  stack[sp] <= stack[sp + 1]);
+      BINARY (ARM32_PRED_GT,  stack[sp] >  stack[sp + 1]);
+      BINARY (ARM32_PRED_GE,  stack[sp] >= stack[sp + 1]);
+
+#undef BINARY
+
+    case ARM32_PRED_JZ:
+      if (stack[sp] == 0)
+        i = pred->code[i].arg - 1;
+      else
+        --sp;
+      break;
+
+    case ARM32_PRED_JNZ:
+      if (stack[sp] != 0)
+        i = pred->code[i].arg - 1;
+      else
+        --sp;
+      break;
+    }
+
+  return stack[0];
+}
+
+int
+arm32_watchpoint_set_condition (struct arm32_watchpoint *wp, const char *expr)
+{
+  struct arm32_predicate *pred = NULL;
+
+  if (expr != NULL)
+    if ((pred = arm32_predicate_compile (expr)) == NULL)
+      return -1;
+
+  if (wp->condition != NULL)
+    arm32_predicate_destroy (wp->condition);
+
+  wp->condition = pred;
+
+  return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "arm_cpu.h"
+#include "arm_stdio.h"
+#include "arm_aio.h"
+
+static struct arm32_stdio_stream *
+arm32_stdio_stream_new (struct arm32_stdio *stdio, int fd, int flags)
+{
+  struct arm32_stdio_stream *new;
+
+  if ((new = calloc (1, sizeof (struct arm32_stdio_stream))) == NULL)
+    return NULL;
+
+  new->fd    = fd;
+  new->flags = flags;
+  new->mode  = isatty (fd) ? ARM32_STDIO_LINE : ARM32_STDIO_FULL;
+  new->owner = stdio;
+
+  return new;
+}
+
+static void
+arm32_stdio_stream_destroy (struct arm32_stdio_stream *stream)
+{
+  if (stream->wbuf != NULL)
+    free (stream->wbuf);
+
+  if (stream->rbuf != NULL)
+    free (stream->rbuf);
+
+  free (stream);
+}
+
+static void
+arm32_stdio_segment_dtor (void *data, void *phys, uint32_t size)
+{
+  free (phys);
+}
+
+static struct arm32_stdio *
+arm32_stdio_new (struct arm32_cpu *cpu)
+{
+  struct arm32_stdio *new;
+  struct arm32_segment *seg;
+  uint32_t *slot_list;
+  uint32_t virt;
+  int i;
+
+  if ((virt = arm32_cpu_find_region (cpu, ARM32_STDIO_MAX_STREAMS * sizeof (uint32_t), 16)) == -1)
+    return NULL;
+
+  if ((new = calloc (1, sizeof (struct arm32_stdio))) == NULL)
+    return NULL;
+
+  if ((slot_list = malloc (ARM32_STDIO_MAX_STREAMS * sizeof (uint32_t))) == NULL)
+    goto fail;
+
+  new->virt = virt;
+
+  for (i = 0; i < ARM32_STDIO_MAX_STREAMS; ++i)
+    slot_list[i] = virt + i * sizeof (uint32_t);
+
+  if ((seg = arm32_segment_new (virt, slot_list, ARM32_STDIO_MAX_STREAMS * sizeof (uint32_t), SA_R | SA_W)) == NULL)
+  {
+    free (slot_list);
+
+    goto fail;
+  }
+
+  arm32_segment_set_dtor (seg, arm32_stdio_segment_dtor, NULL);
+
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    arm32_segment_destroy (seg);
+
+    goto fail;
+  }
+
+  if ((new->stream_list[ARM32_STDIO_STDIN]  = arm32_stdio_stream_new (new, 0, ARM32_STDIO_READ))  == NULL ||
+      (new->stream_list[ARM32_STDIO_STDOUT] = arm32_stdio_stream_new (new, 1, ARM32_STDIO_WRITE)) == NULL ||
+      (new->stream_list[ARM32_STDIO_STDERR] = arm32_stdio_stream_new (new, 2, ARM32_STDIO_WRITE)) == NULL)
+    goto fail;
+
+  new->stream_list[ARM32_STDIO_STDERR]->mode = ARM32_STDIO_NONE;
+
+  return new;
+
+fail:
+  /* The table segment, if any, stays mapped until the CPU goes away */
+  arm32_stdio_destroy (new);
+
+  return NULL;
+}
+
+/* Created the first time the guest needs it */
+struct arm32_stdio *
+arm32_cpu_get_stdio (struct arm32_cpu *cpu)
+{
+  if (cpu->runtime.stdio == NULL)
+    cpu->runtime.stdio = arm32_stdio_new (cpu);
+
+  return cpu->runtime.stdio;
+}
+
+/* Pending output is written, descriptors opened by the guest are closed */
+void
+arm32_stdio_destroy (struct arm32_stdio *stdio)
+{
+  int i;
+
+  arm32_stdio_flush_all (stdio);
+
+  for (i = 0; i < ARM32_STDIO_MAX_STREAMS; ++i)
+    if (stdio->stream_list[i] != NULL)
+    {
+      if (i > ARM32_STDIO_STDERR)
+        close (stdio->stream_list[i]->fd);
+
+      arm32_stdio_stream_destroy (stdio->stream_list[i]);
+    }
+
+  free (stdio);
+}
+
+uint32_t
+arm32_stdio_handle (struct arm32_cpu *cpu, int index)
+{
+  struct arm32_stdio *stdio;
+
+  if ((stdio = arm32_cpu_get_stdio (cpu)) == NULL)
+    return 0;
+
+  return stdio->virt + index * sizeof (uint32_t);
+}
+
+struct arm32_stdio_stream *
+arm32_stdio_lookup (struct arm32_cpu *cpu, uint32_t handle)
+{
+  struct arm32_stdio *stdio;
+  uint32_t index;
+
+  if ((stdio = arm32_cpu_get_stdio (cpu)) == NULL)
+    return NULL;
+
+  index = (handle - stdio->virt) / sizeof (uint32_t);
+
+  if ((handle & 3) != 0 || index >= ARM32_STDIO_MAX_STREAMS)
+    return NULL;
+
+  return stdio->stream_list[index];
+}
+
+static int
+arm32_stdio_parse_mode (const char *mode, int *flags)
+{
+  int oflags;
+
+  switch (*mode++)
+  {
+  case 'r':
+    oflags = O_RDONLY;
+    *flags = ARM32_STDIO_READ;
+    break;
+
+  case 'w':
+    oflags = O_WRONLY | O_CREAT | O_TRUNC;
+    *flags = ARM32_STDIO_WRITE;
+    break;
+
+  case 'a':
+    oflags = O_WRONLY | O_CREAT | O_APPEND;
+    *flags = ARM32_STDIO_WRITE;
+    break;
+
+  default:
+    return -1;
+  }
+
+  for (; *mode != '\0' && *mode != ','; ++mode)
+    switch (*mode)
+    {
+    case '+':
+      oflags = (oflags & ~O_ACCMODE) | O_RDWR;
+      *flags = ARM32_STDIO_READ | ARM32_STDIO_WRITE;
+      break;
+
+    case 'x':
+      oflags |= O_EXCL;
+      break;
+
+    case 'e':
+      oflags |= O_CLOEXEC;
+      break;
+    }
+
+  return oflags;
+}
+
+/* Returns the guest FILE pointer, or 0 with errno set */
+uint32_t
+arm32_stdio_open (struct arm32_cpu *cpu, const char *path, const char *mode)
+{
+  struct arm32_stdio *stdio;
+  int oflags, flags;
+  int fd;
+  int i;
+
+  if ((stdio = arm32_cpu_get_stdio (cpu)) == NULL)
+  {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  if ((oflags = arm32_stdio_parse_mode (mode, &flags)) == -1)
+  {
+    errno = EINVAL;
+    return 0;
+  }
+
+  for (i = ARM32_STDIO_STDERR + 1; i < ARM32_STDIO_MAX_STREAMS; ++i)
+    if (stdio->stream_list[i] == NULL)
+      break;
+
+  if (i == ARM32_STDIO_MAX_STREAMS)
+  {
+    errno = EMFILE;
+    return 0;
+  }
+
+  if ((fd = open (path, oflags, 0666)) == -1)
+    return 0;
+
+  if ((stdio->stream_list[i] = arm32_stdio_stream_new (stdio, fd, flags)) == NULL)
+  {
+    close (fd);
+
+    errno = ENOMEM;
+    return 0;
+  }
+
+  return stdio->virt + i * sizeof (uint32_t);
+}
+
+/* The standard streams are only flushed and detached, their host
+   descriptors belong to the process embedding the emulator */
+int
+arm32_stdio_close (struct arm32_cpu *cpu, uint32_t handle)
+{
+  struct arm32_stdio_stream *stream;
+  int result;
+  int i;
+
+  if ((stream = arm32_stdio_lookup (cpu, handle)) == NULL)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  i = (handle - cpu->runtime.stdio->virt) / sizeof (uint32_t);
+
+  result = arm32_stdio_flush (stream);
+
+  if (i > ARM32_STDIO_STDERR)
+  {
+    arm32_aio_untrack (cpu, stream->fd);
+
+    if (close (stream->fd) == -1)
+      result = -1;
+  }
+
+  cpu->runtime.stdio->stream_list[i] = NULL;
+
+  arm32_stdio_stream_destroy (stream);
+
+  return result;
+}
+
+/* Partial writes are retried until everything is out */
+static int
+arm32_stdio_writev_all (struct arm32_stdio_stream *stream, struct iovec *iov, int count)
+{
+  ssize_t written;
+
+  while (count > 0)
+  {
+    if ((written = writev (stream->fd, iov, count)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      stream->flags |= ARM32_STDIO_ERROR;
+
+      return -1;
+    }
+
+    while (count > 0 && written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+
+    if (count > 0)
+    {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len  -= written;
+    }
+  }
+
+  return 0;
+}
+
+/* Input read ahead is given back to the file before writing */
+static int
+arm32_stdio_drop_input (struct arm32_stdio_stream *stream)
+{
+  if (stream->rpos < stream->rlen)
+    if (lseek (stream->fd, (off_t) stream->rpos - (off_t) stream->rlen, SEEK_CUR) == -1)
+      if (errno != ESPIPE)
+        return -1;
+
+  stream->rpos = stream->rlen = 0;
+
+  return 0;
+}
+
+int
+arm32_stdio_flush (struct arm32_stdio_stream *stream)
+{
+  struct iovec iov;
+
+  if (stream->wlen == 0)
+    return 0;
+
+  iov.iov_base = stream->wbuf;
+  iov.iov_len  = stream->wlen;
+
+  stream->wlen = 0;
+
+  return arm32_stdio_writev_all (stream, &iov, 1);
+}
+
+int
+arm32_stdio_flush_all (struct arm32_stdio *stdio)
+{
+  int result = 0;
+  int i;
+
+  for (i = 0; i < ARM32_STDIO_MAX_STREAMS; ++i)
+    if (stdio->stream_list[i] != NULL)
+      if (arm32_stdio_flush (stdio->stream_list[i]) == -1)
+        result = -1;
+
+  return result;
+}
+
+/* Data that does not fit in the buffer goes out along with it in a
+   single writev, instead of a flush followed by a write */
+ssize_t
+arm32_stdio_write (struct arm32_stdio_stream *stream, const void *data, size_t size)
+{
+  struct iovec iov[2];
+
+  if (!(stream->flags & ARM32_STDIO_WRITE))
+  {
+    stream->flags |= ARM32_STDIO_ERROR;
+
+    errno = EBADF;
+    return -1;
+  }
+
+  if (arm32_stdio_drop_input (stream) == -1)
+    return -1;
+
+  if (stream->wlen + size > ARM32_STDIO_BUFSIZ)
+  {
+    iov[0].iov_base = stream->wbuf;
+    iov[0].iov_len  = stream->wlen;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len  = size;
+
+    stream->wlen = 0;
+
+    if (arm32_stdio_writev_all (stream, iov, 2) == -1)
+      return -1;
+
+    return size;
+  }
+
+  if (stream->wbuf == NULL)
+    if ((stream->wbuf = malloc (ARM32_STDIO_BUFSIZ)) == NULL)
+      return -1;
+
+  memcpy (stream->wbuf + stream->wlen, data, size);
+  stream->wlen += size;
+
+  if (stream->mode == ARM32_STDIO_NONE ||
+      (stream->mode == ARM32_STDIO_LINE && memchr (data, '\n', size) != NULL))
+    if (arm32_stdio_flush (stream) == -1)
+      return -1;
+
+  return size;
+}
+
+/* Interactive programs expect their prompts out before blocking on input */
+static void
+arm32_stdio_flush_line_buffered (struct arm32_stdio *stdio)
+{
+  int i;
+
+  for (i = 0; i < ARM32_STDIO_MAX_STREAMS; ++i)
+    if (stdio->stream_list[i] != NULL && stdio->stream_list[i]->mode == ARM32_STDIO_LINE)
+      arm32_stdio_flush (stdio->stream_list[i]);
+}
+
+static int
+arm32_stdio_prepare_read (struct arm32_stdio_stream *stream)
+{
+  if (!(stream->flags & ARM32_STDIO_READ))
+  {
+    stream->flags |= ARM32_STDIO_ERROR;
+
+    errno = EBADF;
+    return -1;
+  }
+
+  if (arm32_stdio_flush (stream) == -1)
+    return -1;
+
+  if (stream->rbuf == NULL)
+    if ((stream->rbuf = malloc (ARM32_STDIO_BUFSIZ)) == NULL)
+      return -1;
+
+  return 0;
+}
+
+/* Whatever the buffer cannot satisfy is read straight into data, and
+   the buffer is refilled by the same readv */
+ssize_t
+arm32_stdio_read (struct arm32_stdio_stream *stream, void *data, size_t size)
+{
+  struct iovec iov[2];
+  size_t done;
+  ssize_t got;
+
+  if (arm32_stdio_prepare_read (stream) == -1)
+    return -1;
+
+  if ((done = stream->rlen - stream->rpos) > size)
+    done = size;
+
+  memcpy (data, stream->rbuf + stream->rpos, done);
+  stream->rpos += done;
+
+  while (done < size)
+  {
+    iov[0].iov_base = (char *) data + done;
+    iov[0].iov_len  = size - done;
+    iov[1].iov_base = stream->rbuf;
+    iov[1].iov_len  = ARM32_STDIO_BUFSIZ;
+
+    if (stream->mode == ARM32_STDIO_LINE)
+      arm32_stdio_flush_line_buffered (stream->owner);
+
+    if ((got = readv (stream->fd, iov, 2)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      stream->flags |= ARM32_STDIO_ERROR;
+
+      return done > 0 ? done : -1;
+    }
+
+    if (got == 0)
+    {
+      stream->flags |= ARM32_STDIO_EOF;
+
+      break;
+    }
+
+    if (got > size - done)
+    {
+      stream->rpos = 0;
+      stream->rlen = got - (size - done);
+
+      got = size - done;
+    }
+
+    done += got;
+  }
+
+  return done;
+}
+
+/* Like fgets: stops after a newline, size counts the terminator. Returns
+   the number of bytes stored, 0 on end of file */
+ssize_t
+arm32_stdio_gets (struct arm32_stdio_stream *stream, char *data, size_t size)
+{
+  const char *nl = NULL;
+  size_t done = 0;
+  size_t avail;
+  ssize_t got;
+
+  if (size == 0)
+    return 0;
+
+  if (arm32_stdio_prepare_read (stream) == -1)
+    return -1;
+
+  while (nl == NULL && done + 1 < size)
+  {
+    if (stream->rpos == stream->rlen)
+    {
+      if (stream->mode == ARM32_STDIO_LINE)
+        arm32_stdio_flush_line_buffered (stream->owner);
+
+      if ((got = read (stream->fd, stream->rbuf, ARM32_STDIO_BUFSIZ)) == -1)
+      {
+        if (errno == EINTR)
+          continue;
+
+        stream->flags |= ARM32_STDIO_ERROR;
+
+        return -1;
+      }
+
+      if (got == 0)
+      {
+        stream->flags |= ARM32_STDIO_EOF;
+
+        break;
+      }
+
+      stream->rpos = 0;
+      stream->rlen = got;
+    }
+
+    if ((avail = stream->rlen - stream->rpos) > size - 1 - done)
+      avail = size - 1 - done;
+
+    if ((nl = memchr (stream->rbuf + stream->rpos, '\n', avail)) != NULL)
+      avail = nl - (stream->rbuf + stream->rpos) + 1;
+
+    memcpy (data + done, stream->rbuf + stream->rpos, avail);
+
+    stream->rpos += avail;
+    done         += avail;
+  }
+
+  data[done] = '\0';
+
+  return done;
+}
@@ -16,25 +16,51 @@
  *    along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* mremap */
+
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <config.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <wchar.h>
 
 #include <armette.h>
 
 #include <arm_cpu.h>
 #include <arm_inst.h>
 #include <arm_elf.h>
+#include <arm_stdio.h>
+#include <arm_aio.h>
+
+/* The host getopt keeps its state in globals */
+static pthread_mutex_t arm32_stdlib_getopt_lock = PTHREAD_MUTEX_INITIALIZER;
 
-extern uint32_t  arm_errno_virt;
-extern uint32_t *arm_errno;
-uint32_t *arm_optind;
+/* Count bytes moved for the hook profiler */
+static inline ssize_t
+arm32_stdlib_account (struct arm32_cpu *cpu, ssize_t bytes)
+{
+  if (bytes > 0)
+    cpu->runtime.bytes += bytes;
+
+  return bytes;
+}
 
 struct arm32_stat64
 {
@@ -85,16 +111,14 @@ ARMPROTO (setlocale)
 
   dom = R0 (cpu);
 
-  static uint32_t last;
-  
   if (R1 (cpu) == 0)
   {
-    R0 (cpu) = last;
-    debug ("Return last locale at 0x%x\n", last);
+    R0 (cpu) = cpu->runtime.locale;
+    debug ("Return last locale at 0x%x\n", cpu->runtime.locale);
   }
   else
   {
-    if ((locale = arm32_cpu_translate_read (cpu, last = R1 (cpu))) == NULL)
+    if ((locale = arm32_cpu_translate_read (cpu, cpu->runtime.locale = R1 (cpu))) == NULL)
       EXCEPT (ARM32_EXCEPTION_DATA);
     
     debug ("Set locale of domain #%d to \"%s\"\n", dom, locale);
@@ -105,48 +129,6 @@ ARMPROTO (setlocale)
   return 0;
 }
 
-ARMPROTO (strrchr)
-{
-  char *haystack;
-  char *where;
-  
-  if ((haystack = arm32_cpu_translate_read (cpu, R0 (cpu))) == NULL)
-    EXCEPT (ARM32_EXCEPTION_DATA);
-  
-  debug ("Strrchr: \"%s\"\n", haystack);
-  debug ("Char: '%c'\n", R1 (cpu));
-
-  if ((where = strrchr (haystack, R1 (cpu))) == NULL)
-    R0 (cpu) = 0;
-  else
-    R0 (cpu) = (where - haystack) + R0 (cpu);
-
-  arm32_cpu_return (cpu);
-  
-  return 0;
-}
-
-ARMPROTO (fwrite)
-{
-  char *buf;
-  int len;
-  int pieces;
-  uint32_t dest;
-  
-  if ((buf = arm32_cpu_translate_read (cpu, R0 (cpu))) == NULL)
-    EXCEPT (ARM32_EXCEPTION_DATA);
-
-  len = R1 (cpu);
-  pieces = R2 (cpu);
-  dest = R3 (cpu);
-
-  debug ("fwrite (\"%s\", %d, %d, 0x%x)\n", buf, len, pieces, dest);
-  
-  arm32_cpu_return (cpu);
-  
-  return 0;
-}
-
 ARMPROTO (libc_start_main)
 {
   debug ("Main: 0x%x\n", R0 (cpu));
@@ -161,12 +143,10 @@ ARMPROTO (libc_start_main)
   return 0;
 }
 
-ARMPROTO (getpagesize)
+ARMTYPED (getpagesize, "i:")
 {
-  R0 (cpu) = 4096;
-  
-  arm32_cpu_return (cpu);
-  
+  *result = 4096;
+
   return 0;
 }
 
@@ -290,10 +270,16 @@ ARMPROTO (getopt_long)
     debug ("  Register longopt: \"%s\" --> '%c'\n", native_longopts[i].name, native_longopts[i].val);
   }
   
+  /* Each CPU has its own optind, which the guest may have reset */
+  pthread_mutex_lock (&arm32_stdlib_getopt_lock);
+
+  optind = *cpu->runtime.optind;
+
   R0 (cpu) = getopt_long (R0 (cpu), argv_copy, optstring, native_longopts, longindex);
 
-  /* Update optind */
-  *arm_optind = optind;
+  *cpu->runtime.optind = optind;
+
+  pthread_mutex_unlock (&arm32_stdlib_getopt_lock);
   
   free (argv_copy);
   free (native_longopts);
@@ -328,82 +314,183 @@ ARMPROTO (__fxstat64)
   return 0;
 }
 
-ARMPROTO (memmove)
+ARMTYPED (memmove, "p:w2,p2,i")
 {
-  const void *src;
-  void *dst;
-  uint32_t size;
+  memmove (arg[0].ptr, arg[1].ptr, arg[2].value);
 
-  size = R2 (cpu);
-  
-  if ((dst = arm32_cpu_translate_write_size (cpu, R0 (cpu), size)) == NULL ||
-      (src = arm32_cpu_translate_read_size  (cpu, R1 (cpu), size)) == NULL)
-    EXCEPT (ARM32_EXCEPTION_DATA);
+  arm32_stdlib_account (cpu, arg[2].value);
 
-  memmove (dst, src, size);
+  *result = arg[0].value;
 
-  arm32_cpu_return (cpu);
+  return 0;
+}
+
+ARMTYPED (memcpy, "p:w2,p2,i")
+{
+  memcpy (arg[0].ptr, arg[1].ptr, arg[2].value);
+
+  arm32_stdlib_account (cpu, arg[2].value);
+
+  *result = arg[0].value;
 
   return 0;
 }
 
-ARMPROTO (memcpy)
+ARMTYPED (memset, "p:w2,i,i")
 {
-  const void *src;
-  void *dst;
-  uint32_t size;
+  memset (arg[0].ptr, arg[1].value, arg[2].value);
 
-  size = R2 (cpu);
+  arm32_stdlib_account (cpu, arg[2].value);
 
-  if ((dst = arm32_cpu_translate_write_size (cpu, R0 (cpu), size)) == NULL ||
-      (src = arm32_cpu_translate_read_size  (cpu, R1 (cpu), size)) == NULL)
-  {
-    error ("memcpy: invalid address (0x%x, 0x%x <-- %d bytes)\n", R0 (cpu), R1 (cpu), size);
+  *result = arg[0].value;
+
+  return 0;
+}
+
+
+/* Guest strings must be terminated inside their segment. Returns NULL
+   otherwise, the length goes to len. */
+const char *
+arm32_stdlib_translate_string (struct arm32_cpu *cpu, uint32_t virt, uint32_t *len)
+{
+  const char *str;
+  uint32_t avail;
+
+  if ((str = arm32_cpu_translate_read_avail (cpu, virt, &avail)) == NULL)
+    return NULL;
+
+  if ((*len = strnlen (str, avail)) == avail)
+    return NULL;
+
+  return str;
+}
+
+/* Compare up to n bytes of two guest strings without leaving their
+   segments. Returns -1 if the comparison would need to. */
+static int
+arm32_stdlib_compare_strings (struct arm32_cpu *cpu, uint32_t a, uint32_t b, uint32_t n, int *result)
+{
+  const char *s1, *s2;
+  uint32_t avail1, avail2;
+  uint32_t max;
+
+  if ((s1 = arm32_cpu_translate_read_avail (cpu, a, &avail1)) == NULL ||
+      (s2 = arm32_cpu_translate_read_avail (cpu, b, &avail2)) == NULL)
+    return -1;
+
+  max = n;
+
+  if (max > avail1)
+    max = avail1;
+
+  if (max > avail2)
+    max = avail2;
+
+  *result = strncmp (s1, s2, max);
+
+  /* Equal so far and no terminator found: the rest is out of bounds */
+  if (*result == 0 && max < n && memchr (s1, 0, max) == NULL)
+    return -1;
+
+  return 0;
+}
+
+ARMPROTO (strncmp)
+{
+  int result;
+
+  if (arm32_stdlib_compare_strings (cpu, R0 (cpu), R1 (cpu), R2 (cpu), &result) == -1)
     EXCEPT (ARM32_EXCEPTION_DATA);
-  }
-  
-  memcpy (dst, src, size);
+
+  R0 (cpu) = result;
 
   arm32_cpu_return (cpu);
 
   return 0;
 }
 
-ARMPROTO (memset)
+ARMPROTO (strcmp)
 {
-  void *dst;
-  uint32_t size;
+  int result;
 
-  size = R2 (cpu);
-  
-  if ((dst = arm32_cpu_translate_write_size (cpu, R0 (cpu), size)) == NULL)
+  if (arm32_stdlib_compare_strings (cpu, R0 (cpu), R1 (cpu), 0xffffffff, &result) == -1)
     EXCEPT (ARM32_EXCEPTION_DATA);
-  
-  memset (dst, R1 (cpu), size);
+
+  R0 (cpu) = result;
 
   arm32_cpu_return (cpu);
 
   return 0;
 }
 
+ARMTYPED (strlen, "i:s")
+{
+  *result = arg[0].size;
+
+  return 0;
+}
 
-ARMPROTO (strncmp)
+ARMTYPED (strchr, "p:s,i")
 {
-  const char *s1, *s2;
+  const char *where;
+
+  /* Searching for 0 finds the terminator */
+  if ((where = memchr (arg[0].ptr, (char) arg[1].value, arg[0].size + 1)) == NULL)
+    *result = 0;
+  else
+    *result = arg[0].value + (where - (const char *) arg[0].ptr);
+
+  return 0;
+}
+
+ARMTYPED (strrchr, "p:s,i")
+{
+  const char *where;
+
+  if ((where = strrchr (arg[0].ptr, (char) arg[1].value)) == NULL)
+    *result = 0;
+  else
+    *result = arg[0].value + (where - (const char *) arg[0].ptr);
+
+  return 0;
+}
+
+ARMPROTO (strcpy)
+{
+  const char *src;
+  char *dst;
+  uint32_t len;
 
-  if ((s1 = arm32_cpu_translate_read (cpu, R0 (cpu))) == NULL ||
-      (s2 = arm32_cpu_translate_read (cpu, R1 (cpu))) == NULL)
+  if ((src = arm32_stdlib_translate_string (cpu, R1 (cpu), &len)) == NULL ||
+      (dst = arm32_cpu_translate_write_size (cpu, R0 (cpu), len + 1)) == NULL)
     EXCEPT (ARM32_EXCEPTION_DATA);
 
-  debug ("Strncmp: \"%s\", \"%s\", %d\n", s1, s2, R2 (cpu));
-  
-  R0 (cpu) = strncmp (s1, s2, R2 (cpu));
+  memmove (dst, src, len + 1);
 
   arm32_cpu_return (cpu);
 
   return 0;
 }
 
+ARMTYPED (memchr, "p:p2,i,i")
+{
+  const char *where;
+
+  if ((where = memchr (arg[0].ptr, (char) arg[1].value, arg[2].value)) == NULL)
+    *result = 0;
+  else
+    *result = arg[0].value + (where - (const char *) arg[0].ptr);
+
+  return 0;
+}
+
+ARMTYPED (memcmp, "i:p2,p2,i")
+{
+  *result = memcmp (arg[0].ptr, arg[1].ptr, arg[2].value);
+
+  return 0;
+}
+
 ARMPROTO (open64)
 {
   char *file;
@@ -414,9 +501,10 @@ ARMPROTO (open64)
   debug ("Open file: \"%s\", flags %d, mode 0%03o\n",
 	  file, R1 (cpu), R2 (cpu));
 
-  R0 (cpu) = open (file, R1 (cpu), R2 (cpu));
-
-  *arm_errno = errno;
+  if ((R0 (cpu) = open (file, R1 (cpu), R2 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+  else if ((R1 (cpu) & O_ACCMODE) == O_RDONLY)
+    arm32_aio_track (cpu, R0 (cpu));
   
   arm32_cpu_return (cpu);
 
@@ -425,466 +513,2635 @@ ARMPROTO (open64)
 
 ARMPROTO (__errno_location)
 {
-  R0 (cpu) = arm_errno_virt;
+  R0 (cpu) = cpu->runtime.errno_virt;
 
   arm32_cpu_return (cpu);
 
   return 0;
 }
 
-const char *
-arm32_cpu_fprintf_pieces (struct arm32_cpu *cpu, FILE *output, int index, const char *fmt)
+/* Output of the guest printf family, reused across calls */
+struct arm32_stdlib_buf
 {
-  uint32_t *stack;
-  uint32_t arg;
-  const char *first_fmt, *next_fmt;
-  char fmtchar;
-  int i, modifiers;
-  char *fmtcopy;
-  
-  if (index < 4)
-    arg = REG (cpu, index);
-  else
-  {
-    if ((stack = arm32_cpu_translate_read (cpu, SP (cpu) + (index - 4) * sizeof (uint32_t))) == NULL)
-      return NULL;
-    
-    arg = *stack;
-  }
+  char  *data;
+  size_t len;
+  size_t alloc;
+};
+
+/* Guest variadic arguments, as laid out by the AAPCS: r0-r3 first, then
+   the stack. 64 bit values take an even register pair or an 8 byte
+   aligned stack slot. A guest va_list is just a stack pointer. */
+struct arm32_stdlib_va
+{
+  struct arm32_cpu *cpu;
+  int      reg;   /* Next core register, 4 once they are exhausted */
+  uint32_t stack; /* Next stacked argument */
+};
 
-  if ((first_fmt = strchr (fmt, '%')) == NULL)
-  {
-    fprintf (output, "%s", fmt);
-    next_fmt = fmt + strlen (fmt);
-  }
-  else
-  {
-    /* TODO: this doesn't support long-long argument. Please fix */
-    for (i = first_fmt - fmt + 1; i < strlen (fmt); ++i)
-      if (strchr ("%sdifgxXoup", fmtchar = fmt[i]) != NULL)
-	break;
+#define ARM32_STDLIB_MAX_WIDTH 65536
 
-    if (fmt[i] == '0')
-    {
-      fprintf (output, "%s", fmt);
-      next_fmt = &fmt[i];
-    }
-    else
-    {
-      next_fmt = &fmt[i + 1];
+static __thread struct arm32_stdlib_buf arm32_stdlib_printf_buf;
 
-      if ((fmtcopy = malloc (i + 2)) == NULL)
-	return NULL;
+static int
+arm32_stdlib_buf_grow (struct arm32_stdlib_buf *buf, size_t size)
+{
+  size_t alloc;
+  char *data;
 
-      memcpy (fmtcopy, fmt, i + 1);
-      
-      fmtcopy[i + 1] = 0;
+  if (buf->len + size <= buf->alloc)
+    return 0;
 
-      if (fmtchar == 's')
-	fprintf (output, fmtcopy, (char *) arm32_cpu_translate_read (cpu, arg));
-      else
-	fprintf (output, fmtcopy, arg);
-      
-      free (fmtcopy);
-    }
-  }
+  for (alloc = buf->alloc ? buf->alloc : 256; alloc < buf->len + size; alloc <<= 1);
+
+  if ((data = realloc (buf->data, alloc)) == NULL)
+    return -1;
 
-  return next_fmt;
+  buf->data  = data;
+  buf->alloc = alloc;
+
+  return 0;
 }
 
-ARMPROTO (error)
+static int
+arm32_stdlib_buf_append (struct arm32_stdlib_buf *buf, const char *data, size_t size)
 {
-  char *errfmt;
-  const char *ptr;
-  int n;
-  
-  if ((errfmt = arm32_cpu_translate_read (cpu, R2 (cpu))) == NULL)
-    EXCEPT (ARM32_EXCEPTION_DATA);
+  if (arm32_stdlib_buf_grow (buf, size) == -1)
+    return -1;
 
-  ptr = errfmt;
+  memcpy (buf->data + buf->len, data, size);
 
-  n = 3;
+  buf->len += size;
 
-  fprintf (stderr, "error: ");
-  
-  do
+  return 0;
+}
+
+static int
+arm32_stdlib_buf_printf (struct arm32_stdlib_buf *buf, const char *spec, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start (ap, spec);
+  len = vsnprintf (buf->data + buf->len, buf->alloc - buf->len, spec, ap);
+  va_end (ap);
+
+  if (len < 0)
+    return -1;
+
+  /* Didn't fit, try again with enough room */
+  if (len >= buf->alloc - buf->len)
   {
-    ptr = arm32_cpu_fprintf_pieces (cpu, stderr, n++, ptr);
-  }
-  while (*ptr);
+    if (arm32_stdlib_buf_grow (buf, len + 1) == -1)
+      return -1;
 
-  fprintf (stderr, ": %s\n", strerror (*arm_errno));
+    va_start (ap, spec);
+    vsnprintf (buf->data + buf->len, buf->alloc - buf->len, spec, ap);
+    va_end (ap);
+  }
 
-  if (R0 (cpu))
-    exit (R0 (cpu));
-  
-  arm32_cpu_return (cpu);
+  buf->len += len;
 
   return 0;
 }
 
-ARMPROTO (posix_fadvise64)
+/* Arguments from the index-th one on */
+static void
+arm32_stdlib_va_init (struct arm32_stdlib_va *va, struct arm32_cpu *cpu, int index)
 {
-  debug ("File access advice:\n");
-  debug ("  Fd: %d\n", R0 (cpu));
-  debug ("  Offset: 0x%x\n", R1 (cpu));
-  debug ("  Len: %d\n", R2 (cpu));
-  debug ("  Advice: %d\n", R3 (cpu));
-
-  arm32_cpu_return (cpu);
+  va->cpu = cpu;
 
-  return 0;
+  if (index < 4)
+  {
+    va->reg   = index;
+    va->stack = SP (cpu);
+  }
+  else
+  {
+    va->reg   = 4;
+    va->stack = SP (cpu) + (index - 4) * sizeof (uint32_t);
+  }
 }
 
-void
-__arm32_stdlib_malloc_segment_dtor (void *data, void *phys, uint32_t size)
+static void
+arm32_stdlib_va_init_list (struct arm32_stdlib_va *va, struct arm32_cpu *cpu, uint32_t ap)
 {
-  free (phys);
+  va->cpu   = cpu;
+  va->reg   = 4;
+  va->stack = ap;
 }
 
-void
-hexdump (const void *data, uint32_t size)
+static int
+arm32_stdlib_va_next (struct arm32_stdlib_va *va, uint32_t *value)
 {
-  const uint8_t *bytes = (const uint8_t *) data;
+  uint32_t *word;
 
-  int i, j;
-  
-  for (i = 0; i < size; ++i)
+  if (va->reg < 4)
   {
-    if ((i & 0xf) == 0)
-      printf ("%08x  ", i);
+    *value = REG (va->cpu, va->reg++);
 
-    printf ("%s%02x ", (i & 0xf) == 8 ? " " : "", bytes[i]);
+    return 0;
+  }
 
-    if ((i & 0xf) == 0xf)
-    {
-      printf (" |");
+  if ((word = arm32_cpu_translate_read_size (va->cpu, va->stack, sizeof (uint32_t))) == NULL)
+    return -1;
 
-      printf (" ");
-      
-      for (j = i - 15; j <= i; ++j)
-        printf ("%c", isprint (bytes[j]) ? bytes[j] : '.');
+  *value = *word;
 
-      printf ("\n");
-    }
-  }
+  va->stack += sizeof (uint32_t);
 
-  if ((i & 0xf) != 0)
-  {
-    for (j = i; j < __ALIGN (size, 16); ++j)
-      printf ("   %s", (j & 0xf) == 8 ? " " : "");
-    
-    printf (" |");
-    
-    printf (" ");
-    
-    for (j = i & ~0xf; j < size; ++j)
-      printf ("%c", isprint (bytes[j]) ? bytes[j] : '.');
-    
-    printf ("\n");
-  }
-      
-  printf ("\n%08x  \n", i);
+  return 0;
 }
 
-ARMPROTO (free)
+static int
+arm32_stdlib_va_next64 (struct arm32_stdlib_va *va, uint64_t *value)
 {
-  uint32_t addr = R0 (cpu);
+  uint32_t lo, hi;
 
-  int i;
-  
-  for (i = 0; i < cpu->segment_count; ++i)
-    if (cpu->segment_list[i] != NULL)
-      if (cpu->segment_list[i]->virt == addr &&
-          cpu->segment_list[i]->dtor == __arm32_stdlib_malloc_segment_dtor)
-      {	
-        arm32_segment_destroy (cpu->segment_list[i]);
-        cpu->segment_list[i] = NULL;
+  if (va->reg < 4)
+    va->reg = __ALIGN (va->reg, 2);
 
-        arm32_cpu_return (cpu);
+  if (va->reg >= 4)
+    va->stack = __ALIGN (va->stack, 8);
 
-        return 0;
-      }
+  if (arm32_stdlib_va_next (va, &lo) == -1 || arm32_stdlib_va_next (va, &hi) == -1)
+    return -1;
 
-  error ("free: unmapped address 0x%x\n", addr);
+  *value = lo | ((uint64_t) hi << 32);
 
-  EXCEPT (ARM32_EXCEPTION_DATA);
+  return 0;
 }
 
-static uint32_t
-arm32_generic_stdlib_alloc (struct arm32_cpu *cpu, unsigned int count, unsigned int size)
+static int
+arm32_stdlib_arg (struct arm32_cpu *cpu, int index, uint32_t *value)
 {
-  void *mem;
-  uint32_t virt;
-  struct arm32_segment *seg;
+  struct arm32_stdlib_va va;
 
-  debug ("Generic stdlib heap alloc: %d elements of %d bytes\n", count, size);
-  
-  if ((virt = arm32_cpu_find_region (cpu, __ALIGN (count * size, 16), 16)) == -1)
-  {
-    debug ("  Address space is full!\n");
+  arm32_stdlib_va_init (&va, cpu, index);
 
-    goto fail;
-  }
+  return arm32_stdlib_va_next (&va, value);
+}
 
-  if ((mem = calloc (count, size)) == NULL)
+/* Length modifiers, as seen by the guest (long is 32 bit) */
+#define ARM32_STDLIB_LEN_HH 0
+#define ARM32_STDLIB_LEN_H  1
+#define ARM32_STDLIB_LEN_I  2
+#define ARM32_STDLIB_LEN_LL 3
+#define ARM32_STDLIB_LEN_L  4 /* As int, but for wide characters */
+
+/* %ls. Guest wchar_t is 32 bit, copied out to the host's. Each wide
+   character takes at least one byte, so with a precision no more than
+   that many need to be there. */
+static int
+arm32_stdlib_format_wide (struct arm32_cpu *cpu, struct arm32_stdlib_buf *buf, char *spec, size_t size, int32_t prec, uint32_t virt)
+{
+  const uint8_t *src;
+  uint32_t avail, max, count;
+  uint32_t wc;
+  wchar_t *wstr;
+  int ret;
+
+  if (virt == 0)
   {
-    debug ("  Too much!\n");
+    snprintf (spec + strlen (spec), size - strlen (spec), "s");
 
-    goto fail;
+    return arm32_stdlib_buf_printf (buf, spec, "(null)");
   }
 
-  if ((seg = arm32_segment_new (virt, mem, __ALIGN (count * size, 16), SA_R | SA_W)) == NULL)
+  if ((src = arm32_cpu_translate_read_avail (cpu, virt, &avail)) == NULL)
+    return -1;
+
+  max = avail / sizeof (uint32_t);
+
+  if (prec >= 0 && prec < max)
+    max = prec;
+
+  for (count = 0; count < max; ++count)
   {
-    debug ("  Cannot allocate segment!\n");
-    
-    free (mem);
+    memcpy (&wc, src + count * sizeof (uint32_t), sizeof (uint32_t));
 
-    goto fail;
+    if (wc == 0)
+      break;
   }
 
-  arm32_segment_set_dtor (seg, __arm32_stdlib_malloc_segment_dtor, NULL);
+  /* Not terminated inside the segment */
+  if (count == max && count != prec)
+    return -1;
+
+  if ((wstr = malloc ((count + 1) * sizeof (wchar_t))) == NULL)
+    return -1;
+
+  for (max = 0; max < count; ++max)
+  {
+    memcpy (&wc, src + max * sizeof (uint32_t), sizeof (uint32_t));
+    wstr[max] = wc;
+  }
+
+  wstr[count] = L'\0';
+
+  if (prec >= 0)
+    snprintf (spec + strlen (spec), size - strlen (spec), ".%d", prec);
+
+  snprintf (spec + strlen (spec), size - strlen (spec), "ls");
+
+  ret = arm32_stdlib_buf_printf (buf, spec, wstr);
+
+  free (wstr);
+
+  return ret;
+}
+
+/* Format a guest format string in a single pass. Literal text is copied
+   as is, and each conversion is rendered by the host from a spec built
+   on the stack. Returns -1 if the format string or any argument is not
+   accessible. */
+static int
+arm32_stdlib_format (struct arm32_cpu *cpu, struct arm32_stdlib_buf *buf, uint32_t fmt_virt, struct arm32_stdlib_va *va)
+{
+  const char *fmt, *end, *pct;
+  const char *str;
+  char spec[32], ptr[16];
+  uint32_t fmt_len, avail;
+  uint32_t value;
+  uint64_t value64;
+  int32_t width, prec;
+  size_t len, p;
+  int length;
+  double number;
+  void *dest;
+  char conv;
+
+  buf->len = 0;
+
+  if ((fmt = arm32_stdlib_translate_string (cpu, fmt_virt, &fmt_len)) == NULL)
+    return -1;
+
+  end = fmt + fmt_len;
+
+  while (fmt < end)
+  {
+    if ((pct = memchr (fmt, '%', end - fmt)) == NULL)
+      pct = end;
+
+    if (arm32_stdlib_buf_append (buf, fmt, pct - fmt) == -1)
+      return -1;
+
+    if ((fmt = pct) == end)
+      break;
+
+    ++fmt;
+
+    p = 0;
+    spec[p++] = '%';
+
+    /* Flags */
+    for (; fmt < end && strchr ("-+ #0'", *fmt) != NULL; ++fmt)
+      if (p < 8)
+        spec[p++] = *fmt;
+
+    /* Width */
+    width = -1;
+
+    if (fmt < end && *fmt == '*')
+    {
+      if (arm32_stdlib_va_next (va, &value) == -1)
+        return -1;
+
+      /* -INT_MIN does not fit */
+      if ((width = (int32_t) value) < 0)
+      {
+        spec[p++] = '-';
+        width = width < -ARM32_STDLIB_MAX_WIDTH ? ARM32_STDLIB_MAX_WIDTH : -width;
+      }
+
+      ++fmt;
+    }
+    else
+      for (; fmt < end && *fmt >= '0' && *fmt <= '9'; ++fmt)
+        if (width <= ARM32_STDLIB_MAX_WIDTH)
+          width = (width < 0 ? 0 : width * 10) + *fmt - '0';
+
+    if (width > ARM32_STDLIB_MAX_WIDTH)
+      width = ARM32_STDLIB_MAX_WIDTH;
+
+    if (width >= 0)
+      p += snprintf (spec + p, sizeof (spec) - p, "%d", width);
+
+    /* Precision */
+    prec = -1;
+
+    if (fmt < end && *fmt == '.')
+    {
+      prec = 0;
+
+      if (++fmt < end && *fmt == '*')
+      {
+        if (arm32_stdlib_va_next (va, &value) == -1)
+          return -1;
+
+        /* Negative is as if there was none */
+        prec = (int32_t) value < 0 ? -1 : value;
+
+        ++fmt;
+      }
+      else
+        for (; fmt < end && *fmt >= '0' && *fmt <= '9'; ++fmt)
+          if (prec <= ARM32_STDLIB_MAX_WIDTH)
+            prec = prec * 10 + *fmt - '0';
+
+      if (prec > ARM32_STDLIB_MAX_WIDTH)
+        prec = ARM32_STDLIB_MAX_WIDTH;
+    }
+
+    /* Length modifier */
+    length = ARM32_STDLIB_LEN_I;
+
+    for (; fmt < end && strchr ("hlLqjzt", *fmt) != NULL; ++fmt)
+      switch (*fmt)
+      {
+      case 'h':
+        length = length == ARM32_STDLIB_LEN_H ? ARM32_STDLIB_LEN_HH : ARM32_STDLIB_LEN_H;
+        break;
+
+      case 'l':
+        if (fmt + 1 < end && fmt[1] == 'l')
+        {
+          length = ARM32_STDLIB_LEN_LL;
+          ++fmt;
+        }
+        else
+          length = ARM32_STDLIB_LEN_L;
+        break;
+
+      case 'L':
+      case 'q':
+      case 'j':
+        length = ARM32_STDLIB_LEN_LL;
+        break;
+      }
+
+    if (fmt == end)
+      return arm32_stdlib_buf_append (buf, pct, end - pct) == -1 ? -1 : buf->len;
+
+    conv = *fmt++;
+
+    switch (conv)
+    {
+    case 'd':
+    case 'i':
+      if (length == ARM32_STDLIB_LEN_LL)
+      {
+        if (arm32_stdlib_va_next64 (va, &value64) == -1)
+          return -1;
+      }
+      else
+      {
+        if (arm32_stdlib_va_next (va, &value) == -1)
+          return -1;
+
+        if (length == ARM32_STDLIB_LEN_HH)
+          value64 = (int64_t) (int8_t) value;
+        else if (length == ARM32_STDLIB_LEN_H)
+          value64 = (int64_t) (int16_t) value;
+        else
+          value64 = (int64_t) (int32_t) value;
+      }
+
+      if (prec >= 0)
+        p += snprintf (spec + p, sizeof (spec) - p, ".%d", prec);
+
+      snprintf (spec + p, sizeof (spec) - p, "ll%c", conv);
+
+      if (arm32_stdlib_buf_printf (buf, spec, (long long) value64) == -1)
+        return -1;
+      break;
+
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      if (length == ARM32_STDLIB_LEN_LL)
+      {
+        if (arm32_stdlib_va_next64 (va, &value64) == -1)
+          return -1;
+      }
+      else
+      {
+        if (arm32_stdlib_va_next (va, &value) == -1)
+          return -1;
+
+        if (length == ARM32_STDLIB_LEN_HH)
+          value64 = (uint8_t) value;
+        else if (length == ARM32_STDLIB_LEN_H)
+          value64 = (uint16_t) value;
+        else
+          value64 = value;
+      }
+
+      if (prec >= 0)
+        p += snprintf (spec + p, sizeof (spec) - p, ".%d", prec);
+
+      snprintf (spec + p, sizeof (spec) - p, "ll%c", conv);
+
+      if (arm32_stdlib_buf_printf (buf, spec, (unsigned long long) value64) == -1)
+        return -1;
+      break;
+
+    case 'c':
+      if (arm32_stdlib_va_next (va, &value) == -1)
+        return -1;
+
+      if (length == ARM32_STDLIB_LEN_L)
+      {
+        snprintf (spec + p, sizeof (spec) - p, "lc");
+
+        if (arm32_stdlib_buf_printf (buf, spec, (wint_t) value) == -1)
+          return -1;
+        break;
+      }
+
+      snprintf (spec + p, sizeof (spec) - p, "c");
+
+      if (arm32_stdlib_buf_printf (buf, spec, (unsigned char) value) == -1)
+        return -1;
+      break;
+
+    case 's':
+      if (arm32_stdlib_va_next (va, &value) == -1)
+        return -1;
+
+      if (length == ARM32_STDLIB_LEN_L)
+      {
+        spec[p] = '\0';
+
+        if (arm32_stdlib_format_wide (cpu, buf, spec, sizeof (spec), prec, value) == -1)
+          return -1;
+        break;
+      }
+
+      if (value == 0)
+      {
+        str = "(null)";
+        len = 6;
+      }
+      else
+      {
+        if ((str = arm32_cpu_translate_read_avail (cpu, value, &avail)) == NULL)
+          return -1;
+
+        /* With a precision, the string needs not be terminated */
+        if ((len = strnlen (str, prec >= 0 && prec < avail ? prec : avail)) == avail)
+          if (prec < 0 || prec > avail)
+            return -1;
+      }
+
+      if (prec >= 0 && prec < len)
+        len = prec;
+
+      snprintf (spec + p, sizeof (spec) - p, ".*s");
+
+      if (arm32_stdlib_buf_printf (buf, spec, (int) len, str) == -1)
+        return -1;
+      break;
+
+    case 'p':
+      if (arm32_stdlib_va_next (va, &value) == -1)
+        return -1;
+
+      if (value == 0)
+        strcpy (ptr, "(nil)");
+      else
+        snprintf (ptr, sizeof (ptr), "0x%x", value);
+
+      snprintf (spec + p, sizeof (spec) - p, "s");
+
+      if (arm32_stdlib_buf_printf (buf, spec, ptr) == -1)
+        return -1;
+      break;
+
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      /* Base standard: doubles are passed in core registers */
+      if (arm32_stdlib_va_next64 (va, &value64) == -1)
+        return -1;
+
+      memcpy (&number, &value64, sizeof (double));
+
+      if (prec >= 0)
+        p += snprintf (spec + p, sizeof (spec) - p, ".%d", prec);
+
+      snprintf (spec + p, sizeof (spec) - p, "%c", conv);
+
+      if (arm32_stdlib_buf_printf (buf, spec, number) == -1)
+        return -1;
+      break;
+
+    case 'n':
+      if (arm32_stdlib_va_next (va, &value) == -1)
+        return -1;
+
+      len = length == ARM32_STDLIB_LEN_HH ? 1 : length == ARM32_STDLIB_LEN_H ? 2 : length == ARM32_STDLIB_LEN_LL ? 8 : 4;
+
+      if ((dest = arm32_cpu_translate_write_size (cpu, value, len)) == NULL)
+        return -1;
+
+      value64 = buf->len;
+
+      memcpy (dest, &value64, len);
+      break;
+
+    case 'm':
+      str = strerror (ERRNO (cpu));
+
+      if (arm32_stdlib_buf_append (buf, str, strlen (str)) == -1)
+        return -1;
+      break;
+
+    case '%':
+      if (arm32_stdlib_buf_append (buf, "%", 1) == -1)
+        return -1;
+      break;
+
+    default:
+      /* Unknown conversion, leave it as is */
+      if (arm32_stdlib_buf_append (buf, pct, fmt - pct) == -1)
+        return -1;
+    }
+  }
+
+  return buf->len;
+}
+
+/* Format with variadic arguments starting at the index-th argument */
+static struct arm32_stdlib_buf *
+arm32_stdlib_format_args (struct arm32_cpu *cpu, uint32_t fmt, int index)
+{
+  struct arm32_stdlib_va va;
+
+  arm32_stdlib_va_init (&va, cpu, index);
+
+  if (arm32_stdlib_format (cpu, &arm32_stdlib_printf_buf, fmt, &va) == -1)
+    return NULL;
+
+  return &arm32_stdlib_printf_buf;
+}
+
+/* Format with a guest va_list */
+static struct arm32_stdlib_buf *
+arm32_stdlib_format_va_list (struct arm32_cpu *cpu, uint32_t fmt, uint32_t ap)
+{
+  struct arm32_stdlib_va va;
+
+  arm32_stdlib_va_init_list (&va, cpu, ap);
+
+  if (arm32_stdlib_format (cpu, &arm32_stdlib_printf_buf, fmt, &va) == -1)
+    return NULL;
+
+  return &arm32_stdlib_printf_buf;
+}
+
+/* snprintf semantics: at most size - 1 bytes plus the terminator */
+static int
+arm32_stdlib_store (struct arm32_cpu *cpu, uint32_t virt, uint32_t size, const struct arm32_stdlib_buf *buf)
+{
+  char *dest;
+  size_t len;
+
+  if (size == 0)
+    return 0;
+
+  len = buf->len < size - 1 ? buf->len : size - 1;
+
+  if ((dest = arm32_cpu_translate_write_size (cpu, virt, len + 1)) == NULL)
+    return -1;
+
+  memcpy (dest, buf->data, len);
+
+  dest[len] = '\0';
+
+  return 0;
+}
+
+/* Host stream behind a guest FILE pointer. Unknown pointers give NULL
+   and EBADF in the guest errno. */
+static struct arm32_stdio_stream *
+arm32_stdlib_stream (struct arm32_cpu *cpu, uint32_t handle)
+{
+  struct arm32_stdio_stream *stream;
+
+  if ((stream = arm32_stdio_lookup (cpu, handle)) == NULL)
+    ERRNO (cpu) = EBADF;
+
+  return stream;
+}
+
+static struct arm32_stdio_stream *
+arm32_stdlib_stdout (struct arm32_cpu *cpu)
+{
+  return arm32_stdlib_stream (cpu, arm32_stdio_handle (cpu, ARM32_STDIO_STDOUT));
+}
+
+static struct arm32_stdio_stream *
+arm32_stdlib_stdin (struct arm32_cpu *cpu)
+{
+  return arm32_stdlib_stream (cpu, arm32_stdio_handle (cpu, ARM32_STDIO_STDIN));
+}
+
+ARMPROTO (error)
+{
+  struct arm32_stdio_stream *stream;
+  struct arm32_stdlib_buf *buf;
+
+  if ((buf = arm32_stdlib_format_args (cpu, R2 (cpu), 3)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  /* errnum is the second argument, 0 means no error string */
+  if (R1 (cpu) != 0 && arm32_stdlib_buf_printf (buf, ": %s", strerror (R1 (cpu))) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if (arm32_stdlib_buf_append (buf, "\n", 1) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  /* Whatever the program printed so far goes first */
+  if ((stream = arm32_stdlib_stdout (cpu)) != NULL)
+    arm32_stdio_flush (stream);
+
+  if ((stream = arm32_stdlib_stream (cpu, arm32_stdio_handle (cpu, ARM32_STDIO_STDERR))) != NULL)
+  {
+    arm32_stdio_write (stream, "error: ", 7);
+    arm32_stdio_write (stream, buf->data, buf->len);
+  }
+
+  if (R0 (cpu))
+  {
+    if (cpu->runtime.stdio != NULL)
+      arm32_stdio_flush_all (cpu->runtime.stdio);
+
+    exit (R0 (cpu));
+  }
   
-  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (posix_fadvise64)
+{
+  debug ("File access advice:\n");
+  debug ("  Fd: %d\n", R0 (cpu));
+  debug ("  Offset: 0x%x\n", R1 (cpu));
+  debug ("  Len: %d\n", R2 (cpu));
+  debug ("  Advice: %d\n", R3 (cpu));
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+void
+__arm32_stdlib_malloc_segment_dtor (void *data, void *phys, uint32_t size)
+{
+  free (phys);
+}
+
+void
+hexdump (const void *data, uint32_t size)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+
+  int i, j;
+  
+  for (i = 0; i < size; ++i)
   {
-    debug ("  Cannot add segment to CPU!\n");
-    
-    arm32_segment_destroy (seg);
+    if ((i & 0xf) == 0)
+      printf ("%08x  ", i);
 
-    goto fail;
+    printf ("%s%02x ", (i & 0xf) == 8 ? " " : "", bytes[i]);
+
+    if ((i & 0xf) == 0xf)
+    {
+      printf (" |");
+
+      printf (" ");
+      
+      for (j = i - 15; j <= i; ++j)
+        printf ("%c", isprint (bytes[j]) ? bytes[j] : '.');
+
+      printf ("\n");
+    }
   }
 
-  debug ("alloc: allocated block of %d bytes in virtual address 0x%x - 0x%x\n", count * size, virt, virt + count * size - 1);
+  if ((i & 0xf) != 0)
+  {
+    for (j = i; j < __ALIGN (size, 16); ++j)
+      printf ("   %s", (j & 0xf) == 8 ? " " : "");
+    
+    printf (" |");
+    
+    printf (" ");
+    
+    for (j = i & ~0xf; j < size; ++j)
+      printf ("%c", isprint (bytes[j]) ? bytes[j] : '.');
+    
+    printf ("\n");
+  }
+      
+  printf ("\n%08x  \n", i);
+}
+
+ARMPROTO (free)
+{
+  uint32_t addr = R0 (cpu);
+
+  int i;
   
-  return virt;
+  for (i = 0; i < cpu->segment_count; ++i)
+    if (cpu->segment_list[i] != NULL)
+      if (cpu->segment_list[i]->virt == addr &&
+          cpu->segment_list[i]->dtor == __arm32_stdlib_malloc_segment_dtor)
+      {	
+        arm32_segment_destroy (cpu->segment_list[i]);
+        cpu->segment_list[i] = NULL;
+
+        arm32_cpu_return (cpu);
+
+        return 0;
+      }
+
+  error ("free: unmapped address 0x%x\n", addr);
+
+  EXCEPT (ARM32_EXCEPTION_DATA);
+}
+
+static uint32_t
+arm32_generic_stdlib_alloc (struct arm32_cpu *cpu, unsigned int count, unsigned int size)
+{
+  void *mem;
+  uint32_t virt;
+  struct arm32_segment *seg;
+
+  debug ("Generic stdlib heap alloc: %d elements of %d bytes\n", count, size);
+  
+  if ((virt = arm32_cpu_find_region (cpu, __ALIGN (count * size, 16), 16)) == -1)
+  {
+    debug ("  Address space is full!\n");
+
+    goto fail;
+  }
+
+  if ((mem = calloc (count, size)) == NULL)
+  {
+    debug ("  Too much!\n");
+
+    goto fail;
+  }
+
+  if ((seg = arm32_segment_new (virt, mem, __ALIGN (count * size, 16), SA_R | SA_W)) == NULL)
+  {
+    debug ("  Cannot allocate segment!\n");
+    
+    free (mem);
+
+    goto fail;
+  }
+
+  arm32_segment_set_dtor (seg, __arm32_stdlib_malloc_segment_dtor, NULL);
+  
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    debug ("  Cannot add segment to CPU!\n");
+    
+    arm32_segment_destroy (seg);
+
+    goto fail;
+  }
+
+  debug ("alloc: allocated block of %d bytes in virtual address 0x%x - 0x%x\n", count * size, virt, virt + count * size - 1);
+  
+  return virt;
+
+fail:
+  return 0;
+}
+
+ARMPROTO (malloc)
+{
+  if ((R0 (cpu) = arm32_generic_stdlib_alloc (cpu, 1, R0 (cpu))) == 0)
+    goto fail;
+
+  arm32_cpu_return (cpu);
+  
+  return 0;
+  
+fail:
+  
+  ERRNO (cpu) = ENOMEM;
+  
+  arm32_cpu_return (cpu);
+  
+  return 0;
+}
+
+ARMPROTO (calloc)
+{
+  if ((R0 (cpu) = arm32_generic_stdlib_alloc (cpu, R0 (cpu), R1 (cpu))) == 0)
+    goto fail;
+
+  arm32_cpu_return (cpu);
+  
+  return 0;
+  
+fail:
+  
+  ERRNO (cpu) = ENOMEM;
+  
+  arm32_cpu_return (cpu);
+  
+  return 0;
+}
+
+/* Guest mappings are host mappings of the same size, so the kernel
+   does all the work. Guest and host PROT_ and MAP_ values match. */
+#define ARM32_STDLIB_PAGE_MASK (ARM32_ELF_PAGE_SIZE - 1)
+#define ARM32_STDLIB_MAP_FLAGS (MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_POPULATE)
+
+/* Room reserved for the program break */
+#define ARM32_STDLIB_BRK_MAX (64 * 1024 * 1024)
+
+static void
+__arm32_stdlib_mmap_segment_dtor (void *data, void *phys, uint32_t size)
+{
+  munmap (phys, size);
+}
+
+static void
+__arm32_stdlib_brk_segment_dtor (void *data, void *phys, uint32_t size)
+{
+  munmap (phys, ARM32_STDLIB_BRK_MAX);
+}
+
+/* Remove [addr, addr + len) from every mapping made by mmap. Others
+   (the image, the stack, malloc blocks) are left alone. */
+void
+arm32_stdlib_unmap (struct arm32_cpu *cpu, uint32_t addr, uint32_t len)
+{
+  struct arm32_segment *seg, *tail;
+  uint64_t lo, hi, seg_lo, seg_hi;
+  int count = cpu->segment_count;
+  int i;
+
+  lo = addr;
+  hi = lo + len;
+
+  for (i = 0; i < count; ++i)
+  {
+    if ((seg = cpu->segment_list[i]) == NULL || seg->dtor != __arm32_stdlib_mmap_segment_dtor)
+      continue;
+
+    seg_lo = seg->virt;
+    seg_hi = seg_lo + seg->size;
+
+    if (seg_hi <= lo || hi <= seg_lo)
+      continue;
+
+    /* Decode regions span whole segments, which are about to change */
+    if ((seg->flags & SA_X) && cpu->dcache != NULL)
+      arm32_decode_cache_drop (cpu->dcache, seg->virt, seg->size);
+
+    if (lo <= seg_lo && seg_hi <= hi)
+    {
+      arm32_segment_destroy (seg);
+      cpu->segment_list[i] = NULL;
+
+      continue;
+    }
+
+    /* A hole in the middle: the part after it gets its own segment */
+    if (seg_lo < lo && hi < seg_hi)
+    {
+      if ((tail = arm32_segment_new (hi, seg->phys + (hi - seg_lo), seg_hi - hi, seg->flags)) != NULL)
+      {
+        arm32_segment_set_dtor (tail, __arm32_stdlib_mmap_segment_dtor, NULL);
+
+        if (arm32_cpu_add_segment (cpu, tail) == -1)
+        {
+          tail->dtor = NULL;
+          arm32_segment_destroy (tail);
+          tail = NULL;
+        }
+      }
+
+      /* Unreachable without a segment, so it goes as well */
+      if (tail == NULL)
+        hi = seg_hi;
+    }
+
+    if (lo <= seg_lo)
+    {
+      munmap (seg->phys, hi - seg_lo);
+
+      seg->phys  = seg->phys + (hi - seg_lo);
+      seg->virt  = hi;
+      seg->size  = seg_hi - hi;
+    }
+    else
+    {
+      munmap (seg->phys + (lo - seg_lo), (hi < seg_hi ? hi : seg_hi) - lo);
+
+      seg->size = lo - seg_lo;
+    }
+
+    hi = lo + len;
+  }
+}
+
+/* The break is set up the first time it is asked for: right after the
+   image if there is room, anywhere else otherwise */
+struct arm32_elf *
+arm32_stdlib_brk_init (struct arm32_cpu *cpu)
+{
+  struct arm32_elf *elf = ARM32_ELF_OWNER ((struct arm32_elf *) cpu->data);
+  struct arm32_segment *seg;
+  uint32_t base = 0;
+  void *mem;
+  int i;
+
+  if (elf->brk_seg != NULL)
+    return elf;
+
+  for (i = 0; i < elf->ehdr->e_phnum; ++i)
+    if (elf->phdr[i].p_type == PT_LOAD)
+      if (elf->phdr[i].p_vaddr + elf->phdr[i].p_memsz + elf->bias > base)
+        base = elf->phdr[i].p_vaddr + elf->phdr[i].p_memsz + elf->bias;
+
+  base = __ALIGN (base, ARM32_ELF_PAGE_SIZE);
+
+  if (!arm32_cpu_region_is_free (cpu, base, ARM32_STDLIB_BRK_MAX))
+    if ((base = arm32_cpu_find_region (cpu, ARM32_STDLIB_BRK_MAX, ARM32_ELF_PAGE_SIZE)) == -1)
+      return NULL;
+
+  if ((mem = mmap (NULL, ARM32_STDLIB_BRK_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+    return NULL;
+
+  if ((seg = arm32_segment_new (base, mem, 0, SA_R | SA_W)) == NULL)
+  {
+    munmap (mem, ARM32_STDLIB_BRK_MAX);
+
+    return NULL;
+  }
+
+  arm32_segment_set_dtor (seg, __arm32_stdlib_brk_segment_dtor, NULL);
+
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    arm32_segment_destroy (seg);
+
+    return NULL;
+  }
+
+  elf->brk_base = base;
+  elf->brk      = base;
+  elf->brk_seg  = seg;
+
+  return elf;
+}
+
+/* Pick an address for a new mapping. The break segment is grown to its
+   full reservation meanwhile, so it is never placed in its way. */
+static uint32_t
+arm32_stdlib_map_region (struct arm32_cpu *cpu, uint32_t hint, uint32_t len)
+{
+  struct arm32_elf *elf = ARM32_ELF_OWNER ((struct arm32_elf *) cpu->data);
+  uint32_t brk_size = 0;
+  uint32_t virt;
+
+  if (elf->brk_seg != NULL)
+  {
+    brk_size = elf->brk_seg->size;
+    elf->brk_seg->size = ARM32_STDLIB_BRK_MAX;
+  }
+
+  if (hint != 0 && (hint & ARM32_STDLIB_PAGE_MASK) == 0 && arm32_cpu_region_is_free (cpu, hint, len))
+    virt = hint;
+  else
+    virt = arm32_cpu_find_region (cpu, len, ARM32_ELF_PAGE_SIZE);
+
+  if (elf->brk_seg != NULL)
+    elf->brk_seg->size = brk_size;
+
+  return virt;
+}
+
+/* Same for a given range, which must not run into the break either */
+static int
+arm32_stdlib_region_is_free (struct arm32_cpu *cpu, uint32_t virt, uint32_t len)
+{
+  struct arm32_elf *elf = ARM32_ELF_OWNER ((struct arm32_elf *) cpu->data);
+  uint32_t brk_size = 0;
+  int is_free;
+
+  if (elf->brk_seg != NULL)
+  {
+    brk_size = elf->brk_seg->size;
+    elf->brk_seg->size = ARM32_STDLIB_BRK_MAX;
+  }
+
+  is_free = arm32_cpu_region_is_free (cpu, virt, len);
+
+  if (elf->brk_seg != NULL)
+    elf->brk_seg->size = brk_size;
+
+  return is_free;
+}
+
+uint32_t
+arm32_stdlib_map (struct arm32_cpu *cpu, uint32_t addr, uint32_t len, int prot, int flags, int fd, off_t offset)
+{
+  struct arm32_segment *seg;
+  uint8_t seg_flags = 0;
+  uint32_t virt;
+  void *mem;
+
+  if (len == 0 || (offset & ARM32_STDLIB_PAGE_MASK) != 0 ||
+      ((flags & MAP_FIXED) && (addr & ARM32_STDLIB_PAGE_MASK) != 0))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (len > -ARM32_ELF_PAGE_SIZE)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  len = __ALIGN (len, ARM32_ELF_PAGE_SIZE);
+
+  if (!(flags & MAP_FIXED) && (addr = arm32_stdlib_map_region (cpu, addr, len)) == -1)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* The host mapping can be anywhere, and is only writable if the guest
+     may write to it */
+  if ((mem = mmap (
+         NULL,
+         len,
+         PROT_READ | (prot & PROT_WRITE),
+         flags & ARM32_STDLIB_MAP_FLAGS,
+         (flags & MAP_ANONYMOUS) ? -1 : fd,
+         offset)) == MAP_FAILED)
+    return -1;
+
+  /* Fixed mappings replace whatever mmap put there before */
+  if (flags & MAP_FIXED)
+  {
+    arm32_stdlib_unmap (cpu, addr, len);
+
+    if (!arm32_cpu_region_is_free (cpu, addr, len))
+    {
+      munmap (mem, len);
+
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  virt = addr;
+
+  if (prot & PROT_READ)
+    seg_flags |= SA_R;
+
+  if (prot & PROT_WRITE)
+    seg_flags |= SA_W;
+
+  if (prot & PROT_EXEC)
+    seg_flags |= SA_X;
+
+  if ((seg = arm32_segment_new (virt, mem, len, seg_flags)) == NULL)
+  {
+    munmap (mem, len);
+
+    errno = ENOMEM;
+    return -1;
+  }
+
+  arm32_segment_set_dtor (seg, __arm32_stdlib_mmap_segment_dtor, NULL);
+
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    arm32_segment_destroy (seg);
+
+    errno = ENOMEM;
+    return -1;
+  }
+
+  debug ("mmap: %u bytes at 0x%x (fd %d, offset 0x%llx)\n", len, virt, fd, (unsigned long long) offset);
+
+  return virt;
+}
+
+ARMPROTO (mmap)
+{
+  uint32_t fd, offset;
+
+  if (arm32_stdlib_arg (cpu, 4, &fd) == -1 || arm32_stdlib_arg (cpu, 5, &offset) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if ((R0 (cpu) = arm32_stdlib_map (cpu, R0 (cpu), R1 (cpu), R2 (cpu), R3 (cpu), fd, offset)) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (mmap64)
+{
+  struct arm32_stdlib_va va;
+  uint32_t fd;
+  uint64_t offset;
+
+  arm32_stdlib_va_init (&va, cpu, 4);
+
+  if (arm32_stdlib_va_next (&va, &fd) == -1 || arm32_stdlib_va_next64 (&va, &offset) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if ((R0 (cpu) = arm32_stdlib_map (cpu, R0 (cpu), R1 (cpu), R2 (cpu), R3 (cpu), fd, offset)) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (munmap)
+{
+  if ((R0 (cpu) & ARM32_STDLIB_PAGE_MASK) != 0 || R1 (cpu) == 0)
+  {
+    ERRNO (cpu) = EINVAL;
+    R0 (cpu) = -1;
+  }
+  else
+  {
+    arm32_stdlib_unmap (cpu, R0 (cpu), __ALIGN ((uint64_t) R1 (cpu), ARM32_ELF_PAGE_SIZE));
+    R0 (cpu) = 0;
+  }
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+/* Whole mappings only. The host side is moved by the kernel, the guest
+   side grows in place if there is room. */
+uint32_t
+arm32_stdlib_remap (struct arm32_cpu *cpu, uint32_t old, uint32_t old_size, uint32_t new_size, int flags)
+{
+  struct arm32_segment *seg = NULL;
+  uint32_t virt;
+  void *mem;
+  int i;
+
+  old_size = __ALIGN ((uint64_t) old_size, ARM32_ELF_PAGE_SIZE);
+
+  if ((flags & ~MREMAP_MAYMOVE) != 0 || new_size == 0 || new_size > -ARM32_ELF_PAGE_SIZE)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  new_size = __ALIGN (new_size, ARM32_ELF_PAGE_SIZE);
+
+  for (i = 0; i < cpu->segment_count; ++i)
+    if (cpu->segment_list[i] != NULL && cpu->segment_list[i]->virt == old)
+      if (cpu->segment_list[i]->dtor == __arm32_stdlib_mmap_segment_dtor)
+        seg = cpu->segment_list[i];
+
+  if (seg == NULL || seg->size != old_size)
+  {
+    errno = EFAULT;
+    return -1;
+  }
+
+  /* Code in it is decoded again wherever it ends up */
+  if ((seg->flags & SA_X) && cpu->dcache != NULL)
+    arm32_decode_cache_drop (cpu->dcache, seg->virt, seg->size);
+
+  if (new_size <= old_size)
+  {
+    if (new_size < old_size)
+      munmap (seg->phys + new_size, old_size - new_size);
+
+    seg->size = new_size;
+
+    return old;
+  }
+
+  if (arm32_stdlib_region_is_free (cpu, old + old_size, new_size - old_size))
+    virt = old;
+  else if (!(flags & MREMAP_MAYMOVE) || (virt = arm32_stdlib_map_region (cpu, 0, new_size)) == -1)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if ((mem = mremap (seg->phys, old_size, new_size, MREMAP_MAYMOVE)) == MAP_FAILED)
+    return -1;
+
+  seg->phys = mem;
+  seg->virt = virt;
+  seg->size = new_size;
+
+  return virt;
+}
+
+ARMPROTO (mremap)
+{
+  if ((R0 (cpu) = arm32_stdlib_remap (cpu, R0 (cpu), R1 (cpu), R2 (cpu), R3 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+/* Host memory behind mmap and the break, which the host kernel may
+   protect and advise as is */
+static int
+arm32_stdlib_is_host_mapping (const struct arm32_segment *seg)
+{
+  return seg->dtor == __arm32_stdlib_mmap_segment_dtor ||
+         seg->dtor == __arm32_stdlib_brk_segment_dtor;
+}
+
+/* Segments whose owner releases each piece on its own: mmap areas,
+   image segments and memory nobody releases. The break moves its one
+   segment and malloc frees its block as a whole, so those are not cut. */
+static int
+arm32_stdlib_can_split (const struct arm32_segment *seg)
+{
+  return seg->dtor == __arm32_stdlib_mmap_segment_dtor ||
+         seg->dtor == arm32_elf_segment_dtor ||
+         seg->dtor == NULL;
+}
+
+/* Cut a segment at virt. The part from virt on gets its own segment
+   over the same host memory and with the same owner, which is
+   returned. */
+static struct arm32_segment *
+arm32_stdlib_split (struct arm32_cpu *cpu, struct arm32_segment *seg, uint32_t virt)
+{
+  struct arm32_segment *tail;
+  uint32_t head_size = virt - seg->virt;
+
+  if ((tail = arm32_segment_new (virt, seg->phys + head_size, seg->size - head_size, seg->flags)) == NULL)
+    return NULL;
+
+  arm32_segment_set_dtor (tail, seg->dtor, seg->data);
+
+  if (arm32_cpu_add_segment (cpu, tail) == -1)
+  {
+    tail->dtor = NULL;
+    arm32_segment_destroy (tail);
+
+    return NULL;
+  }
+
+  seg->size = head_size;
+
+  return tail;
+}
+
+/* Change the permissions of [addr, addr + len). Segments are split as
+   needed. Those that cannot be split (the break, malloc blocks) keep
+   their permissions when only partly covered, as static glibc protects
+   RELRO inside its data segment and gives up on failure. */
+int
+arm32_stdlib_protect (struct arm32_cpu *cpu, uint32_t addr, uint32_t len, int prot)
+{
+  struct arm32_segment *seg;
+  uint64_t lo, hi, virt, next;
+  uint8_t seg_flags = 0;
+
+  if ((addr & ARM32_STDLIB_PAGE_MASK) != 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  lo = addr;
+  hi = __ALIGN (lo + len, ARM32_ELF_PAGE_SIZE);
+
+  /* All or nothing: check the whole range first. The rest of the page
+     a segment ends in counts as mapped. */
+  for (virt = lo; virt < hi; virt = next)
+  {
+    if ((seg = arm32_cpu_lookup_segment (cpu, virt)) != NULL)
+      next = (uint64_t) seg->virt + seg->size;
+    else if ((virt & ARM32_STDLIB_PAGE_MASK) != 0)
+      next = __ALIGN (virt, ARM32_ELF_PAGE_SIZE);
+    else
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  if (prot & PROT_READ)
+    seg_flags |= SA_R;
+
+  if (prot & PROT_WRITE)
+    seg_flags |= SA_W;
+
+  if (prot & PROT_EXEC)
+    seg_flags |= SA_X;
+
+  for (virt = lo; virt < hi; virt = next)
+  {
+    if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL)
+    {
+      next = __ALIGN (virt, ARM32_ELF_PAGE_SIZE);
+      continue;
+    }
+
+    next = (uint64_t) seg->virt + seg->size;
+
+    if (!arm32_stdlib_can_split (seg) && (seg->virt < lo || hi < next))
+      continue;
+
+    if ((seg->flags & SA_X) && cpu->dcache != NULL)
+      arm32_decode_cache_drop (cpu->dcache, seg->virt, seg->size);
+
+    if (seg->virt < virt && (seg = arm32_stdlib_split (cpu, seg, virt)) == NULL)
+      goto fail;
+
+    if (hi < next && arm32_stdlib_split (cpu, seg, hi) == NULL)
+      goto fail;
+
+    /* Same host protection as at mmap time */
+    if (arm32_stdlib_is_host_mapping (seg) &&
+        mprotect (seg->phys, seg->size, PROT_READ | (prot & PROT_WRITE)) == -1)
+      return -1;
+
+    seg->flags = seg_flags;
+  }
+
+  return 0;
+
+fail:
+  errno = ENOMEM;
+  return -1;
+}
+
+ARMPROTO (mprotect)
+{
+  if ((R0 (cpu) = arm32_stdlib_protect (cpu, R0 (cpu), R1 (cpu), R2 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+/* Advice goes to the host for host mappings. Elsewhere only hints are
+   taken, advice that would drop contents is refused. */
+int
+arm32_stdlib_advise (struct arm32_cpu *cpu, uint32_t addr, uint32_t len, int advice)
+{
+  struct arm32_segment *seg;
+  uint64_t lo, hi, virt, end;
+
+  if ((addr & ARM32_STDLIB_PAGE_MASK) != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  lo = addr;
+  hi = __ALIGN (lo + len, ARM32_ELF_PAGE_SIZE);
+
+  for (virt = lo; virt < hi; virt = end)
+  {
+    if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL)
+    {
+      /* The rest of the page a segment ends in */
+      if ((virt & ARM32_STDLIB_PAGE_MASK) != 0)
+      {
+        end = __ALIGN (virt, ARM32_ELF_PAGE_SIZE);
+        continue;
+      }
+
+      errno = ENOMEM;
+      return -1;
+    }
+
+    end = (uint64_t) seg->virt + seg->size;
+
+    if (end > hi)
+      end = hi;
+
+    if (arm32_stdlib_is_host_mapping (seg))
+    {
+      if (madvise (arm32_segment_translate (seg, virt), end - virt, advice) == -1)
+        return -1;
+    }
+    else if (advice != MADV_NORMAL && advice != MADV_RANDOM &&
+             advice != MADV_SEQUENTIAL && advice != MADV_WILLNEED)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+ARMPROTO (madvise)
+{
+  if ((R0 (cpu) = arm32_stdlib_advise (cpu, R0 (cpu), R1 (cpu), R2 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+/* Move the break to addr. Released pages are dropped, so they read as
+   zero if the break grows over them again. */
+int
+arm32_stdlib_set_brk (struct arm32_cpu *cpu, uint32_t addr)
+{
+  struct arm32_elf *elf;
+  uint32_t size;
+
+  if ((elf = arm32_stdlib_brk_init (cpu)) == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (addr < elf->brk_base || addr - elf->brk_base > ARM32_STDLIB_BRK_MAX)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  size = __ALIGN (addr - elf->brk_base, ARM32_ELF_PAGE_SIZE);
+
+  if (size > elf->brk_seg->size)
+  {
+    if (!arm32_cpu_region_is_free (cpu, elf->brk_base + elf->brk_seg->size, size - elf->brk_seg->size))
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  else if (size < elf->brk_seg->size)
+    madvise (elf->brk_seg->phys + size, elf->brk_seg->size - size, MADV_DONTNEED);
+
+  elf->brk_seg->size = size;
+  elf->brk           = addr;
+
+  return 0;
+}
+
+ARMPROTO (brk)
+{
+  if ((R0 (cpu) = arm32_stdlib_set_brk (cpu, R0 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (sbrk)
+{
+  struct arm32_elf *elf;
+  uint32_t old;
+
+  if ((elf = arm32_stdlib_brk_init (cpu)) == NULL)
+  {
+    ERRNO (cpu) = ENOMEM;
+    R0 (cpu) = -1;
+  }
+  else
+  {
+    old = elf->brk;
+
+    if (arm32_stdlib_set_brk (cpu, old + R0 (cpu)) == -1)
+    {
+      ERRNO (cpu) = ENOMEM;
+      R0 (cpu) = -1;
+    }
+    else
+      R0 (cpu) = old;
+  }
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (dcgettext)
+{
+  debug ("dcgettext 0x%x\n", R1 (cpu));
+  
+  arm32_cpu_return (cpu);
+
+  R0 (cpu) = R1 (cpu);
+  
+  return 0;
+}
+
+static int
+arm32_stdlib_print (struct arm32_cpu *cpu, struct arm32_stdio_stream *stream, const struct arm32_stdlib_buf *buf)
+{
+  if (buf == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if (stream == NULL)
+    R0 (cpu) = -1;
+  else if ((R0 (cpu) = arm32_stdlib_account (cpu, arm32_stdio_write (stream, buf->data, buf->len))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+/* size is the size of the destination buffer, including the terminator */
+static int
+arm32_stdlib_sprint (struct arm32_cpu *cpu, uint32_t dest, uint32_t size, const struct arm32_stdlib_buf *buf)
+{
+  if (buf == NULL || arm32_stdlib_store (cpu, dest, size, buf) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  R0 (cpu) = buf->len;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (printf)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stdout (cpu), arm32_stdlib_format_args (cpu, R0 (cpu), 1));
+}
+
+ARMPROTO (__printf_chk)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stdout (cpu), arm32_stdlib_format_args (cpu, R1 (cpu), 2));
+}
+
+ARMPROTO (vprintf)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stdout (cpu), arm32_stdlib_format_va_list (cpu, R0 (cpu), R1 (cpu)));
+}
+
+ARMPROTO (fprintf)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stream (cpu, R0 (cpu)), arm32_stdlib_format_args (cpu, R1 (cpu), 2));
+}
+
+ARMPROTO (__fprintf_chk)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stream (cpu, R0 (cpu)), arm32_stdlib_format_args (cpu, R2 (cpu), 3));
+}
+
+ARMPROTO (vfprintf)
+{
+  return arm32_stdlib_print (cpu, arm32_stdlib_stream (cpu, R0 (cpu)), arm32_stdlib_format_va_list (cpu, R1 (cpu), R2 (cpu)));
+}
+
+ARMPROTO (sprintf)
+{
+  struct arm32_stdlib_buf *buf;
+
+  if ((buf = arm32_stdlib_format_args (cpu, R1 (cpu), 2)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  return arm32_stdlib_sprint (cpu, R0 (cpu), buf->len + 1, buf);
+}
+
+ARMPROTO (__sprintf_chk)
+{
+  struct arm32_stdlib_buf *buf;
+
+  if ((buf = arm32_stdlib_format_args (cpu, R3 (cpu), 4)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  /* Would overflow the object the compiler saw */
+  if (buf->len + 1 > R2 (cpu))
+  {
+    error ("__sprintf_chk: buffer overflow detected\n");
+    EXCEPT (ARM32_EXCEPTION_DATA);
+  }
+
+  return arm32_stdlib_sprint (cpu, R0 (cpu), buf->len + 1, buf);
+}
+
+ARMPROTO (snprintf)
+{
+  return arm32_stdlib_sprint (cpu, R0 (cpu), R1 (cpu), arm32_stdlib_format_args (cpu, R2 (cpu), 3));
+}
+
+ARMPROTO (__snprintf_chk)
+{
+  uint32_t fmt;
+
+  if (R1 (cpu) > R3 (cpu) || arm32_stdlib_arg (cpu, 4, &fmt) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  return arm32_stdlib_sprint (cpu, R0 (cpu), R1 (cpu), arm32_stdlib_format_args (cpu, fmt, 5));
+}
+
+ARMPROTO (vsnprintf)
+{
+  return arm32_stdlib_sprint (cpu, R0 (cpu), R1 (cpu), arm32_stdlib_format_va_list (cpu, R2 (cpu), R3 (cpu)));
+}
+
+ARMPROTO (__vsnprintf_chk)
+{
+  uint32_t fmt, ap;
+
+  if (R1 (cpu) > R3 (cpu) || arm32_stdlib_arg (cpu, 4, &fmt) == -1 || arm32_stdlib_arg (cpu, 5, &ap) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  return arm32_stdlib_sprint (cpu, R0 (cpu), R1 (cpu), arm32_stdlib_format_va_list (cpu, fmt, ap));
+}
+
+ARMPROTO (fopen)
+{
+  const char *path, *mode;
+  uint32_t len;
+
+  if ((path = arm32_stdlib_translate_string (cpu, R0 (cpu), &len)) == NULL ||
+      (mode = arm32_stdlib_translate_string (cpu, R1 (cpu), &len)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  debug ("Open stream: \"%s\", mode \"%s\"\n", path, mode);
+
+  if ((R0 (cpu) = arm32_stdio_open (cpu, path, mode)) == 0)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fclose)
+{
+  if ((R0 (cpu) = arm32_stdio_close (cpu, R0 (cpu))) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fflush)
+{
+  struct arm32_stdio_stream *stream;
+  struct arm32_stdio *stdio;
+
+  /* fflush (NULL) flushes every output stream */
+  if (R0 (cpu) == 0)
+  {
+    if ((stdio = arm32_cpu_get_stdio (cpu)) != NULL && (R0 (cpu) = arm32_stdio_flush_all (stdio)) == -1)
+      ERRNO (cpu) = errno;
+  }
+  else if ((stream = arm32_stdlib_stream (cpu, R0 (cpu))) == NULL)
+    R0 (cpu) = -1;
+  else if ((R0 (cpu) = arm32_stdio_flush (stream)) == -1)
+    ERRNO (cpu) = errno;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fwrite)
+{
+  struct arm32_stdio_stream *stream;
+  const void *ptr;
+  uint64_t size;
+  ssize_t written;
+
+  size = (uint64_t) R1 (cpu) * R2 (cpu);
+
+  if (size > UINT32_MAX || (ptr = arm32_cpu_translate_read_size (cpu, R0 (cpu), size)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if (size == 0)
+    R0 (cpu) = 0;
+  else if ((stream = arm32_stdlib_stream (cpu, R3 (cpu))) == NULL)
+    R0 (cpu) = 0;
+  else if ((written = arm32_stdio_write (stream, ptr, size)) == -1)
+  {
+    ERRNO (cpu) = errno;
+    R0 (cpu) = 0;
+  }
+  else
+    R0 (cpu) = arm32_stdlib_account (cpu, written) / R1 (cpu);
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fread)
+{
+  struct arm32_stdio_stream *stream;
+  void *ptr;
+  uint64_t size;
+  ssize_t got;
+
+  size = (uint64_t) R1 (cpu) * R2 (cpu);
+
+  if (size > UINT32_MAX || (ptr = arm32_cpu_translate_write_size (cpu, R0 (cpu), size)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if (size == 0)
+    R0 (cpu) = 0;
+  else if ((stream = arm32_stdlib_stream (cpu, R3 (cpu))) == NULL)
+    R0 (cpu) = 0;
+  else if ((got = arm32_stdio_read (stream, ptr, size)) == -1)
+  {
+    ERRNO (cpu) = errno;
+    R0 (cpu) = 0;
+  }
+  else
+    R0 (cpu) = arm32_stdlib_account (cpu, got) / R1 (cpu);
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fgets)
+{
+  struct arm32_stdio_stream *stream;
+  char *ptr;
+  ssize_t got;
+
+  if ((int32_t) R1 (cpu) <= 0)
+  {
+    R0 (cpu) = 0;
+
+    arm32_cpu_return (cpu);
+
+    return 0;
+  }
+
+  if ((ptr = arm32_cpu_translate_write_size (cpu, R0 (cpu), R1 (cpu))) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if ((stream = arm32_stdlib_stream (cpu, R2 (cpu))) == NULL)
+    R0 (cpu) = 0;
+  else if ((got = arm32_stdio_gets (stream, ptr, R1 (cpu))) <= 0)
+  {
+    if (got == -1)
+      ERRNO (cpu) = errno;
+
+    R0 (cpu) = 0;
+  }
+  else
+    arm32_stdlib_account (cpu, got);
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+static int
+arm32_stdlib_write_string (struct arm32_cpu *cpu, uint32_t virt, struct arm32_stdio_stream *stream, int newline)
+{
+  const char *s;
+  uint32_t len;
+
+  if ((s = arm32_stdlib_translate_string (cpu, virt, &len)) == NULL)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  if (stream == NULL)
+    R0 (cpu) = -1;
+  else if (arm32_stdio_write (stream, s, len) == -1 ||
+           (newline && arm32_stdio_write (stream, "\n", 1) == -1))
+  {
+    ERRNO (cpu) = errno;
+    R0 (cpu) = -1;
+  }
+  else
+    R0 (cpu) = arm32_stdlib_account (cpu, len + newline);
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fputs)
+{
+  return arm32_stdlib_write_string (cpu, R0 (cpu), arm32_stdlib_stream (cpu, R1 (cpu)), 0);
+}
+
+ARMPROTO (puts)
+{
+  return arm32_stdlib_write_string (cpu, R0 (cpu), arm32_stdlib_stdout (cpu), 1);
+}
+
+static int
+arm32_stdlib_write_char (struct arm32_cpu *cpu, uint8_t c, struct arm32_stdio_stream *stream)
+{
+  if (stream == NULL)
+    R0 (cpu) = -1;
+  else if (arm32_stdio_write (stream, &c, 1) == -1)
+  {
+    ERRNO (cpu) = errno;
+    R0 (cpu) = -1;
+  }
+  else
+    R0 (cpu) = c;
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fputc)
+{
+  return arm32_stdlib_write_char (cpu, R0 (cpu), arm32_stdlib_stream (cpu, R1 (cpu)));
+}
+
+ARMPROTO (putchar)
+{
+  return arm32_stdlib_write_char (cpu, R0 (cpu), arm32_stdlib_stdout (cpu));
+}
+
+/* EOF (-1) both at end of file and on error, as told by feof / ferror */
+static int
+arm32_stdlib_read_char (struct arm32_cpu *cpu, struct arm32_stdio_stream *stream)
+{
+  uint8_t c;
+  ssize_t got;
+
+  if (stream == NULL)
+    R0 (cpu) = -1;
+  else if ((got = arm32_stdio_read (stream, &c, 1)) == 1)
+  {
+    arm32_stdlib_account (cpu, 1);
+    R0 (cpu) = c;
+  }
+  else
+  {
+    if (got == -1)
+      ERRNO (cpu) = errno;
+
+    R0 (cpu) = -1;
+  }
+
+  arm32_cpu_return (cpu);
+
+  return 0;
+}
+
+ARMPROTO (fgetc)
+{
+  return arm32_stdlib_read_char (cpu, arm32_stdlib_stream (cpu, R0 (cpu)));
+}
+
+ARMPROTO (getchar)
+{
+  return arm32_stdlib_read_char (cpu, arm32_stdlib_stdin (cpu));
+}
+
+ARMPROTO (feof)
+{
+  struct arm32_stdio_stream *stream;
+
+  R0 (cpu) = (stream = arm32_stdlib_stream (cpu, R0 (cpu))) != NULL && (stream->flags & ARM32_STDIO_EOF);
+
+  arm32_cpu_return (cpu);
 
-fail:
   return 0;
 }
 
-ARMPROTO (malloc)
+ARMPROTO (ferror)
 {
-  if ((R0 (cpu) = arm32_generic_stdlib_alloc (cpu, 1, R0 (cpu))) == 0)
-    goto fail;
+  struct arm32_stdio_stream *stream;
+
+  R0 (cpu) = (stream = arm32_stdlib_stream (cpu, R0 (cpu))) != NULL && (stream->flags & ARM32_STDIO_ERROR);
 
   arm32_cpu_return (cpu);
-  
-  return 0;
-  
-fail:
-  
-  *arm_errno = ENOMEM;
-  
-  arm32_cpu_return (cpu);
-  
+
   return 0;
 }
 
-ARMPROTO (calloc)
+ARMPROTO (clearerr)
 {
-  if ((R0 (cpu) = arm32_generic_stdlib_alloc (cpu, R0 (cpu), R1 (cpu))) == 0)
-    goto fail;
+  struct arm32_stdio_stream *stream;
+
+  if ((stream = arm32_stdlib_stream (cpu, R0 (cpu))) != NULL)
+    stream->flags &= ~(ARM32_STDIO_EOF | ARM32_STDIO_ERROR);
 
   arm32_cpu_return (cpu);
-  
-  return 0;
-  
-fail:
-  
-  *arm_errno = ENOMEM;
-  
-  arm32_cpu_return (cpu);
-  
+
   return 0;
 }
 
-ARMPROTO (dcgettext)
+ARMPROTO (fileno)
 {
-  debug ("dcgettext 0x%x\n", R1 (cpu));
-  
+  struct arm32_stdio_stream *stream;
+
+  R0 (cpu) = (stream = arm32_stdlib_stream (cpu, R0 (cpu))) != NULL ? stream->fd : -1;
+
   arm32_cpu_return (cpu);
 
-  R0 (cpu) = R1 (cpu);
-  
   return 0;
 }
 
-ARMPROTO (__fprintf_chk)
+/* Host iovecs over guest memory. Each guest iovec may need several,
+   one per segment it spans, but the host takes no more than IOV_MAX. */
+#ifdef IOV_MAX
+#  define ARM32_STDLIB_IOV_MAX IOV_MAX
+#else
+#  define ARM32_STDLIB_IOV_MAX 1024
+#endif
+
+/* Bounce buffer of the sendfile fallback */
+#define ARM32_STDLIB_COPY_SIZE 65536
+
+/* Allocated once per CPU, the first time it moves data */
+static struct iovec *
+arm32_stdlib_iov_list (struct arm32_cpu *cpu)
 {
-  char *fmt;
-  int n;
-  const char *ptr;
-  
-  if ((fmt = arm32_cpu_translate_read (cpu, R2 (cpu))) == NULL)
+  if (cpu->runtime.iov_list == NULL)
+    if ((cpu->runtime.iov_list = malloc (ARM32_STDLIB_IOV_MAX * sizeof (struct iovec))) == NULL)
+      errno = ENOMEM;
+
+  return cpu->runtime.iov_list;
+}
+
+/* Hosts without preadv, pwritev or sendfile get the same through plain
+   read/write loops. Like the real ones, they return what was moved
+   before an error, and -1 only if nothing was. */
+ssize_t
+arm32_stdlib_host_preadv (int fd, const struct iovec *iov, int count, off_t offset)
+{
+#ifdef HAVE_PREADV
+  return preadv (fd, iov, count, offset);
+#else
+  ssize_t total = 0;
+  ssize_t got;
+  int i;
+
+  for (i = 0; i < count; ++i)
   {
-    error ("Cannot translate 0x%x\n", R2 (cpu));
-    EXCEPT (ARM32_EXCEPTION_DATA);
+    if ((got = pread (fd, iov[i].iov_base, iov[i].iov_len, offset + total)) == -1)
+      return total > 0 ? total : -1;
+
+    total += got;
+
+    if (got < iov[i].iov_len)
+      break;
   }
-  
-  ptr = fmt;
 
-  n = 3;
+  return total;
+#endif
+}
+
+ssize_t
+arm32_stdlib_host_pwritev (int fd, const struct iovec *iov, int count, off_t offset)
+{
+#ifdef HAVE_PWRITEV
+  return pwritev (fd, iov, count, offset);
+#else
+  ssize_t total = 0;
+  ssize_t done;
+  int i;
 
-  do
+  for (i = 0; i < count; ++i)
   {
-    ptr = arm32_cpu_fprintf_pieces (cpu, stdout, n++, ptr);
+    if ((done = pwrite (fd, iov[i].iov_base, iov[i].iov_len, offset + total)) == -1)
+      return total > 0 ? total : -1;
+
+    total += done;
+
+    if (done < iov[i].iov_len)
+      break;
   }
-  while (*ptr);
 
-  arm32_cpu_return (cpu);
-  
-  return 0;  
+  return total;
+#endif
 }
 
-ARMPROTO (__printf_chk)
+ssize_t
+arm32_stdlib_host_sendfile (int out_fd, int in_fd, off_t *offset, size_t count)
 {
-  char *fmt;
-  int n;
-  const char *ptr;
-  
-  if ((fmt = arm32_cpu_translate_read (cpu, R1 (cpu))) == NULL)
+#ifdef HAVE_SYS_SENDFILE_H
+  return sendfile (out_fd, in_fd, offset, count);
+#else
+  char *buffer;
+  ssize_t total = 0;
+  ssize_t got, done, put;
+
+  if ((buffer = malloc (ARM32_STDLIB_COPY_SIZE)) == NULL)
+    return -1;
+
+  while (count > 0)
   {
-    error ("Cannot translate 0x%x\n", R1 (cpu));
-    EXCEPT (ARM32_EXCEPTION_DATA);
+    if (offset != NULL)
+      got = pread (in_fd, buffer, count < ARM32_STDLIB_COPY_SIZE ? count : ARM32_STDLIB_COPY_SIZE, *offset);
+    else
+      got = read (in_fd, buffer, count < ARM32_STDLIB_COPY_SIZE ? count : ARM32_STDLIB_COPY_SIZE);
+
+    if (got <= 0)
+      break;
+
+    for (done = 0; done < got; done += put)
+      if ((put = write (out_fd, buffer + done, got - done)) == -1)
+        break;
+
+    /* Only what reached out_fd counts as read */
+    if (offset != NULL)
+      *offset += done;
+    else if (done < got)
+      lseek (in_fd, done - got, SEEK_CUR);
+
+    total += done;
+    count -= done;
+
+    if (done < got)
+    {
+      got = -1;
+      break;
+    }
   }
-  
-  ptr = fmt;
 
-  n = 2;
+  free (buffer);
 
-  do
+  return got == -1 && total == 0 ? -1 : total;
+#endif
+}
+
+/* Split [virt, virt + size) at segment boundaries, storing at most max
+   host iovecs. Whatever does not fit is left out, which only makes the
+   transfer shorter. Returns the number of iovecs, or -1 if the range is
+   not accessible. */
+static int
+arm32_stdlib_iovec (struct arm32_cpu *cpu, uint32_t virt, uint32_t size, uint8_t access, struct iovec *iov, int max)
+{
+  struct arm32_segment *seg;
+  uint32_t avail;
+  int count = 0;
+
+  while (size > 0 && count < max)
   {
-    ptr = arm32_cpu_fprintf_pieces (cpu, stdout, n++, ptr);
+    if ((seg = arm32_cpu_lookup_segment (cpu, virt)) == NULL ||
+        arm32_segment_check_access (seg, access) == -1)
+      return -1;
+
+    if ((avail = seg->size - (virt - seg->virt)) > size)
+      avail = size;
+
+    iov[count].iov_base = arm32_segment_translate (seg, virt);
+    iov[count].iov_len  = avail;
+
+    ++count;
+
+    virt += avail;
+    size -= avail;
   }
-  while (*ptr);
 
-  arm32_cpu_return (cpu);
-  
-  return 0;  
+  return count;
 }
 
-ARMPROTO (fputs_unlocked)
+/* Same, for an array of count guest iovecs at virt */
+static int
+arm32_stdlib_iovec_list (struct arm32_cpu *cpu, uint32_t virt, uint32_t count, uint8_t access, struct iovec *iov, int max)
 {
-  char *s;
+  const uint32_t *guest_iov;
+  int total = 0;
+  int n;
+  int i;
 
-  if ((s = arm32_cpu_translate_read (cpu, R0 (cpu))) == NULL)
-    EXCEPT (ARM32_EXCEPTION_DATA);
-  
-  fputs (s, stdout);
+  if (count > ARM32_STDLIB_IOV_MAX)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ((guest_iov = arm32_cpu_translate_read_size (cpu, virt, count * 2 * sizeof (uint32_t))) == NULL)
+  {
+    errno = EFAULT;
+    return -1;
+  }
+
+  for (i = 0; i < count && total < max; ++i)
+  {
+    if ((n = arm32_stdlib_iovec (cpu, guest_iov[2 * i], guest_iov[2 * i + 1], access, iov + total, max - total)) == -1)
+    {
+      errno = EFAULT;
+      return -1;
+    }
+
+    total += n;
+  }
+
+  return total;
+}
+
+/* Set the guest return value of a host call, errno included */
+static int
+arm32_stdlib_return_ssize (struct arm32_cpu *cpu, ssize_t result)
+{
+  if ((R0 (cpu) = result) == -1)
+    ERRNO (cpu) = errno;
 
   arm32_cpu_return (cpu);
 
   return 0;
 }
 
-ARMPROTO (read)
+/* Transfers between a file and guest memory. They return what the host
+   calls do, errno included, and are shared with the syscall layer. */
+ssize_t
+arm32_stdlib_read_guest (struct arm32_cpu *cpu, int fd, uint32_t virt, uint32_t size, int positional, off_t offset)
 {
-  /* Read is tricky as we need to check if we actually have space for this */
+  struct arm32_aio_file *file;
+  struct iovec *iov;
+  int count;
 
-  int fd;
-  void *buf;
-  uint32_t size;
+  if ((iov = arm32_stdlib_iov_list (cpu)) == NULL)
+    return -1;
 
-  fd = R0 (cpu);
-  size = R2 (cpu);
-  
-  if ((buf = arm32_cpu_translate_write_size (cpu, R1 (cpu), size)) == NULL)
+  if ((count = arm32_stdlib_iovec (cpu, virt, size, SA_W, iov, ARM32_STDLIB_IOV_MAX)) == -1)
   {
-    R0 (cpu) = -1;
+    errno = EFAULT;
+    return -1;
+  }
+
+  if (positional)
+    return arm32_stdlib_account (cpu, arm32_stdlib_host_preadv (fd, iov, count, offset));
+
+  if ((file = arm32_aio_lookup (cpu, fd)) != NULL)
+    return arm32_stdlib_account (cpu, arm32_aio_readv (cpu, file, iov, count));
+
+  return arm32_stdlib_account (cpu, readv (fd, iov, count));
+}
+
+ssize_t
+arm32_stdlib_write_guest (struct arm32_cpu *cpu, int fd, uint32_t virt, uint32_t size, int positional, off_t offset)
+{
+  struct iovec *iov;
+  int count;
+
+  if ((iov = arm32_stdlib_iov_list (cpu)) == NULL)
+    return -1;
 
-    *arm_errno = EFAULT;
+  if ((count = arm32_stdlib_iovec (cpu, virt, size, SA_R, iov, ARM32_STDLIB_IOV_MAX)) == -1)
+  {
+    errno = EFAULT;
+    return -1;
   }
-  else
-    if ((R0 (cpu) = read (fd, buf, size)) == -1)
-      *arm_errno = EFAULT;
 
-  
-  arm32_cpu_return (cpu);
-  
+  if (!positional)
+    arm32_aio_untrack (cpu, fd);
+
+  return arm32_stdlib_account (cpu, positional ? arm32_stdlib_host_pwritev (fd, iov, count, offset) : writev (fd, iov, count));
+}
+
+/* Same, through an array of count guest iovecs */
+ssize_t
+arm32_stdlib_readv_guest (struct arm32_cpu *cpu, int fd, uint32_t virt, uint32_t count)
+{
+  struct iovec *iov;
+  int n;
+
+  arm32_aio_untrack (cpu, fd);
+
+  if ((iov = arm32_stdlib_iov_list (cpu)) == NULL)
+    return -1;
+
+  if ((n = arm32_stdlib_iovec_list (cpu, virt, count, SA_W, iov, ARM32_STDLIB_IOV_MAX)) == -1)
+    return -1;
+
+  return arm32_stdlib_account (cpu, readv (fd, iov, n));
+}
+
+ssize_t
+arm32_stdlib_writev_guest (struct arm32_cpu *cpu, int fd, uint32_t virt, uint32_t count)
+{
+  struct iovec *iov;
+  int n;
+
+  arm32_aio_untrack (cpu, fd);
+
+  if ((iov = arm32_stdlib_iov_list (cpu)) == NULL)
+    return -1;
+
+  if ((n = arm32_stdlib_iovec_list (cpu, virt, count, SA_R, iov, ARM32_STDLIB_IOV_MAX)) == -1)
+    return -1;
+
+  return arm32_stdlib_account (cpu, writev (fd, iov, n));
+}
+
+/* 64 bit file offset, passed after three 32 bit arguments */
+static int
+arm32_stdlib_offset64 (struct arm32_cpu *cpu, off_t *offset)
+{
+  struct arm32_stdlib_va va;
+  uint64_t value;
+
+  arm32_stdlib_va_init (&va, cpu, 3);
+
+  if (arm32_stdlib_va_next64 (&va, &value) == -1)
+    return -1;
+
+  *offset = (int64_t) value;
+
   return 0;
 }
 
+ARMPROTO (read)
+{
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_read_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 0, 0));
+}
+
 ARMPROTO (write)
 {
-  int fd;
-  const void *buf;
-  uint32_t size;
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_write_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 0, 0));
+}
+
+ARMPROTO (pread)
+{
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_read_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 1, (int32_t) R3 (cpu)));
+}
+
+ARMPROTO (pwrite)
+{
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_write_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 1, (int32_t) R3 (cpu)));
+}
+
+ARMPROTO (pread64)
+{
+  off_t offset;
+
+  if (arm32_stdlib_offset64 (cpu, &offset) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_read_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 1, offset));
+}
+
+ARMPROTO (pwrite64)
+{
+  off_t offset;
+
+  if (arm32_stdlib_offset64 (cpu, &offset) == -1)
+    EXCEPT (ARM32_EXCEPTION_DATA);
+
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_write_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu), 1, offset));
+}
+
+ARMPROTO (readv)
+{
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_readv_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu)));
+}
+
+ARMPROTO (writev)
+{
+  return arm32_stdlib_return_ssize (cpu, arm32_stdlib_writev_guest (cpu, R0 (cpu), R1 (cpu), R2 (cpu)));
+}
 
-  fd = R0 (cpu);
-  size = R2 (cpu);
+/* Data never goes through guest memory, only the offset does */
+static int
+arm32_stdlib_send_file (struct arm32_cpu *cpu, int wide)
+{
+  void *guest_offset = NULL;
+  off_t offset;
+  ssize_t result;
 
-  if ((buf = arm32_cpu_translate_read_size (cpu, R1 (cpu), size)) == NULL)
+  if (R2 (cpu) != 0)
   {
-    R0 (cpu) = -1;
+    if ((guest_offset = arm32_cpu_translate_write_size (cpu, R2 (cpu), wide ? sizeof (int64_t) : sizeof (int32_t))) == NULL)
+    {
+      errno = EFAULT;
+      return arm32_stdlib_return_ssize (cpu, -1);
+    }
 
-    *arm_errno = EFAULT;
+    if (wide)
+      memcpy (&offset, guest_offset, sizeof (int64_t));
+    else
+      offset = *(int32_t *) guest_offset;
   }
-  else
-    if ((R0 (cpu) = write (fd, buf, size)) == -1)
-      *arm_errno = EFAULT;
 
-  arm32_cpu_return (cpu);
-  
+  arm32_aio_untrack (cpu, R0 (cpu));
+
+  if (guest_offset == NULL)
+    arm32_aio_untrack (cpu, R1 (cpu));
+
+  result = arm32_stdlib_account (cpu, arm32_stdlib_host_sendfile (R0 (cpu), R1 (cpu), guest_offset != NULL ? &offset : NULL, R3 (cpu)));
+
+  if (guest_offset != NULL)
+  {
+    if (wide)
+      memcpy (guest_offset, &offset, sizeof (int64_t));
+    else
+      *(int32_t *) guest_offset = offset;
+  }
+
+  return arm32_stdlib_return_ssize (cpu, result);
+}
+
+ARMPROTO (sendfile)
+{
+  return arm32_stdlib_send_file (cpu, 0);
+}
+
+ARMPROTO (sendfile64)
+{
+  return arm32_stdlib_send_file (cpu, 1);
+}
+
+/* Read ahead blocks are kept, they are looked up by offset */
+off_t
+arm32_stdlib_seek (struct arm32_cpu *cpu, int fd, off_t offset, int whence)
+{
+  struct arm32_aio_file *file;
+  off_t result;
+
+  if ((file = arm32_aio_lookup (cpu, fd)) != NULL)
+    lseek (fd, file->pos, SEEK_SET);
+
+  if ((result = lseek (fd, offset, whence)) != -1 && file != NULL)
+    file->pos = result;
+
+  return result;
+}
+
+ARMPROTO (lseek)
+{
+  off_t result;
+
+  if ((result = arm32_stdlib_seek (cpu, R0 (cpu), (int32_t) R1 (cpu), R2 (cpu))) > INT32_MAX)
+  {
+    errno  = EOVERFLOW;
+    result = -1;
+  }
+
+  return arm32_stdlib_return_ssize (cpu, result);
+}
+
+/* The offset goes in r2:r3, whence on the stack */
+ARMTYPED (lseek64, "l!:i,l,i")
+{
+  *result = arm32_stdlib_seek (cpu, arg[0].value, (int64_t) arg[1].value, arg[2].value);
+
   return 0;
 }
 
-ARMPROTO (close)
+ARMTYPED (close, "i!:i")
 {
-  R0 (cpu) = close (R0 (cpu));
+  arm32_aio_untrack (cpu, arg[0].value);
 
-  arm32_cpu_return (cpu);
+  *result = close (arg[0].value);
 
   return 0;
 }
 
 ARMPROTO (exit)
 {
+  if (cpu->runtime.stdio != NULL)
+    arm32_stdio_flush_all (cpu->runtime.stdio);
+
+  if (getenv (ARM32_ELF_PROFILE_ENV) != NULL)
+    arm32_cpu_dump_profile (cpu, stderr);
+
   exit (R0 (cpu));
 
   return 0;
 }
 
+#define ARMHOOK(name, sname)       { name, ARMSYM (sname), NULL }
+#define ARMTYPED_HOOK(name, sname) { name, arm32_hook_typed_call, &ARMSIG (sname) }
+
+/* Native replacements, bound to matching imports at load time */
+static const struct arm32_stdlib_hook arm32_stdlib_hook_list[] =
+{
+  ARMTYPED_HOOK ("memset", memset),
+  ARMTYPED_HOOK ("memcpy", memcpy),
+  ARMTYPED_HOOK ("memmove", memmove),
+  ARMHOOK ("exit", exit),
+  ARMHOOK ("write", write),
+  ARMHOOK ("read", read),
+  ARMHOOK ("pread", pread),
+  ARMHOOK ("pread64", pread64),
+  ARMHOOK ("pwrite", pwrite),
+  ARMHOOK ("pwrite64", pwrite64),
+  ARMHOOK ("readv", readv),
+  ARMHOOK ("writev", writev),
+  ARMHOOK ("sendfile", sendfile),
+  ARMHOOK ("sendfile64", sendfile64),
+  ARMTYPED_HOOK ("close", close),
+  ARMHOOK ("lseek", lseek),
+  ARMTYPED_HOOK ("lseek64", lseek64),
+  ARMHOOK ("fopen", fopen),
+  ARMHOOK ("fopen64", fopen),
+  ARMHOOK ("fclose", fclose),
+  ARMHOOK ("fflush", fflush),
+  ARMHOOK ("fflush_unlocked", fflush),
+  ARMHOOK ("fread", fread),
+  ARMHOOK ("fread_unlocked", fread),
+  ARMHOOK ("fwrite_unlocked", fwrite),
+  ARMHOOK ("fgets", fgets),
+  ARMHOOK ("fgets_unlocked", fgets),
+  ARMHOOK ("fputs", fputs),
+  ARMHOOK ("fputs_unlocked", fputs),
+  ARMHOOK ("puts", puts),
+  ARMHOOK ("fputc", fputc),
+  ARMHOOK ("fputc_unlocked", fputc),
+  ARMHOOK ("putc", fputc),
+  ARMHOOK ("putc_unlocked", fputc),
+  ARMHOOK ("putchar", putchar),
+  ARMHOOK ("putchar_unlocked", putchar),
+  ARMHOOK ("fgetc", fgetc),
+  ARMHOOK ("fgetc_unlocked", fgetc),
+  ARMHOOK ("getc", fgetc),
+  ARMHOOK ("getc_unlocked", fgetc),
+  ARMHOOK ("_IO_getc", fgetc),
+  ARMHOOK ("getchar", getchar),
+  ARMHOOK ("getchar_unlocked", getchar),
+  ARMHOOK ("feof", feof),
+  ARMHOOK ("feof_unlocked", feof),
+  ARMHOOK ("ferror", ferror),
+  ARMHOOK ("ferror_unlocked", ferror),
+  ARMHOOK ("clearerr", clearerr),
+  ARMHOOK ("clearerr_unlocked", clearerr),
+  ARMHOOK ("fileno", fileno),
+  ARMHOOK ("fileno_unlocked", fileno),
+  ARMHOOK ("printf", printf),
+  ARMHOOK ("__printf_chk", __printf_chk),
+  ARMHOOK ("vprintf", vprintf),
+  ARMHOOK ("fprintf", fprintf),
+  ARMHOOK ("__fprintf_chk", __fprintf_chk),
+  ARMHOOK ("vfprintf", vfprintf),
+  ARMHOOK ("sprintf", sprintf),
+  ARMHOOK ("__sprintf_chk", __sprintf_chk),
+  ARMHOOK ("snprintf", snprintf),
+  ARMHOOK ("__snprintf_chk", __snprintf_chk),
+  ARMHOOK ("vsnprintf", vsnprintf),
+  ARMHOOK ("__vsnprintf_chk", __vsnprintf_chk),
+  ARMHOOK ("dcgettext", dcgettext),
+  ARMHOOK ("malloc", malloc),
+  ARMHOOK ("calloc", calloc),
+  ARMHOOK ("free", free),
+  ARMHOOK ("mmap", mmap),
+  ARMHOOK ("mmap64", mmap64),
+  ARMHOOK ("munmap", munmap),
+  ARMHOOK ("mremap", mremap),
+  ARMHOOK ("mprotect", mprotect),
+  ARMHOOK ("madvise", madvise),
+  ARMHOOK ("brk", brk),
+  ARMHOOK ("sbrk", sbrk),
+
+  ARMHOOK ("posix_fadvise64", posix_fadvise64),
+  ARMHOOK ("error", error),
+  ARMHOOK ("__errno_location", __errno_location),
+  ARMHOOK ("open64", open64),
+  ARMHOOK ("strncmp", strncmp),
+
+  ARMHOOK ("__fxstat64", __fxstat64),
+  ARMHOOK ("getopt_long", getopt_long),
+  ARMHOOK ("__cxa_atexit", cxa_atexit),
+  ARMHOOK ("textdomain", textdomain),
+  ARMHOOK ("__libc_start_main", libc_start_main),
+  ARMTYPED_HOOK ("getpagesize", getpagesize),
+  ARMTYPED_HOOK ("strrchr", strrchr),
+  ARMTYPED_HOOK ("strlen", strlen),
+  ARMHOOK ("strcmp", strcmp),
+  ARMTYPED_HOOK ("strchr", strchr),
+  ARMHOOK ("strcpy", strcpy),
+  ARMTYPED_HOOK ("memchr", memchr),
+  ARMTYPED_HOOK ("memcmp", memcmp),
+  ARMHOOK ("fwrite", fwrite),
+  ARMHOOK ("setlocale", setlocale),
+  ARMHOOK ("bindtextdomain", bindtextdomain),
+  
+  { NULL, NULL, NULL }
+};
+
+static pthread_once_t arm32_stdlib_hook_once = PTHREAD_ONCE_INIT;
+static int           *arm32_stdlib_hook_index; /* Entries are index + 1 */
+static uint32_t       arm32_stdlib_hook_mask;
+
+static void
+arm32_stdlib_hook_index_init (void)
+{
+  uint32_t size = 16;
+  uint32_t slot;
+  int *index;
+  int i;
+
+  for (i = 0; arm32_stdlib_hook_list[i].name != NULL; ++i)
+    if (arm32_stdlib_hook_list[i].callback == arm32_hook_typed_call)
+      arm32_hook_sig_parse (arm32_stdlib_hook_list[i].data);
+
+  while (size < 2 * i)
+    size <<= 1;
+
+  if ((index = calloc (size, sizeof (int))) == NULL)
+    return;
+
+  for (i = 0; arm32_stdlib_hook_list[i].name != NULL; ++i)
+  {
+    for (slot = arm32_elf_gnu_hash (arm32_stdlib_hook_list[i].name) & (size - 1);
+         index[slot] != 0;
+         slot = (slot + 1) & (size - 1));
+
+    index[slot] = i + 1;
+  }
+
+  arm32_stdlib_hook_mask  = size - 1;
+  arm32_stdlib_hook_index = index;
+}
+
+const struct arm32_stdlib_hook *
+arm32_stdlib_hook_lookup (const char *name)
+{
+  uint32_t slot;
+  int i;
+
+  pthread_once (&arm32_stdlib_hook_once, arm32_stdlib_hook_index_init);
+
+  if (arm32_stdlib_hook_index == NULL)
+  {
+    for (i = 0; arm32_stdlib_hook_list[i].name != NULL; ++i)
+      if (strcmp (arm32_stdlib_hook_list[i].name, name) == 0)
+        return &arm32_stdlib_hook_list[i];
+
+    return NULL;
+  }
+
+  for (slot = arm32_elf_gnu_hash (name) & arm32_stdlib_hook_mask;
+       (i = arm32_stdlib_hook_index[slot]) != 0;
+       slot = (slot + 1) & arm32_stdlib_hook_mask)
+    if (strcmp (arm32_stdlib_hook_list[i - 1].name, name) == 0)
+      return &arm32_stdlib_hook_list[i - 1];
+
+  return NULL;
+}
+
+/* Data objects provided by the emulator itself. Returns their guest
+   address, or 0 if name is not one of them. */
+uint32_t
+arm32_stdlib_data_import (struct arm32_cpu *cpu, const char *name)
+{
+  static const char *stream_names[] = {"stdin", "stdout", "stderr"};
+  int i;
+
+  for (i = 0; i < sizeof (stream_names) / sizeof (stream_names[0]); ++i)
+    if (strcmp (name, stream_names[i]) == 0)
+      return arm32_stdio_handle (cpu, i);
+
+  return 0;
+}
+
+/* Hooks that only touch guest memory, safe to put in place of the
+   copies a static binary carries */
+static const char *arm32_stdlib_static_list[] =
+{
+  "memset", "memcpy", "memmove", "memchr", "memcmp", "strlen",
+  "strcmp", "strncmp", "strchr", "strrchr", "strcpy", NULL
+};
+
+/* String functions defined by the main image are sent to their native
+   hooks, and the hooks get the per-program state they rely on. Imports
+   are bound at load time, see ARM32_ELF_STDLIB_HOOKS. */
 void
 arm32_init_stdlib_hooks (struct arm32_cpu *cpu)
 {
   struct arm32_elf *elf = (struct arm32_elf *) cpu->data;
+  const struct arm32_stdlib_hook *hook;
   int optind_idx;
+  int i;
+
+  if (!elf->static_hooks)
+    for (i = 0; arm32_stdlib_static_list[i] != NULL; ++i)
+      if ((hook = arm32_stdlib_hook_lookup (arm32_stdlib_static_list[i])) != NULL)
+        if (arm32_elf_hook_defined_function (elf, hook) == -1)
+          warning ("Cannot hook static copy of `%s'\n", hook->name);
+
+  elf->static_hooks = 1;
+
+  cpu->runtime.optind = &cpu->runtime.optind_local;
 
-  arm_optind = &optind;
-  
   if ((optind_idx = arm32_cpu_get_symbol_index (cpu, "optind")) != -1)
-    if ((arm_optind = arm32_cpu_translate_read (cpu, elf->symtab[optind_idx].st_value)) == NULL)
-      arm_optind = &optind;
-
-  arm32_cpu_override_symbol (cpu, "memset", ARMSYM (memset), NULL);
-  arm32_cpu_override_symbol (cpu, "memcpy", ARMSYM (memcpy), NULL);
-  arm32_cpu_override_symbol (cpu, "memmove", ARMSYM (memmove), NULL);
-  arm32_cpu_override_symbol (cpu, "exit", ARMSYM (exit), NULL);
-  arm32_cpu_override_symbol (cpu, "write", ARMSYM (write), NULL);
-  arm32_cpu_override_symbol (cpu, "read", ARMSYM (read), NULL);
-  arm32_cpu_override_symbol (cpu, "close", ARMSYM (close), NULL);
-  arm32_cpu_override_symbol (cpu, "fputs_unlocked", ARMSYM (fputs_unlocked), NULL);
-  arm32_cpu_override_symbol (cpu, "__printf_chk", ARMSYM (__printf_chk), NULL);
-  arm32_cpu_override_symbol (cpu, "__fprintf_chk", ARMSYM (__fprintf_chk), NULL);
-  arm32_cpu_override_symbol (cpu, "dcgettext", ARMSYM (dcgettext), NULL);
-  arm32_cpu_override_symbol (cpu, "malloc", ARMSYM (malloc), NULL);
-  arm32_cpu_override_symbol (cpu, "calloc", ARMSYM (calloc), NULL);
-  arm32_cpu_override_symbol (cpu, "free", ARMSYM (free), NULL);
-  
-  arm32_cpu_override_symbol (cpu, "posix_fadvise64", ARMSYM (posix_fadvise64), NULL);
-  arm32_cpu_override_symbol (cpu, "error", ARMSYM (error), NULL);
-  arm32_cpu_override_symbol (cpu, "__errno_location", ARMSYM (__errno_location), NULL);
-  arm32_cpu_override_symbol (cpu, "open64", ARMSYM (open64), NULL);
-  arm32_cpu_override_symbol (cpu, "strncmp", ARMSYM (strncmp), NULL);
-  
-  arm32_cpu_override_symbol (cpu, "__fxstat64", ARMSYM (__fxstat64), NULL);
-  arm32_cpu_override_symbol (cpu, "getopt_long", ARMSYM (getopt_long), NULL);
-  arm32_cpu_override_symbol (cpu, "__cxa_atexit", ARMSYM (cxa_atexit), NULL);
-  arm32_cpu_override_symbol (cpu, "textdomain", ARMSYM (textdomain), NULL);
-  arm32_cpu_override_symbol (cpu, "__libc_start_main", ARMSYM (libc_start_main), NULL);
-  arm32_cpu_override_symbol (cpu, "getpagesize", ARMSYM (getpagesize), NULL);
-  arm32_cpu_override_symbol (cpu, "strrchr", ARMSYM (strrchr), NULL);
-  arm32_cpu_override_symbol (cpu, "fwrite", ARMSYM (fwrite), NULL);
-  arm32_cpu_override_symbol (cpu, "setlocale", ARMSYM (setlocale), NULL);
-  arm32_cpu_override_symbol (cpu, "bindtextdomain", ARMSYM (bindtextdomain), NULL);
+    if ((cpu->runtime.optind = arm32_cpu_translate_read (cpu, elf->symtab[optind_idx].st_value)) == NULL)
+      cpu->runtime.optind = &cpu->runtime.optind_local;
 }
@@ -0,0 +1,1008 @@
+/*
+ *    ARMette: a small ARM7 multiplatform emulation library
+ *    Copyright (C) 2014  Gonzalo J. Carracedo
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _GNU_SOURCE /* syscall, dup3, pipe2, O_DIRECT */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "arm_cpu.h"
+#include "arm_elf.h"
+#include "arm_stdio.h"
+#include "arm_aio.h"
+#include "arm_syscall.h"
+
+#define SYSSYM(sname) JOIN (arm32_sys_, sname)
+
+/* Kernel user helpers, as glibc and the EABI runtime call them:
+   __kuser_memory_barrier at 0xffff0fa0, __kuser_cmpxchg at 0xffff0fc0,
+   __kuser_get_tls at 0xffff0fe0 and __kuser_helper_version at 0xffff0ffc */
+static uint32_t arm_kuser_helpers[ARM32_SYSCALL_KUSER_SIZE / sizeof (uint32_t)] =
+{
+  [0x00 / 4] = 0xe12fff1e, /* bx lr */
+
+  [0x20 / 4] = 0xe5923000, /* ldr r3, [r2] */
+  [0x24 / 4] = 0xe0533000, /* subs r3, r3, r0 */
+  [0x28 / 4] = 0x05821000, /* streq r1, [r2] */
+  [0x2c / 4] = 0xe2730000, /* rsbs r0, r3, #0 */
+  [0x30 / 4] = 0xe12fff1e, /* bx lr */
+
+  [0x40 / 4] = 0xee1d0f70, /* mrc p15, 0, r0, c13, c0, 3 */
+  [0x44 / 4] = 0xe12fff1e, /* bx lr */
+
+  [0x5c / 4] = 3           /* Helpers up to __kuser_memory_barrier */
+};
+
+#define SYSPROTO(sname) \
+  static int32_t SYSSYM (sname) (struct arm32_cpu *cpu, const uint32_t *args)
+
+/* Guest open flags that differ from x86 hosts */
+#define ARM32_O_DIRECTORY 040000
+#define ARM32_O_NOFOLLOW  0100000
+#define ARM32_O_DIRECT    0200000
+#define ARM32_O_LARGEFILE 0400000
+
+#define ARM32_O_ARCH \
+  (ARM32_O_DIRECTORY | ARM32_O_NOFOLLOW | ARM32_O_DIRECT | ARM32_O_LARGEFILE)
+
+/* Terminal ioctls, numbered and laid out alike on every Linux port
+   but Alpha, MIPS, PowerPC and SPARC */
+#define ARM32_TCGETS     0x5401
+#define ARM32_TCSETS     0x5402
+#define ARM32_TCSETSW    0x5403
+#define ARM32_TCSETSF    0x5404
+#define ARM32_TIOCGWINSZ 0x5413
+#define ARM32_FIONREAD   0x541b
+
+#define ARM32_TERMIOS_SIZE 36
+
+/* struct stat64 as seen by EABI guests. 64 bit fields are 8 byte aligned
+   by explicit padding, so the layout holds on 32 bit hosts too. */
+struct arm32_stat64
+{
+  uint64_t st_dev;
+  uint32_t __pad0;
+  uint32_t __st_ino;
+  uint32_t st_mode;
+  uint32_t st_nlink;
+  uint32_t st_uid;
+  uint32_t st_gid;
+  uint64_t st_rdev;
+  uint32_t __pad3[2];
+  int64_t  st_size;
+  uint32_t st_blksize;
+  uint32_t __pad4;
+  uint64_t st_blocks;
+  uint32_t st_atime_sec;
+  uint32_t st_atime_nsec;
+  uint32_t st_mtime_sec;
+  uint32_t st_mtime_nsec;
+  uint32_t st_ctime_sec;
+  uint32_t st_ctime_nsec;
+  uint64_t st_ino;
+};
+
+static inline int32_t
+arm32_syscall_result (long result)
+{
+  return result == -1 ? -errno : result;
+}
+
+/* Guest buffers must fit in one segment */
+static void *
+arm32_syscall_ptr (struct arm32_cpu *cpu, uint32_t virt, uint32_t size, int write)
+{
+  if (write)
+    return arm32_cpu_translate_write_size (cpu, virt, size);
+  else
+    return arm32_cpu_translate_read_size (cpu, virt, size);
+}
+
+static const char *
+arm32_syscall_path (struct arm32_cpu *cpu, uint32_t virt)
+{
+  uint32_t len;
+
+  return arm32_stdlib_translate_string (cpu, virt, &len);
+}
+
+static int
+arm32_syscall_open_flags (uint32_t guest)
+{
+  int flags = guest & ~ARM32_O_ARCH;
+
+  if (guest & ARM32_O_DIRECTORY)
+    flags |= O_DIRECTORY;
+
+  if (guest & ARM32_O_NOFOLLOW)
+    flags |= O_NOFOLLOW;
+
+  if (guest & ARM32_O_DIRECT)
+    flags |= O_DIRECT;
+
+  return flags;
+}
+
+static uint32_t
+arm32_syscall_guest_open_flags (int flags)
+{
+  uint32_t guest = flags & ~(O_DIRECTORY | O_NOFOLLOW | O_DIRECT | O_LARGEFILE);
+
+  if (flags & O_DIRECTORY)
+    guest |= ARM32_O_DIRECTORY;
+
+  if (flags & O_NOFOLLOW)
+    guest |= ARM32_O_NOFOLLOW;
+
+  if (flags & O_DIRECT)
+    guest |= ARM32_O_DIRECT;
+
+  /* Host offsets are always 64 bits wide */
+  return guest | ARM32_O_LARGEFILE;
+}
+
+static int32_t
+arm32_syscall_open_at (struct arm32_cpu *cpu, int dirfd, uint32_t path_virt, uint32_t flags, uint32_t mode)
+{
+  const char *path;
+  int fd;
+
+  if ((path = arm32_syscall_path (cpu, path_virt)) == NULL)
+    return -EFAULT;
+
+  if ((fd = openat (dirfd, path, arm32_syscall_open_flags (flags), mode)) == -1)
+    return -errno;
+
+  if ((flags & O_ACCMODE) == O_RDONLY)
+    arm32_aio_track (cpu, fd);
+
+  return fd;
+}
+
+static int32_t
+arm32_syscall_stat_at (struct arm32_cpu *cpu, int dirfd, const char *path, uint32_t buf, int flags)
+{
+  struct arm32_stat64 *st;
+  struct stat sbuf;
+
+  if ((st = arm32_syscall_ptr (cpu, buf, sizeof (struct arm32_stat64), 1)) == NULL)
+    return -EFAULT;
+
+  if (fstatat (dirfd, path, &sbuf, flags) == -1)
+    return -errno;
+
+  memset (st, 0, sizeof (struct arm32_stat64));
+
+  st->st_dev        = sbuf.st_dev;
+  st->__st_ino      = sbuf.st_ino;
+  st->st_mode       = sbuf.st_mode;
+  st->st_nlink      = sbuf.st_nlink;
+  st->st_uid        = sbuf.st_uid;
+  st->st_gid        = sbuf.st_gid;
+  st->st_rdev       = sbuf.st_rdev;
+  st->st_size       = sbuf.st_size;
+  st->st_blksize    = sbuf.st_blksize;
+  st->st_blocks     = sbuf.st_blocks;
+  st->st_atime_sec  = sbuf.st_atim.tv_sec;
+  st->st_atime_nsec = sbuf.st_atim.tv_nsec;
+  st->st_mtime_sec  = sbuf.st_mtim.tv_sec;
+  st->st_mtime_nsec = sbuf.st_mtim.tv_nsec;
+  st->st_ctime_sec  = sbuf.st_ctim.tv_sec;
+  st->st_ctime_nsec = sbuf.st_ctim.tv_nsec;
+  st->st_ino        = sbuf.st_ino;
+
+  return 0;
+}
+
+static int32_t
+arm32_syscall_path_stat (struct arm32_cpu *cpu, uint32_t path_virt, uint32_t buf, int flags)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, path_virt)) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_stat_at (cpu, AT_FDCWD, path, buf, flags);
+}
+
+SYSPROTO (exit)
+{
+  if (cpu->runtime.stdio != NULL)
+    arm32_stdio_flush_all (cpu->runtime.stdio);
+
+  if (getenv (ARM32_ELF_PROFILE_ENV) != NULL)
+    arm32_cpu_dump_profile (cpu, stderr);
+
+  exit (args[0]);
+
+  return 0;
+}
+
+SYSPROTO (read)
+{
+  return arm32_syscall_result (arm32_stdlib_read_guest (cpu, args[0], args[1], args[2], 0, 0));
+}
+
+SYSPROTO (write)
+{
+  return arm32_syscall_result (arm32_stdlib_write_guest (cpu, args[0], args[1], args[2], 0, 0));
+}
+
+SYSPROTO (open)
+{
+  return arm32_syscall_open_at (cpu, AT_FDCWD, args[0], args[1], args[2]);
+}
+
+SYSPROTO (openat)
+{
+  return arm32_syscall_open_at (cpu, args[0], args[1], args[2], args[3]);
+}
+
+SYSPROTO (close)
+{
+  arm32_aio_untrack (cpu, args[0]);
+
+  return arm32_syscall_result (close (args[0]));
+}
+
+SYSPROTO (unlink)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (unlink (path));
+}
+
+SYSPROTO (chdir)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (chdir (path));
+}
+
+SYSPROTO (access)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (access (path, args[1]));
+}
+
+SYSPROTO (rename)
+{
+  const char *from, *to;
+
+  if ((from = arm32_syscall_path (cpu, args[0])) == NULL ||
+      (to = arm32_syscall_path (cpu, args[1])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (rename (from, to));
+}
+
+SYSPROTO (mkdir)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (mkdir (path, args[1]));
+}
+
+SYSPROTO (rmdir)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (rmdir (path));
+}
+
+SYSPROTO (readlink)
+{
+  const char *path;
+  char *buf;
+
+  if ((path = arm32_syscall_path (cpu, args[0])) == NULL ||
+      (buf = arm32_syscall_ptr (cpu, args[1], args[2], 1)) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (readlink (path, buf, args[2]));
+}
+
+SYSPROTO (getcwd)
+{
+  char *buf;
+
+  if ((buf = arm32_syscall_ptr (cpu, args[0], args[1], 1)) == NULL)
+    return -EFAULT;
+
+  if (getcwd (buf, args[1]) == NULL)
+    return -errno;
+
+  return strlen (buf) + 1;
+}
+
+SYSPROTO (lseek)
+{
+  off_t result;
+
+  if ((result = arm32_stdlib_seek (cpu, args[0], (int32_t) args[1], args[2])) == -1)
+    return -errno;
+
+  return result > INT32_MAX ? -EOVERFLOW : result;
+}
+
+SYSPROTO (_llseek)
+{
+  int64_t *result;
+  off_t offset;
+
+  if ((result = arm32_syscall_ptr (cpu, args[3], sizeof (int64_t), 1)) == NULL)
+    return -EFAULT;
+
+  if ((offset = arm32_stdlib_seek (cpu, args[0], (int64_t) ((uint64_t) args[1] << 32 | args[2]), args[4])) == -1)
+    return -errno;
+
+  *result = offset;
+
+  return 0;
+}
+
+SYSPROTO (pread64)
+{
+  off_t offset = (int64_t) ((uint64_t) args[5] << 32 | args[4]);
+
+  return arm32_syscall_result (arm32_stdlib_read_guest (cpu, args[0], args[1], args[2], 1, offset));
+}
+
+SYSPROTO (pwrite64)
+{
+  off_t offset = (int64_t) ((uint64_t) args[5] << 32 | args[4]);
+
+  return arm32_syscall_result (arm32_stdlib_write_guest (cpu, args[0], args[1], args[2], 1, offset));
+}
+
+SYSPROTO (readv)
+{
+  return arm32_syscall_result (arm32_stdlib_readv_guest (cpu, args[0], args[1], args[2]));
+}
+
+SYSPROTO (writev)
+{
+  return arm32_syscall_result (arm32_stdlib_writev_guest (cpu, args[0], args[1], args[2]));
+}
+
+static int32_t
+arm32_syscall_send_file (struct arm32_cpu *cpu, const uint32_t *args, int wide)
+{
+  void *guest_offset = NULL;
+  off_t offset;
+  ssize_t result;
+
+  if (args[2] != 0)
+  {
+    if ((guest_offset = arm32_syscall_ptr (cpu, args[2], wide ? sizeof (int64_t) : sizeof (int32_t), 1)) == NULL)
+      return -EFAULT;
+
+    if (wide)
+      memcpy (&offset, guest_offset, sizeof (int64_t));
+    else
+      offset = *(int32_t *) guest_offset;
+  }
+
+  arm32_aio_untrack (cpu, args[0]);
+  arm32_aio_untrack (cpu, args[1]);
+
+  result = arm32_stdlib_host_sendfile (args[0], args[1], guest_offset != NULL ? &offset : NULL, args[3]);
+
+  if (guest_offset != NULL)
+  {
+    if (wide)
+      memcpy (guest_offset, &offset, sizeof (int64_t));
+    else
+      *(int32_t *) guest_offset = offset;
+  }
+
+  return arm32_syscall_result (result);
+}
+
+SYSPROTO (sendfile)
+{
+  return arm32_syscall_send_file (cpu, args, 0);
+}
+
+SYSPROTO (sendfile64)
+{
+  return arm32_syscall_send_file (cpu, args, 1);
+}
+
+SYSPROTO (pipe2)
+{
+  int32_t *guest_fds;
+  int fds[2];
+
+  if ((guest_fds = arm32_syscall_ptr (cpu, args[0], 2 * sizeof (int32_t), 1)) == NULL)
+    return -EFAULT;
+
+  if (pipe2 (fds, arm32_syscall_open_flags (args[1])) == -1)
+    return -errno;
+
+  guest_fds[0] = fds[0];
+  guest_fds[1] = fds[1];
+
+  return 0;
+}
+
+SYSPROTO (pipe)
+{
+  const uint32_t pipe_args[2] = {args[0], 0};
+
+  return SYSSYM (pipe2) (cpu, pipe_args);
+}
+
+/* Duplicates share the file offset, which read ahead leaves behind.
+   Whatever newfd was is closed. */
+SYSPROTO (dup)
+{
+  arm32_aio_untrack (cpu, args[0]);
+
+  return arm32_syscall_result (dup (args[0]));
+}
+
+SYSPROTO (dup2)
+{
+  arm32_aio_untrack (cpu, args[0]);
+
+  if (args[1] != args[0])
+    arm32_aio_untrack (cpu, args[1]);
+
+  return arm32_syscall_result (dup2 (args[0], args[1]));
+}
+
+SYSPROTO (dup3)
+{
+  arm32_aio_untrack (cpu, args[0]);
+  arm32_aio_untrack (cpu, args[1]);
+
+  return arm32_syscall_result (dup3 (args[0], args[1], args[2]));
+}
+
+/* Integer arguments only, struct flock is not translated */
+SYSPROTO (fcntl)
+{
+  int flags;
+
+  switch (args[1])
+  {
+    case F_DUPFD:
+    case F_DUPFD_CLOEXEC:
+    case F_GETFD:
+    case F_SETFD:
+      return arm32_syscall_result (fcntl (args[0], args[1], args[2]));
+
+    case F_GETFL:
+      if ((flags = fcntl (args[0], F_GETFL)) == -1)
+        return -errno;
+
+      return arm32_syscall_guest_open_flags (flags);
+
+    case F_SETFL:
+      return arm32_syscall_result (fcntl (args[0], F_SETFL, arm32_syscall_open_flags (args[2])));
+  }
+
+  return -EINVAL;
+}
+
+SYSPROTO (ioctl)
+{
+  uint32_t size;
+  void *arg;
+
+  switch (args[1])
+  {
+    case ARM32_TCGETS:
+    case ARM32_TCSETS:
+    case ARM32_TCSETSW:
+    case ARM32_TCSETSF:
+      size = ARM32_TERMIOS_SIZE;
+      break;
+
+    case ARM32_TIOCGWINSZ:
+      size = 4 * sizeof (uint16_t);
+      break;
+
+    case ARM32_FIONREAD:
+      size = sizeof (int32_t);
+      break;
+
+    default:
+      return -ENOTTY;
+  }
+
+  if ((arg = arm32_syscall_ptr (cpu, args[2], size, 1)) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (ioctl (args[0], args[1], arg));
+}
+
+SYSPROTO (stat64)
+{
+  return arm32_syscall_path_stat (cpu, args[0], args[1], 0);
+}
+
+SYSPROTO (lstat64)
+{
+  return arm32_syscall_path_stat (cpu, args[0], args[1], AT_SYMLINK_NOFOLLOW);
+}
+
+SYSPROTO (fstat64)
+{
+  return arm32_syscall_stat_at (cpu, args[0], "", args[1], AT_EMPTY_PATH);
+}
+
+SYSPROTO (fstatat64)
+{
+  const char *path;
+
+  if ((path = arm32_syscall_path (cpu, args[1])) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_stat_at (cpu, args[0], path, args[2], args[3]);
+}
+
+/* struct linux_dirent64 is the same everywhere */
+SYSPROTO (getdents64)
+{
+  void *buf;
+
+  if ((buf = arm32_syscall_ptr (cpu, args[1], args[2], 1)) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (syscall (SYS_getdents64, args[0], buf, args[2]));
+}
+
+SYSPROTO (brk)
+{
+  struct arm32_elf *elf;
+
+  if ((elf = arm32_stdlib_brk_init (cpu)) == NULL)
+    return -ENOMEM;
+
+  /* The kernel returns the current break, failure or not */
+  if (args[0] != 0)
+    arm32_stdlib_set_brk (cpu, args[0]);
+
+  return elf->brk;
+}
+
+SYSPROTO (mmap2)
+{
+  uint32_t virt;
+
+  virt = arm32_stdlib_map (
+      cpu,
+      args[0],
+      args[1],
+      args[2],
+      args[3],
+      args[4],
+      (off_t) args[5] * ARM32_ELF_PAGE_SIZE);
+
+  return virt == -1 ? -errno : virt;
+}
+
+SYSPROTO (munmap)
+{
+  if ((args[0] & (ARM32_ELF_PAGE_SIZE - 1)) != 0 || args[1] == 0)
+    return -EINVAL;
+
+  arm32_stdlib_unmap (cpu, args[0], __ALIGN ((uint64_t) args[1], ARM32_ELF_PAGE_SIZE));
+
+  return 0;
+}
+
+SYSPROTO (mremap)
+{
+  uint32_t virt;
+
+  if ((virt = arm32_stdlib_remap (cpu, args[0], args[1], args[2], args[3])) == -1)
+    return -errno;
+
+  return virt;
+}
+
+SYSPROTO (mprotect)
+{
+  if (arm32_stdlib_protect (cpu, args[0], args[1], args[2]) == -1)
+    return -errno;
+
+  return 0;
+}
+
+SYSPROTO (madvise)
+{
+  if (arm32_stdlib_advise (cpu, args[0], args[1], args[2]) == -1)
+    return -errno;
+
+  return 0;
+}
+
+SYSPROTO (uname)
+{
+  struct utsname host;
+  struct utsname *guest;
+
+  /* struct new_utsname: six 65 byte strings, same as the host's */
+  if ((guest = arm32_syscall_ptr (cpu, args[0], sizeof (struct utsname), 1)) == NULL)
+    return -EFAULT;
+
+  if (uname (&host) == -1)
+    return -errno;
+
+  *guest = host;
+
+  strncpy (guest->machine, "armv7l", sizeof (guest->machine));
+
+  return 0;
+}
+
+SYSPROTO (gettimeofday)
+{
+  struct timeval tv;
+  int32_t *guest_tv, *guest_tz;
+
+  if (gettimeofday (&tv, NULL) == -1)
+    return -errno;
+
+  if (args[0] != 0)
+  {
+    if ((guest_tv = arm32_syscall_ptr (cpu, args[0], 2 * sizeof (int32_t), 1)) == NULL)
+      return -EFAULT;
+
+    guest_tv[0] = tv.tv_sec;
+    guest_tv[1] = tv.tv_usec;
+  }
+
+  if (args[1] != 0)
+  {
+    if ((guest_tz = arm32_syscall_ptr (cpu, args[1], 2 * sizeof (int32_t), 1)) == NULL)
+      return -EFAULT;
+
+    guest_tz[0] = 0;
+    guest_tz[1] = 0;
+  }
+
+  return 0;
+}
+
+SYSPROTO (clock_gettime)
+{
+  struct timespec ts;
+  int32_t *guest_ts;
+
+  if ((guest_ts = arm32_syscall_ptr (cpu, args[1], 2 * sizeof (int32_t), 1)) == NULL)
+    return -EFAULT;
+
+  if (clock_gettime (args[0], &ts) == -1)
+    return -errno;
+
+  guest_ts[0] = ts.tv_sec;
+  guest_ts[1] = ts.tv_nsec;
+
+  return 0;
+}
+
+SYSPROTO (clock_gettime64)
+{
+  struct timespec ts;
+  int64_t *guest_ts;
+
+  if ((guest_ts = arm32_syscall_ptr (cpu, args[1], 2 * sizeof (int64_t), 1)) == NULL)
+    return -EFAULT;
+
+  if (clock_gettime (args[0], &ts) == -1)
+    return -errno;
+
+  guest_ts[0] = ts.tv_sec;
+  guest_ts[1] = ts.tv_nsec;
+
+  return 0;
+}
+
+SYSPROTO (nanosleep)
+{
+  struct timespec req, rem;
+  const int32_t *guest_req;
+  int32_t *guest_rem = NULL;
+  int result;
+
+  if ((guest_req = arm32_syscall_ptr (cpu, args[0], 2 * sizeof (int32_t), 0)) == NULL)
+    return -EFAULT;
+
+  if (args[1] != 0)
+    if ((guest_rem = arm32_syscall_ptr (cpu, args[1], 2 * sizeof (int32_t), 1)) == NULL)
+      return -EFAULT;
+
+  req.tv_sec  = guest_req[0];
+  req.tv_nsec = guest_req[1];
+
+  if ((result = nanosleep (&req, &rem)) == -1 && guest_rem != NULL)
+  {
+    guest_rem[0] = rem.tv_sec;
+    guest_rem[1] = rem.tv_nsec;
+  }
+
+  return arm32_syscall_result (result);
+}
+
+SYSPROTO (getrandom)
+{
+  void *buf;
+
+  if ((buf = arm32_syscall_ptr (cpu, args[0], args[1], 1)) == NULL)
+    return -EFAULT;
+
+  return arm32_syscall_result (syscall (SYS_getrandom, buf, args[1], args[2]));
+}
+
+/* Signals are never delivered to the guest: handlers and masks are
+   accepted and reported back empty */
+SYSPROTO (rt_sigaction)
+{
+  void *old;
+
+  if (args[2] != 0)
+  {
+    /* handler, flags, restorer and a 64 bit mask */
+    if ((old = arm32_syscall_ptr (cpu, args[2], 5 * sizeof (uint32_t), 1)) == NULL)
+      return -EFAULT;
+
+    memset (old, 0, 5 * sizeof (uint32_t));
+  }
+
+  return 0;
+}
+
+SYSPROTO (rt_sigprocmask)
+{
+  void *old;
+
+  if (args[2] != 0)
+  {
+    if ((old = arm32_syscall_ptr (cpu, args[2], args[3], 1)) == NULL)
+      return -EFAULT;
+
+    memset (old, 0, args[3]);
+  }
+
+  return 0;
+}
+
+SYSPROTO (set_tid_address)
+{
+  return getpid ();
+}
+
+SYSPROTO (set_robust_list)
+{
+  return 0;
+}
+
+/* ARM private syscalls. Decoded instructions are checked against memory
+   on every fetch, so there is no cache to flush. */
+SYSPROTO (cacheflush)
+{
+  return 0;
+}
+
+SYSPROTO (set_tls)
+{
+  cpu->runtime.tls = args[0];
+
+  return 0;
+}
+
+SYSPROTO (get_tls)
+{
+  return cpu->runtime.tls;
+}
+
+#define SYSCALL(nr, sname) [nr] = { STRINGIFY (sname), SYSSYM (sname), 0 }
+#define SYSPASS(nr, sname) [nr] = { STRINGIFY (sname), NULL, JOIN (SYS_, sname) }
+#define SYSHOST(nr, sname, host) [nr] = { STRINGIFY (sname), NULL, JOIN (SYS_, host) }
+#define SYSALIAS(nr, sname, handler) [nr] = { STRINGIFY (sname), SYSSYM (handler), 0 }
+
+/* EABI numbers. Calls taking integers only go straight to the host. */
+static const struct arm32_syscall arm32_syscall_table[ARM32_SYSCALL_MAX] =
+{
+  SYSCALL (1, exit),
+  SYSCALL (3, read),
+  SYSCALL (4, write),
+  SYSCALL (5, open),
+  SYSCALL (6, close),
+  SYSCALL (10, unlink),
+  SYSCALL (12, chdir),
+  SYSCALL (19, lseek),
+  SYSPASS (20, getpid),
+  SYSPASS (24, getuid),
+  SYSCALL (33, access),
+  SYSPASS (37, kill),
+  SYSCALL (38, rename),
+  SYSCALL (39, mkdir),
+  SYSCALL (40, rmdir),
+  SYSCALL (41, dup),
+  SYSCALL (42, pipe),
+  SYSCALL (45, brk),
+  SYSPASS (47, getgid),
+  SYSPASS (49, geteuid),
+  SYSPASS (50, getegid),
+  SYSCALL (54, ioctl),
+  SYSCALL (55, fcntl),
+  SYSPASS (60, umask),
+  SYSCALL (63, dup2),
+  SYSPASS (64, getppid),
+  SYSPASS (66, setsid),
+  SYSCALL (78, gettimeofday),
+  SYSCALL (85, readlink),
+  SYSCALL (91, munmap),
+  SYSPASS (94, fchmod),
+  SYSPASS (118, fsync),
+  SYSCALL (122, uname),
+  SYSCALL (125, mprotect),
+  SYSPASS (133, fchdir),
+  SYSCALL (140, _llseek),
+  SYSPASS (143, flock),
+  SYSCALL (145, readv),
+  SYSCALL (146, writev),
+  SYSPASS (148, fdatasync),
+  SYSPASS (158, sched_yield),
+  SYSCALL (162, nanosleep),
+  SYSCALL (163, mremap),
+  SYSCALL (174, rt_sigaction),
+  SYSCALL (175, rt_sigprocmask),
+  SYSCALL (180, pread64),
+  SYSCALL (181, pwrite64),
+  SYSCALL (183, getcwd),
+  SYSCALL (187, sendfile),
+  SYSCALL (192, mmap2),
+  SYSCALL (195, stat64),
+  SYSCALL (196, lstat64),
+  SYSCALL (197, fstat64),
+  SYSHOST (199, getuid32, getuid),
+  SYSHOST (200, getgid32, getgid),
+  SYSHOST (201, geteuid32, geteuid),
+  SYSHOST (202, getegid32, getegid),
+  SYSCALL (217, getdents64),
+  SYSCALL (220, madvise),
+  SYSALIAS (221, fcntl64, fcntl),
+  SYSPASS (224, gettid),
+  SYSCALL (239, sendfile64),
+  SYSALIAS (248, exit_group, exit),
+  SYSCALL (256, set_tid_address),
+  SYSCALL (263, clock_gettime),
+  SYSPASS (268, tgkill),
+  SYSCALL (322, openat),
+  SYSCALL (327, fstatat64),
+  SYSCALL (338, set_robust_list),
+  SYSCALL (358, dup3),
+  SYSCALL (359, pipe2),
+  SYSCALL (384, getrandom),
+  SYSCALL (403, clock_gettime64),
+};
+
+static const struct arm32_syscall arm32_syscall_private_table[ARM32_SYSCALL_PRIVATE_MAX] =
+{
+  SYSCALL (2, cacheflush),
+  SYSCALL (5, set_tls),
+  SYSCALL (6, get_tls),
+};
+
+const struct arm32_syscall *
+arm32_syscall_lookup (uint32_t nr)
+{
+  const struct arm32_syscall *sc;
+
+  if (nr < ARM32_SYSCALL_MAX)
+    sc = &arm32_syscall_table[nr];
+  else if (nr - ARM32_SYSCALL_PRIVATE_BASE < ARM32_SYSCALL_PRIVATE_MAX)
+    sc = &arm32_syscall_private_table[nr - ARM32_SYSCALL_PRIVATE_BASE];
+  else
+    return NULL;
+
+  return sc->name != NULL ? sc : NULL;
+}
+
+/* SWI vector. Only r0 is written back, like the kernel does. */
+void
+arm32_syscall_vector (struct arm32_cpu *cpu, uint32_t addr, uint32_t code)
+{
+  const struct arm32_syscall *sc;
+  uint32_t args[ARM32_SYSCALL_ARGS];
+  int32_t result;
+  int i;
+
+  /* OABI passes the number in the instruction, not supported */
+  if (code != 0 || (sc = arm32_syscall_lookup (REG (cpu, 7))) == NULL)
+  {
+    debug ("0x%08x: unsupported syscall %d (swi 0x%x)\n", addr, REG (cpu, 7), code);
+
+    R0 (cpu) = -ENOSYS;
+
+    return;
+  }
+
+  for (i = 0; i < ARM32_SYSCALL_ARGS; ++i)
+    args[i] = REG (cpu, i);
+
+  if (sc->handler != NULL)
+    result = (sc->handler) (cpu, args);
+  else
+    result = arm32_syscall_result (
+        syscall (
+          sc->host_nr,
+          (long) (int32_t) args[0],
+          (long) (int32_t) args[1],
+          (long) (int32_t) args[2],
+          (long) (int32_t) args[3],
+          (long) (int32_t) args[4],
+          (long) (int32_t) args[5]));
+
+  debug ("0x%08x: %s () = %d\n", addr, sc->name, result);
+
+  R0 (cpu) = result;
+}
+
+int
+arm32_syscall_install (struct arm32_cpu *cpu)
+{
+  struct arm32_segment *seg;
+
+  if ((seg = arm32_segment_new (ARM32_SYSCALL_KUSER_BOTTOM, arm_kuser_helpers, sizeof (arm_kuser_helpers), SA_R | SA_X)) == NULL)
+    return -1;
+
+  if (arm32_cpu_add_segment (cpu, seg) == -1)
+  {
+    arm32_segment_destroy (seg);
+
+    return -1;
+  }
+
+  cpu->vector_table[ARM32_EXCEPTION_SWI] = arm32_syscall_vector;
+
+  return 0;
+}
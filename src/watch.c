@@ -49,6 +49,13 @@ arm32_watchpoint_new (const char *name, int type, int when)
 void
 arm32_watchpoint_destroy (struct arm32_watchpoint *wp)
 {
+  if (wp->condition != NULL)
+    arm32_predicate_destroy (wp->condition);
+
+  /* Name and watchpoint live in the arena */
+  if (wp->arena)
+    return;
+
   free (wp->name);
   free (wp);
 }
@@ -64,11 +71,212 @@ arm32_watchpoint_set_new (void)
   return new;
 }
 
+void
+arm32_watchpoint_queue_destroy (struct arm32_watchpoint_queue *queue)
+{
+  pthread_cond_destroy (&queue->cond);
+  pthread_mutex_destroy (&queue->lock);
+
+  if (queue->event_list != NULL)
+    free (queue->event_list);
+
+  free (queue);
+}
+
+struct arm32_watchpoint_queue *
+arm32_watchpoint_queue_new (unsigned int size, int flags)
+{
+  struct arm32_watchpoint_queue *new;
+  unsigned int real_size = 1;
+
+  /* Head and tail are free running counters, size must be a power of 2 */
+  while (real_size < size)
+    real_size <<= 1;
+
+  if ((new = calloc (1, sizeof (struct arm32_watchpoint_queue))) == NULL)
+    return NULL;
+
+  if ((new->event_list = malloc (real_size * sizeof (struct arm32_watchpoint_event))) == NULL)
+  {
+    free (new);
+
+    return NULL;
+  }
+
+  new->size  = real_size;
+  new->flags = flags;
+
+  pthread_mutex_init (&new->lock, NULL);
+  pthread_cond_init (&new->cond, NULL);
+
+  return new;
+}
+
+static void
+arm32_watchpoint_queue_wake (struct arm32_watchpoint_queue *queue)
+{
+  pthread_mutex_lock (&queue->lock);
+
+  queue->waiting = 0;
+  pthread_cond_broadcast (&queue->cond);
+
+  pthread_mutex_unlock (&queue->lock);
+}
+
+static int
+arm32_watchpoint_queue_push (struct arm32_watchpoint_queue *queue, const struct arm32_watchpoint_event *event)
+{
+  unsigned int head, tail;
+
+  tail = queue->tail;
+  head = __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST);
+
+  if (tail - head == queue->size)
+  {
+    if (!(queue->flags & ARM32_WATCHPOINT_QUEUE_BLOCK))
+    {
+      warning ("Watchpoint queue full, event lost\n");
+
+      return 1;
+    }
+
+    pthread_mutex_lock (&queue->lock);
+
+    while (tail - (head = __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST)) == queue->size && !queue->closed)
+    {
+      __atomic_store_n (&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+      /* Consumer may have popped before seeing the flag */
+      if (tail - __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST) != queue->size)
+        break;
+
+      pthread_cond_wait (&queue->cond, &queue->lock);
+    }
+
+    pthread_mutex_unlock (&queue->lock);
+
+    /* Closed with no room left: storing it would overwrite unread events */
+    if (tail - (head = __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST)) == queue->size)
+    {
+      warning ("Watchpoint queue closed while full, event lost\n");
+
+      return 1;
+    }
+  }
+
+  queue->event_list[tail & (queue->size - 1)] = *event;
+
+  __atomic_store_n (&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n (&queue->waiting, __ATOMIC_SEQ_CST))
+    arm32_watchpoint_queue_wake (queue);
+
+  /* Buffer just got full: stop and let the consumer catch up */
+  if (!(queue->flags & ARM32_WATCHPOINT_QUEUE_BLOCK) && tail + 1 - head == queue->size)
+    return 1;
+
+  return __atomic_exchange_n (&queue->stop, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Called from the consumer thread. If wait is set, blocks until at least
+   one event is available or the queue is closed. */
+unsigned int
+arm32_watchpoint_queue_pop (struct arm32_watchpoint_queue *queue, struct arm32_watchpoint_event *events, unsigned int max, int wait)
+{
+  unsigned int head, tail;
+  unsigned int i, n;
+
+  head = queue->head;
+  tail = __atomic_load_n (&queue->tail, __ATOMIC_SEQ_CST);
+
+  if (head == tail && wait)
+  {
+    pthread_mutex_lock (&queue->lock);
+
+    while ((tail = __atomic_load_n (&queue->tail, __ATOMIC_SEQ_CST)) == head && !queue->closed)
+    {
+      __atomic_store_n (&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+      if (__atomic_load_n (&queue->tail, __ATOMIC_SEQ_CST) != head)
+        continue;
+
+      pthread_cond_wait (&queue->cond, &queue->lock);
+    }
+
+    pthread_mutex_unlock (&queue->lock);
+  }
+
+  if ((n = tail - head) > max)
+    n = max;
+
+  for (i = 0; i < n; ++i)
+    events[i] = queue->event_list[(head + i) & (queue->size - 1)];
+
+  __atomic_store_n (&queue->head, head + n, __ATOMIC_SEQ_CST);
+
+  if (n > 0 && __atomic_load_n (&queue->waiting, __ATOMIC_SEQ_CST))
+    arm32_watchpoint_queue_wake (queue);
+
+  return n;
+}
+
+/* Next push will stop the emulation */
+void
+arm32_watchpoint_queue_request_stop (struct arm32_watchpoint_queue *queue)
+{
+  __atomic_store_n (&queue->stop, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wake up the consumer, pop will return 0 once the queue is empty */
+void
+arm32_watchpoint_queue_close (struct arm32_watchpoint_queue *queue)
+{
+  pthread_mutex_lock (&queue->lock);
+
+  queue->closed = 1;
+  pthread_cond_broadcast (&queue->cond);
+
+  pthread_mutex_unlock (&queue->lock);
+}
+
+int
+arm32_cpu_watchpoint_queue_enable (struct arm32_cpu *cpu, unsigned int size, int flags)
+{
+  struct arm32_watchpoint_queue *queue;
+
+  if (size == 0)
+    size = ARM32_WATCHPOINT_QUEUE_DEFAULT_SIZE;
+
+  if ((queue = arm32_watchpoint_queue_new (size, flags)) == NULL)
+    return -1;
+
+  arm32_cpu_watchpoint_queue_disable (cpu);
+
+  cpu->wps->queue = queue;
+
+  return 0;
+}
+
+/* The consumer thread must be done with the queue before calling this */
+void
+arm32_cpu_watchpoint_queue_disable (struct arm32_cpu *cpu)
+{
+  if (cpu->wps->queue != NULL)
+  {
+    arm32_watchpoint_queue_destroy (cpu->wps->queue);
+
+    cpu->wps->queue = NULL;
+  }
+}
+
 void
 arm32_watchpoint_set_destroy (struct arm32_watchpoint_set *wps)
 {
   int i;
 
+  if (wps->queue != NULL)
+    arm32_watchpoint_queue_destroy (wps->queue);
+
   for (i = 0; i < wps->watchpoint_count; ++i)
     if (wps->watchpoint_list[i] != NULL)
       arm32_watchpoint_destroy (wps->watchpoint_list[i]);
@@ -76,21 +284,73 @@ arm32_watchpoint_set_destroy (struct arm32_watchpoint_set *wps)
   if (wps->watchpoint_list != NULL)
     free (wps->watchpoint_list);
 
+  for (i = 0; i < wps->arena_count; ++i)
+    free (wps->arena_list[i]);
+
+  if (wps->arena_list != NULL)
+    free (wps->arena_list);
+
   free (wps);
 }
 
+/* Make room for count more entries at the end of the list */
+static int
+arm32_watchpoint_set_reserve (struct arm32_watchpoint_set *wps, int count)
+{
+  struct arm32_watchpoint **list;
+  int alloc;
+
+  if (wps->watchpoint_count + count <= wps->watchpoint_alloc)
+    return 0;
+
+  for (alloc = wps->watchpoint_alloc ? wps->watchpoint_alloc : 16; alloc < wps->watchpoint_count + count; alloc <<= 1);
+
+  if ((list = realloc (wps->watchpoint_list, alloc * sizeof (struct arm32_watchpoint *))) == NULL)
+    return -1;
+
+  wps->watchpoint_list  = list;
+  wps->watchpoint_alloc = alloc;
+
+  return 0;
+}
+
+static void
+arm32_watchpoint_set_account (struct arm32_watchpoint_set *wps, struct arm32_watchpoint *wp)
+{
+  ++wps->live_count;
+
+  if (wp->type == ARM32_WATCHPOINT_REG)
+    wps->regmask |= wp->mask;
+  else if (wp->type == ARM32_WATCHPOINT_BRANCH)
+    ++wps->branch_count;
+}
+
 int
 arm32_watchpoint_register (struct arm32_watchpoint_set *wps, struct arm32_watchpoint *wp)
 {
   int backidx;
-  
-  if ((backidx = PTR_LIST_APPEND_CHECK (wps->watchpoint, wp)) == -1)
-    return -1;
+
+  for (backidx = wps->free_hint; backidx < wps->watchpoint_count; ++backidx)
+    if (wps->watchpoint_list[backidx] == NULL)
+      break;
+
+  if (backidx == wps->watchpoint_count)
+  {
+    if (arm32_watchpoint_set_reserve (wps, 1) == -1)
+      return -1;
+
+    ++wps->watchpoint_count;
+  }
+
+  wps->watchpoint_list[backidx] = wp;
+  wps->free_hint = backidx + 1;
 
   wp->backidx = backidx;
 
-  if (wp->type == ARM32_WATCHPOINT_REG)
-    wps->regmask |= wp->mask;
+  /* delay may have been set directly, without the setter */
+  wp->countdown = wp->delay;
+
+  arm32_watchpoint_set_account (wps, wp);
 
   return 0;
 }
@@ -122,6 +382,36 @@ arm32_watchpoint_enable (struct arm32_watchpoint *wp)
   wp->enabled = 1;
 }
 
+void
+arm32_watchpoint_set_async (struct arm32_watchpoint *wp, int async)
+{
+  wp->async = async;
+}
+
+/* Ignore the first `delay' hits. After each trigger, ignore the next
+   `reset' hits (0 means trigger on every hit from then on) */
+void
+arm32_watchpoint_set_delay (struct arm32_watchpoint *wp, int delay, int reset)
+{
+  wp->delay = delay;
+  wp->reset = reset;
+
+  wp->countdown = delay;
+}
+
+uint64_t
+arm32_watchpoint_get_hits (const struct arm32_watchpoint *wp)
+{
+  return wp->hits;
+}
+
+void
+arm32_watchpoint_reset_hits (struct arm32_watchpoint *wp)
+{
+  wp->hits = 0;
+  wp->countdown = wp->delay;
+}
+
 void
 arm32_watchpoint_delete (struct arm32_watchpoint_set *wps, struct arm32_watchpoint *wp)
 {
@@ -130,8 +420,15 @@ arm32_watchpoint_delete (struct arm32_watchpoint_set *wps, struct arm32_watchpoi
 
   wps->watchpoint_list[wp->backidx] = NULL;
 
+  if (wp->backidx < wps->free_hint)
+    wps->free_hint = wp->backidx;
+
+  --wps->live_count;
+
   if (wp->type == ARM32_WATCHPOINT_REG)
     arm32_watchpoint_set_recalc_regmask (wps);
+  else if (wp->type == ARM32_WATCHPOINT_BRANCH)
+    --wps->branch_count;
   
   arm32_watchpoint_destroy (wp);
 }
@@ -168,7 +465,7 @@ arm32_cpu_watchpoint_test (struct arm32_cpu *cpu, uint32_t inst, struct arm32_wa
     wp->affected = 0;
 
     for (i = 0; i < 16; ++i)
-      if (wp->mask & i)
+      if (wp->mask & (1 << i))
 	if (REG (cpu, i) != wps->regs_saved.r[i])
 	{
 	  wp->affected |= 1 << i;
@@ -191,15 +488,77 @@ arm32_cpu_watchpoint_test (struct arm32_cpu *cpu, uint32_t inst, struct arm32_wa
     n += (inst & wp->mask) == (wp->inst & wp->mask);
     break;
 
-  case ARM32_WATCHPOINT_BRANCH:
-    n += PC (cpu) == cpu->next_pc;
-    break;
-    
   }
   
   return n;
 }
 
+static uint32_t
+arm32_cpu_watchpoint_value (struct arm32_cpu *cpu, struct arm32_watchpoint *wp, uint32_t inst)
+{
+  switch (wp->type)
+  {
+  case ARM32_WATCHPOINT_REG:
+    return wp->affected;
+
+  case ARM32_WATCHPOINT_MEMORY:
+    return *wp->cached_phys;
+
+  case ARM32_WATCHPOINT_INST:
+    return inst;
+
+  case ARM32_WATCHPOINT_BRANCH:
+    return cpu->wps->branch.to;
+  }
+
+  return 0;
+}
+
+static int
+arm32_cpu_watchpoint_trigger (struct arm32_cpu *cpu, uint32_t inst, struct arm32_watchpoint *wp, int when)
+{
+  struct arm32_watchpoint_set *set = cpu->wps;
+  struct arm32_watchpoint_event event;
+
+  if (wp->condition != NULL && !arm32_predicate_eval (cpu, wp->condition))
+    return 0;
+
+  /* Fields may be set directly after registration, too */
+  if (wp->hits++ == 0)
+    wp->countdown = wp->delay;
+
+  if (wp->countdown > 0)
+  {
+    --wp->countdown;
+
+    return 0;
+  }
+
+  wp->countdown = wp->reset;
+
+  if (wp->async && set->queue != NULL)
+  {
+    event.pc    = set->pc;
+    event.inst  = inst;
+    event.value = arm32_cpu_watchpoint_value (cpu, wp, inst);
+    event.index = wp->backidx;
+    event.type  = wp->type;
+    event.when  = when;
+    event.kind  = wp->type == ARM32_WATCHPOINT_BRANCH ? set->branch.kind : 0;
+
+    return arm32_watchpoint_queue_push (set->queue, &event);
+  }
+
+  if (wp->callback == NULL)
+  {
+    warning ("Watchpoint #%d (\"%s\") triggered, stopping execution (%s)\n", wp->backidx, wp->name, when == ARM32_WATCHPOINT_PRE_EXEC ? "pre-exec" : "post-exec");
+
+    return 1;
+  }
+
+  return (wp->callback) (cpu, wp, wp->data);
+}
+
 struct arm32_watchpoint *
 arm32_cpu_watch_branch (struct arm32_cpu *cpu, const char *name, int (*callback) (struct arm32_cpu *, struct arm32_watchpoint *, void *), void *data)
 {
@@ -218,9 +577,6 @@ arm32_cpu_watch_branch (struct arm32_cpu *cpu, const char *name, int (*callback)
     return NULL;
   }
 
-  /* Make periodical backups of reg15 */
-  cpu->wps->regmask |= 1 << 15;
-  
   return wp;
 }
 
@@ -324,6 +680,154 @@ arm32_cpu_watch_inst (struct arm32_cpu *cpu, const char *name, int (*callback) (
   return wp;
 }
 
+/* Install count watchpoints at once. All of them (and their names) are
+   allocated in a single arena, which is released along with the set. */
+int
+arm32_cpu_watch_bulk (struct arm32_cpu *cpu, const struct arm32_watchpoint_desc *desc, int count, struct arm32_watchpoint **out)
+{
+  struct arm32_watchpoint_set *wps = cpu->wps;
+  struct arm32_watchpoint *wp;
+  size_t names_size = 0;
+  char *names;
+  void *arena;
+  int i;
+
+  for (i = 0; i < count; ++i)
+    names_size += strlen (desc[i].name) + 1;
+
+  if ((arena = calloc (1, count * sizeof (struct arm32_watchpoint) + names_size)) == NULL)
+    return -1;
+
+  wp    = (struct arm32_watchpoint *) arena;
+  names = (char *) (wp + count);
+
+  for (i = 0; i < count; ++i)
+  {
+    wp[i].name = strcpy (names, desc[i].name);
+    names += strlen (desc[i].name) + 1;
+
+    wp[i].arena    = 1;
+    wp[i].enabled  = 1;
+    wp[i].type     = desc[i].type;
+    wp[i].when     = desc[i].when ? desc[i].when : ARM32_WATCHPOINT_POST_EXEC;
+    wp[i].mask     = desc[i].mask;
+    wp[i].addr     = desc[i].addr;
+    wp[i].async    = desc[i].async;
+    wp[i].callback = desc[i].callback;
+    wp[i].data     = desc[i].data;
+
+    arm32_watchpoint_set_delay (&wp[i], desc[i].delay, desc[i].reset);
+
+    if (desc[i].condition != NULL)
+      if ((wp[i].condition = arm32_predicate_compile (desc[i].condition)) == NULL)
+        goto fail;
+  }
+
+  if (arm32_watchpoint_set_reserve (wps, count) == -1)
+    goto fail;
+
+  if (PTR_LIST_APPEND_CHECK (wps->arena, arena) == -1)
+    goto fail;
+
+  /* Free slots are left for single registrations */
+  for (i = 0; i < count; ++i)
+  {
+    wp[i].backidx = wps->watchpoint_count;
+    wps->watchpoint_list[wps->watchpoint_count++] = &wp[i];
+
+    arm32_watchpoint_set_account (wps, &wp[i]);
+
+    if (out != NULL)
+      out[i] = &wp[i];
+  }
+
+  return 0;
+
+fail:
+  for (i = 0; i < count; ++i)
+    if (wp[i].condition != NULL)
+      arm32_predicate_destroy (wp[i].condition);
+
+  free (arena);
+
+  return -1;
+}
+
+/* Copy all watchpoints of src into dst, in a single arena. Hit counters
+   and cached translations are not copied. */
+int
+arm32_cpu_watchpoint_clone (struct arm32_cpu *dst, const struct arm32_cpu *src)
+{
+  struct arm32_watchpoint_set *wps = dst->wps;
+  struct arm32_watchpoint *wp, *orig;
+  size_t names_size = 0;
+  char *names;
+  void *arena;
+  int count = 0;
+  int i, j;
+
+  for (i = 0; i < src->wps->watchpoint_count; ++i)
+    if ((orig = src->wps->watchpoint_list[i]) != NULL)
+    {
+      names_size += strlen (orig->name) + 1;
+      ++count;
+    }
+
+  if (count == 0)
+    return 0;
+
+  if ((arena = calloc (1, count * sizeof (struct arm32_watchpoint) + names_size)) == NULL)
+    return -1;
+
+  wp    = (struct arm32_watchpoint *) arena;
+  names = (char *) (wp + count);
+
+  for (i = j = 0; i < src->wps->watchpoint_count; ++i)
+    if ((orig = src->wps->watchpoint_list[i]) != NULL)
+    {
+      wp[j] = *orig;
+
+      wp[j].name = strcpy (names, orig->name);
+      names += strlen (orig->name) + 1;
+
+      wp[j].arena       = 1;
+      wp[j].cached_phys = NULL;
+      wp[j].hits        = 0;
+      wp[j].countdown   = orig->delay;
+
+      if (orig->condition != NULL)
+        if ((wp[j].condition = arm32_predicate_dup (orig->condition)) == NULL)
+          goto fail;
+
+      ++j;
+    }
+
+  if (arm32_watchpoint_set_reserve (wps, count) == -1)
+    goto fail;
+
+  if (PTR_LIST_APPEND_CHECK (wps->arena, arena) == -1)
+    goto fail;
+
+  for (i = 0; i < count; ++i)
+  {
+    wp[i].backidx = wps->watchpoint_count;
+    wps->watchpoint_list[wps->watchpoint_count++] = &wp[i];
+
+    arm32_watchpoint_set_account (wps, &wp[i]);
+  }
+
+  return 0;
+
+fail:
+  for (i = 0; i < j; ++i)
+    if (wp[i].condition != NULL)
+      arm32_predicate_destroy (wp[i].condition);
+
+  free (arena);
+
+  return -1;
+}
+
 int
 arm32_cpu_watchpoint_set_test_pre (struct arm32_cpu *cpu, uint32_t inst)
 {
@@ -331,6 +835,12 @@ arm32_cpu_watchpoint_set_test_pre (struct arm32_cpu *cpu, uint32_t inst)
   struct arm32_watchpoint_set *set = cpu->wps;
   uint16_t regmask = set->regmask;
 
+  set->pc = PC (cpu) - 8;
+
+  /* Only branch watchpoints, these are tested on block exits */
+  if (set->live_count == set->branch_count)
+    return 0;
+
   if (regmask)
     for (i = 0; i < 16; ++i)
       if (regmask & (1 << i))
@@ -344,19 +854,14 @@ arm32_cpu_watchpoint_set_test_pre (struct arm32_cpu *cpu, uint32_t inst)
       case ARM32_WATCHPOINT_MEMORY:
 	arm32_cpu_watchpoint_memory_pre (cpu, set->watchpoint_list[i]);
 	break;
+
+      case ARM32_WATCHPOINT_BRANCH:
+	continue;
       }
 
       if ((set->watchpoint_list[i]->when & ARM32_WATCHPOINT_PRE_EXEC) && arm32_cpu_watchpoint_test (cpu, inst, set->watchpoint_list[i]))
-      {
-	if (set->watchpoint_list[i]->callback == NULL)
-	{
-	  warning ("Watchpoint #%d (\"%s\") triggered, stopping execution (pre-exec)\n");
-	  
+	if (arm32_cpu_watchpoint_trigger (cpu, inst, set->watchpoint_list[i], ARM32_WATCHPOINT_PRE_EXEC))
 	  return 1;
-	}
-	else if ((set->watchpoint_list[i]->callback) (cpu, set->watchpoint_list[i], set->watchpoint_list[i]->data))
-	  return 1;
-      }
     }
   
   return 0;
@@ -369,20 +874,64 @@ arm32_cpu_watchpoint_set_test_post (struct arm32_cpu *cpu, uint32_t inst)
 
   struct arm32_watchpoint_set *set = cpu->wps;
 
+  if (set->live_count == set->branch_count)
+    return 0;
+
   for (i = 0; i < set->watchpoint_count; ++i)
     if (set->watchpoint_list[i] != NULL && set->watchpoint_list[i]->enabled)    
       if ((set->watchpoint_list[i]->when & ARM32_WATCHPOINT_POST_EXEC) && arm32_cpu_watchpoint_test (cpu, inst, set->watchpoint_list[i]))
-      {
-	if (set->watchpoint_list[i]->callback == NULL)
-	{
-	  warning ("Watchpoint #%d (\"%s\") triggered, stopping execution (post-exec)\n");
-	  
-	  return 1;
-	}
-	else if ((set->watchpoint_list[i]->callback) (cpu, set->watchpoint_list[i], set->watchpoint_list[i]->data))
+	if (arm32_cpu_watchpoint_trigger (cpu, inst, set->watchpoint_list[i], ARM32_WATCHPOINT_POST_EXEC))
 	  return 1;
-      }
     
   
   return 0;
 }
+
+static int
+arm32_branch_kind (uint32_t inst)
+{
+  /* B / BL */
+  if ((inst & 0x0e000000) == 0x0a000000)
+    return (inst & (1 << 24)) ? ARM32_BRANCH_CALL : ARM32_BRANCH_JUMP;
+
+  /* BLX Rm */
+  if ((inst & 0x0ffffff0) == 0x012fff30)
+    return ARM32_BRANCH_CALL;
+
+  /* BX LR, MOV PC, LR */
+  if ((inst & 0x0fffffff) == 0x012fff1e || (inst & 0x0fffffff) == 0x01a0f00e)
+    return ARM32_BRANCH_RETURN;
+
+  /* LDM SP, {..., PC} and LDR PC, [SP] */
+  if (((inst & 0x0e108000) == 0x08108000 || (inst & 0x0c10f000) == 0x0410f000) && UINT32_GET_FIELD (inst, 16, 4) == 13)
+    return ARM32_BRANCH_RETURN;
+
+  return ARM32_BRANCH_INDIRECT;
+}
+
+/* Called on block exits only: from is the address of the instruction
+   that jumped. Hooks leaving through the trampoline are hook returns. */
+int
+arm32_cpu_watchpoint_set_test_branch (struct arm32_cpu *cpu, uint32_t inst, uint32_t from, int hook)
+{
+  int i;
+  struct arm32_watchpoint_set *set = cpu->wps;
+
+  set->pc = from;
+
+  set->branch.from = from;
+  set->branch.to   = cpu->next_pc;
+
+  if (hook)
+    set->branch.kind = cpu->next_pc == LR (cpu) ? ARM32_BRANCH_RETURN : ARM32_BRANCH_INDIRECT;
+  else
+    set->branch.kind = arm32_branch_kind (inst);
+
+  for (i = 0; i < set->watchpoint_count; ++i)
+    if (set->watchpoint_list[i] != NULL && set->watchpoint_list[i]->enabled)
+      if (set->watchpoint_list[i]->type == ARM32_WATCHPOINT_BRANCH)
+	if (arm32_cpu_watchpoint_trigger (cpu, inst, set->watchpoint_list[i], ARM32_WATCHPOINT_POST_EXEC))
+	  return 1;
+
+  return 0;
+}